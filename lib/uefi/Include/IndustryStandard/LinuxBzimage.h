@@ -15,6 +15,8 @@
 #define E820_NVS		4
 #define E820_UNUSABLE		5
 
+#define XLF_CAN_BE_LOADED_ABOVE_4G	(1<<1)
+
 #pragma pack(1)
 
 struct setup_header {
@@ -126,7 +128,10 @@ struct boot_params {
 	UINT8 hd1_info[16];
 	UINT8 sys_desc_table[0x10];
 	UINT8 olpc_ofw_header[0x10];
-	UINT8 _pad4[128];
+	UINT32 ext_ramdisk_image;
+	UINT32 ext_ramdisk_size;
+	UINT32 ext_cmd_line_ptr;
+	UINT8 _pad4[116];
 	UINT8 edid_info[0x80];
 	struct efi_info efi_info;
 	UINT32 alt_mem_k;
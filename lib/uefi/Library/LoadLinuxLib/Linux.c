@@ -431,6 +431,8 @@ LoadLinuxSetInitrd (
 
   Bp->hdr.ramdisk_start = (UINT32)(UINTN) Initrd;
   Bp->hdr.ramdisk_len = (UINT32) InitrdSize;
+  Bp->ext_ramdisk_image = (UINT32)RShiftU64 ((UINTN) Initrd, 32);
+  Bp->ext_ramdisk_size = (UINT32)RShiftU64 (InitrdSize, 32);
 
   return EFI_SUCCESS;
 }
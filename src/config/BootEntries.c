@@ -2,6 +2,8 @@
 #include "BootConfig.h"
 
 #include <util/FileUtils.h>
+#include <util/PartitionIndex.h>
+#include <util/Timeline.h>
 #include <util/Except.h>
 
 #include <Uefi.h>
@@ -15,7 +17,8 @@
 #include <util/DPUtils.h>
 #include <Library/BaseMemoryLib.h>
 
-#define CHECK_OPTION(x) (StrnCmp(Line, x L"=", ARRAY_SIZE(x)) == 0)
+#define CHECK_OPTION(x) (AsciiStrnCmp(Line, x "=", sizeof(x)) == 0)
+#define OPTION_VALUE(Line) (AsciiStrStr(Line, "=") + 1)
 
 BOOT_ENTRY* gDefaultEntry = NULL;
 LIST_ENTRY gBootEntries = INITIALIZE_LIST_HEAD_VARIABLE(gBootEntries);
@@ -40,31 +43,166 @@ BOOT_ENTRY* GetBootEntryAt(int index) {
     return NULL;
 }
 
-static CHAR16* CopyString(CHAR16* String) {
-    return AllocateCopyPool((1 + StrLen(String)) * sizeof(CHAR16), String);
+/**
+ * Decode a single utf8 character, invalid sequences are taken as latin1
+ * and anything outside of the BMP is replaced since we can only store UCS-2
+ */
+static CHAR16 DecodeUtf8(CHAR8** String) {
+    UINT8* C = (UINT8*)*String;
+
+    if (C[0] >= 0xC0 && C[0] < 0xE0 && (C[1] & 0xC0) == 0x80) {
+        *String += 2;
+        return (CHAR16)(((C[0] & 0x1F) << 6) | (C[1] & 0x3F));
+    } else if (C[0] >= 0xE0 && C[0] < 0xF0 && (C[1] & 0xC0) == 0x80 && (C[2] & 0xC0) == 0x80) {
+        *String += 3;
+        return (CHAR16)(((C[0] & 0x0F) << 12) | ((C[1] & 0x3F) << 6) | (C[2] & 0x3F));
+    } else if (C[0] >= 0xF0 && C[0] < 0xF8 && (C[1] & 0xC0) == 0x80 && (C[2] & 0xC0) == 0x80 && (C[3] & 0xC0) == 0x80) {
+        *String += 4;
+        return L'?';
+    }
+
+    *String += 1;
+    return C[0];
 }
 
-static EFI_STATUS ParseUri(CHAR16* Uri, EFI_SIMPLE_FILE_SYSTEM_PROTOCOL** OutFs, CHAR16** OutPath) {
+static CHAR16* CopyString(CHAR8* String) {
+    // the utf16 string can never have more characters than the utf8 one has bytes
+    CHAR16* Copy = AllocatePool((1 + AsciiStrLen(String)) * sizeof(CHAR16));
+    if (Copy == NULL) {
+        return NULL;
+    }
+
+    CHAR16* Out = Copy;
+    while (*String != '\0') {
+        *Out++ = DecodeUtf8(&String);
+    }
+    *Out = CHAR_NULL;
+
+    return Copy;
+}
+
+/**
+ * Config files saved as UCS-2 (with a BOM) are converted to utf8 so the rest
+ * of the parser only ever deals with a single encoding, a utf8 BOM is skipped
+ */
+static EFI_STATUS NormalizeConfigEncoding(CHAR8** Config, UINTN* ConfigSize, CHAR8** Start) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8* Data = (UINT8*)*Config;
+
+    *Start = *Config;
+
+    if (*ConfigSize >= 3 && Data[0] == 0xEF && Data[1] == 0xBB && Data[2] == 0xBF) {
+        *Start += 3;
+    } else if (*ConfigSize >= 2 && Data[0] == 0xFF && Data[1] == 0xFE) {
+        CHAR16* Wide = (CHAR16*)(Data + 2);
+        UINTN WideCount = (*ConfigSize - 2) / sizeof(CHAR16);
+
+        // every ucs2 character takes at most 3 bytes in utf8
+        UINT8* Utf8 = AllocatePool(WideCount * 3 + 1);
+        CHECK_ERROR(Utf8 != NULL, EFI_OUT_OF_RESOURCES);
+
+        UINT8* Out = Utf8;
+        for (UINTN i = 0; i < WideCount; i++) {
+            CHAR16 C = Wide[i];
+            if (C < 0x80) {
+                *Out++ = (UINT8)C;
+            } else if (C < 0x800) {
+                *Out++ = 0xC0 | (C >> 6);
+                *Out++ = 0x80 | (C & 0x3F);
+            } else {
+                *Out++ = 0xE0 | (C >> 12);
+                *Out++ = 0x80 | ((C >> 6) & 0x3F);
+                *Out++ = 0x80 | (C & 0x3F);
+            }
+        }
+        *Out = '\0';
+
+        FreePool(*Config);
+        *Config = (CHAR8*)Utf8;
+        *ConfigSize = Out - Utf8;
+        *Start = *Config;
+    }
+
+cleanup:
+    return Status;
+}
+
+/**
+ * Tokenize the next line in place, the line is null terminated
+ * and all the carriage returns are removed from it
+ */
+static CHAR8* NextConfigLine(CHAR8** Cursor, CHAR8* End) {
+    CHAR8* Line = *Cursor;
+    CHAR8* Out = Line;
+    CHAR8* C = Line;
+
+    for (; C < End && *C != '\n' && *C != '\0'; C++) {
+        if (*C != '\r') {
+            *Out++ = *C;
+        }
+    }
+    *Out = '\0';
+
+    *Cursor = C + 1;
+    return Line;
+}
+
+/**
+ * Parse a size with an optional K, M or G suffix, returns 0 if it is invalid
+ */
+static UINT64 ParseSize(CHAR8* String) {
+    CHAR8* End = NULL;
+    UINT64 Size = 0;
+    if (EFI_ERROR(AsciiStrDecimalToUint64S(String, &End, &Size)) || End == String) {
+        return 0;
+    }
+
+    switch (*End) {
+        case 'K': case 'k': Size = LShiftU64(Size, 10); End++; break;
+        case 'M': case 'm': Size = LShiftU64(Size, 20); End++; break;
+        case 'G': case 'g': Size = LShiftU64(Size, 30); End++; break;
+        default: break;
+    }
+
+    return *End == '\0' ? Size : 0;
+}
+
+/**
+ * Parse a placement region, returns FALSE if it is invalid
+ */
+static BOOLEAN ParsePlacementRegion(CHAR8* String, PLACEMENT_REGION* Region) {
+    if (AsciiStrCmp(String, "default") == 0) {
+        *Region = PLACEMENT_DEFAULT;
+    } else if (AsciiStrCmp(String, "low") == 0) {
+        *Region = PLACEMENT_LOW;
+    } else if (AsciiStrCmp(String, "high") == 0) {
+        *Region = PLACEMENT_HIGH;
+    } else {
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static EFI_STATUS ParseUri(CHAR8* Uri, EFI_SIMPLE_FILE_SYSTEM_PROTOCOL** OutFs, CHAR16** OutPath) {
     EFI_STATUS Status = EFI_SUCCESS;
-    EFI_LOADED_IMAGE_PROTOCOL* LoadedImage = NULL;
-    EFI_DEVICE_PATH* BootDevicePath = NULL;
-    EFI_HANDLE* Handles = NULL;
-    UINTN HandleCount = 0;
 
     CHECK(Uri != NULL);
     CHECK(OutFs != NULL);
     CHECK(OutPath != NULL);
 
     // separate the domain from the uri type
-    CHAR16* Root = StrStr(Uri, L":");
-    *Root = L'\0';
+    CHAR8* Root = AsciiStrStr(Uri, "://");
+    CHECK_TRACE(Root != NULL, "Invalid uri `%a`", Uri);
+    *Root = '\0';
     Root += 3; // skip ://
 
     // create the path itself
-    CHAR16* Path = StrStr(Root, L"/");
-    *Path = L'\0';
+    CHAR8* Path = AsciiStrStr(Root, "/");
+    CHECK_TRACE(Path != NULL, "Missing path in uri `%a://%a`", Uri, Root);
+    *Path = '\0';
     Path++; // skip the /
     *OutPath = CopyString(Path);
+    CHECK_ERROR(*OutPath != NULL, EFI_OUT_OF_RESOURCES);
 
     // convert `/` to `\` for uefi
     for (CHAR16* C = *OutPath; *C != CHAR_NULL; C++) {
@@ -74,125 +212,36 @@ static EFI_STATUS ParseUri(CHAR16* Uri, EFI_SIMPLE_FILE_SYSTEM_PROTOCOL** OutFs,
     }
 
     // check the uri
-    if (StrCmp(Uri, L"boot") == 0) {
+    if (AsciiStrCmp(Uri, "boot") == 0) {
         // boot://[<part num>]/
 
-        if (*Root == L'\0') {
+        if (*Root == '\0') {
             // the part num is missing, use
             // the boot fs so there is nothing
             // to do here really
         } else {
             // this has a part num, get it
-            UINTN PartNum = StrDecimalToUintn(Root);
-
-            // we need the boot drive device path so we can check the filesystems
-            // are on the same drive
-            EFI_CHECK(gBS->HandleProtocol(gImageHandle, &gEfiLoadedImageProtocolGuid, (void**)&LoadedImage));
-            EFI_CHECK(gBS->HandleProtocol(LoadedImage->DeviceHandle, &gEfiDevicePathProtocolGuid, (void**)&BootDevicePath));
-
-            // remove the last part which should be the partition itself
-
-            BootDevicePath = RemoveLastDevicePathNode(BootDevicePath);
-            CHECK(BootDevicePath != NULL);
-
-            CHAR16* Text = ConvertDevicePathToText(BootDevicePath, TRUE, TRUE);
-            TRACE("Boot device path: %s", Text);
-            FreePool(Text);
-
-            // iterate the protocols
-            EFI_CHECK(gBS->LocateHandleBuffer(ByProtocol, &gEfiSimpleFileSystemProtocolGuid, NULL, &HandleCount, &Handles));
-            int index = -1;
-            for (int i = 0; i < HandleCount; i++) {
-                EFI_DEVICE_PATH* DevicePath = NULL;
-                EFI_CHECK(gBS->HandleProtocol(Handles[i], &gEfiDevicePathProtocolGuid, (void**)&DevicePath));
-
-                Text = ConvertDevicePathToText(DevicePath, TRUE, TRUE);
-                TRACE("Testing against filesystem at %s", Text);
-                FreePool(Text);
-
-                // check this is part of the same drive
-                if (!InsideDevicePath(DevicePath, BootDevicePath)) {
-                    // skip this entry
-                    WARN("This is not on the same drive, next");
-                    continue;
-                }
+            UINTN PartNum = AsciiStrDecimalToUintn(Root);
 
-                // get the last one, and make sure it is of
-                // a harddrive part, since we are looking for
-                // partitions
-                DevicePath = LastDevicePathNode(DevicePath);
-                if (DevicePathType(DevicePath) != MEDIA_DEVICE_PATH || DevicePathSubType(DevicePath) != MEDIA_HARDDRIVE_DP) {
-                    // skip it
-                    WARN("The last node is not a harddrive :(");
-                    continue;
-                }
-
-                // we found one which might be valid! check it
-                HARDDRIVE_DEVICE_PATH* Hd = (HARDDRIVE_DEVICE_PATH*)DevicePath;
-                if (Hd->PartitionNumber == PartNum) {
-                    // we freaking found it!
-                    index = i;
-                    break;
-                }
-            }
-
-            // make sure we found it
-            CHECK_TRACE(index != -1, "Could not find partition number `%d`", PartNum);
-
-            // get the fs and set it
-            EFI_CHECK(gBS->HandleProtocol(Handles[index], &gEfiSimpleFileSystemProtocolGuid, (void**)OutFs));
+            // get the fs from the index
+            *OutFs = GetBootDrivePartitionFs(PartNum);
+            CHECK_TRACE(*OutFs != NULL, "Could not find partition number `%d`", PartNum);
         }
-    } else if (StrCmp(Uri, L"guid") == 0 || StrCmp(Uri, L"uuid") == 0) {
+    } else if (AsciiStrCmp(Uri, "guid") == 0 || AsciiStrCmp(Uri, "uuid") == 0) {
         // guid://<guid>/
 
         // parse the guid
         EFI_GUID Guid;
-        EFI_CHECK(StrToGuid(Root, &Guid));
-
-        // iterate the protocols
-        EFI_CHECK(gBS->LocateHandleBuffer(ByProtocol, &gEfiSimpleFileSystemProtocolGuid, NULL, &HandleCount, &Handles));
-        int index = -1;
-        for (int i = 0; i < HandleCount; i++) {
-            EFI_DEVICE_PATH* DevicePath = NULL;
-            EFI_CHECK(gBS->HandleProtocol(Handles[i], &gEfiDevicePathProtocolGuid, (void**)&DevicePath));
-
-            // get the last one, and make sure it is of
-            // a harddrive part, since we are looking for
-            // partitions
-            DevicePath = LastDevicePathNode(DevicePath);
-            if (DevicePathType(DevicePath) != MEDIA_DEVICE_PATH || DevicePathSubType(DevicePath) != MEDIA_HARDDRIVE_DP) {
-                // skip it
-                continue;
-            }
-
-            // we found one which might be valid! check that it is a gpt partition (important)
-            // and that it matches the signature
-            HARDDRIVE_DEVICE_PATH* Hd = (HARDDRIVE_DEVICE_PATH*)DevicePath;
-            if (Hd->SignatureType == SIGNATURE_TYPE_GUID && CompareGuid(&Guid, (EFI_GUID*)Hd->Signature)) {
-                // we freaking found it!
-                index = i;
-                break;
-            }
-        }
-
-        // make sure we found it
-        CHECK_TRACE(index != -1, "Could not find partition or fs with guid of `%s`", Root);
+        EFI_CHECK(AsciiStrToGuid(Root, &Guid));
 
-        // get the fs from the guid
-        EFI_CHECK(gBS->HandleProtocol(Handles[index], &gEfiSimpleFileSystemProtocolGuid, (void**)OutFs));
+        // get the fs from the index
+        *OutFs = GetPartitionFsByGuid(&Guid);
+        CHECK_TRACE(*OutFs != NULL, "Could not find partition or fs with guid of `%a`", Root);
     } else {
-        CHECK_FAIL_TRACE("Unsupported resource type `%s`", Uri);
+        CHECK_FAIL_TRACE("Unsupported resource type `%a`", Uri);
     }
 
 cleanup:
-    if (Handles != NULL) {
-        FreePool(Handles);
-    }
-
-    if (BootDevicePath != NULL) {
-        FreePool(BootDevicePath);
-    }
-
     return Status;
 }
 
@@ -200,6 +249,8 @@ static EFI_STATUS LoadBootEntries(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FS, LIST_ENTR
     EFI_STATUS Status = EFI_SUCCESS;
     EFI_FILE_PROTOCOL* root = NULL;
     EFI_FILE_PROTOCOL* file = NULL;
+    CHAR8* Config = NULL;
+    UINTN ConfigSize = 0;
 
     // open the configurations
     CHECK(FS != NULL);
@@ -219,26 +270,26 @@ static EFI_STATUS LoadBootEntries(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FS, LIST_ENTR
         goto cleanup;
     }
 
+    // read the whole config at once, the firmware is slow enough
+    // as is so we don't want to go to it for every line
+    CHAR8* Cursor = NULL;
+    CHECK_AND_RETHROW(FileReadAll(file, (void**)&Config, &ConfigSize));
+    CHECK_AND_RETHROW(NormalizeConfigEncoding(&Config, &ConfigSize, &Cursor));
+    CHAR8* ConfigEnd = Config + ConfigSize;
+
     // Start from a clean state
     *Head = (LIST_ENTRY)INITIALIZE_LIST_HEAD_VARIABLE(*Head);
     BOOT_ENTRY* CurrentEntry = NULL;
     BOOT_MODULE* CurrentModuleString = NULL;
 
     // now do the actual processing of everything
-    while(TRUE) {
-        CHAR16 Line[255] = {0};
-        UINTN LineSize = sizeof(Line);
-        BOOLEAN Ascii = TRUE;
-
-        if (FileHandleEof(file)) {
-            break;
-        }
-        EFI_CHECK(FileHandleReadLine(file, Line, &LineSize, FALSE, &Ascii));
+    while (Cursor < ConfigEnd) {
+        CHAR8* Line = NextConfigLine(&Cursor, ConfigEnd);
 
         //------------------------------------------
         // New entry
         //------------------------------------------
-        if (Line[0] == L':') {
+        if (Line[0] == ':') {
             // got new entry (this is the name)
             CurrentEntry = AllocateZeroPool(sizeof(BOOT_ENTRY));
             CurrentEntry->Protocol = BOOT_STIVALE;
@@ -256,12 +307,14 @@ static EFI_STATUS LoadBootEntries(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FS, LIST_ENTR
         // Global keys
         //------------------------------------------
         } else if (CurrentEntry == NULL) {
-            if (CHECK_OPTION(L"TIMEOUT")) {
-                gBootConfigOverride.BootDelay = (INT32)StrDecimalToUintn(StrStr(Line, L"=") + 1);
-            } else if (CHECK_OPTION(L"DEFAULT_ENTRY")) {
-                gBootConfigOverride.DefaultOS = (INT32)StrDecimalToUintn(StrStr(Line, L"=") + 1);
+            if (CHECK_OPTION("TIMEOUT")) {
+                gBootConfigOverride.BootDelay = (INT32)AsciiStrDecimalToUintn(OPTION_VALUE(Line));
+            } else if (CHECK_OPTION("DEFAULT_ENTRY")) {
+                gBootConfigOverride.DefaultOS = (INT32)AsciiStrDecimalToUintn(OPTION_VALUE(Line));
+            } else if (CHECK_OPTION("READ_QUEUE_DEPTH")) {
+                gFileReadQueueDepth = AsciiStrDecimalToUintn(OPTION_VALUE(Line));
             } else {
-                WARN("Invalid line `%s`, ignoring", Line);
+                WARN("Invalid line `%a`, ignoring", Line);
             }
 
         //------------------------------------------
@@ -272,38 +325,64 @@ static EFI_STATUS LoadBootEntries(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FS, LIST_ENTR
             //------------------------------------------
             // path of the kernel
             //------------------------------------------
-            if(CHECK_OPTION(L"PATH") || CHECK_OPTION(L"KERNEL_PATH")) {
-                CHAR16* Path = StrStr(Line, L"=") + 1;
+            if(CHECK_OPTION("PATH") || CHECK_OPTION("KERNEL_PATH")) {
+                CHAR8* Path = OPTION_VALUE(Line);
                 CHECK_AND_RETHROW(ParseUri(Path, &CurrentEntry->Fs, &CurrentEntry->Path));
 
             //------------------------------------------
             // command line arguments
             //------------------------------------------
-            }else if(CHECK_OPTION(L"CMDLINE") || CHECK_OPTION(L"KERNEL_CMDLINE")) {
-                CurrentEntry->Cmdline = CopyString(StrStr(Line, L"=") + 1);
+            }else if(CHECK_OPTION("CMDLINE") || CHECK_OPTION("KERNEL_CMDLINE")) {
+                CurrentEntry->Cmdline = CopyString(OPTION_VALUE(Line));
 
                 // the boot protocol to use (onyl one)
-            } else if(CHECK_OPTION(L"PROTOCOL") || CHECK_OPTION("KERNEL_PROTO") || CHECK_OPTION("KERNEL_PROTOCOL")) {
-                CHAR16* Protocol = StrStr(Line, L"=") + 1;
+            } else if(CHECK_OPTION("PROTOCOL") || CHECK_OPTION("KERNEL_PROTO") || CHECK_OPTION("KERNEL_PROTOCOL")) {
+                CHAR8* Protocol = OPTION_VALUE(Line);
 
                 // check the options
-                if (StrCmp(Protocol, L"linux") == 0) {
+                if (AsciiStrCmp(Protocol, "linux") == 0) {
                     CurrentEntry->Protocol = BOOT_LINUX;
-                } else if (StrCmp(Protocol, L"mb2") == 0) {
+                } else if (AsciiStrCmp(Protocol, "mb2") == 0) {
                     CurrentEntry->Protocol = BOOT_MB2;
-                } else if (StrCmp(Protocol, L"stivale") == 0) {
+                } else if (AsciiStrCmp(Protocol, "stivale") == 0) {
                     CurrentEntry->Protocol = BOOT_STIVALE;
-                } else if (StrCmp(Protocol, L"stivale2") == 0) {
+                } else if (AsciiStrCmp(Protocol, "stivale2") == 0) {
                     CurrentEntry->Protocol = BOOT_STIVALE2;
                 } else {
-                    CHECK_FAIL_TRACE("Unknown protocol `%s` for option `%s`", Protocol, CurrentEntry->Name);
+                    CHECK_FAIL_TRACE("Unknown protocol `%a` for option `%s`", Protocol, CurrentEntry->Name);
+                }
+
+            //------------------------------------------
+            // module placement
+            //------------------------------------------
+            } else if (CHECK_OPTION("PLACEMENT_ALIGN")) {
+                UINT64 Alignment = ParseSize(OPTION_VALUE(Line));
+                if (Alignment >= EFI_PAGE_SIZE && Alignment <= SIZE_1GB && (Alignment & (Alignment - 1)) == 0) {
+                    CurrentEntry->Placement.Alignment = (UINTN)Alignment;
+                } else {
+                    WARN("Invalid alignment `%a`, must be a power of two between 4K and 1G", OPTION_VALUE(Line));
+                }
+
+            } else if (CHECK_OPTION("PLACEMENT_NODE")) {
+                CHAR8* End = NULL;
+                UINT64 Domain = 0;
+                if (!EFI_ERROR(AsciiStrDecimalToUint64S(OPTION_VALUE(Line), &End, &Domain)) && End != OPTION_VALUE(Line) && *End == '\0' && Domain < MAX_UINT32) {
+                    CurrentEntry->Placement.HasDomain = TRUE;
+                    CurrentEntry->Placement.Domain = (UINT32)Domain;
+                } else {
+                    WARN("Invalid NUMA node `%a`", OPTION_VALUE(Line));
+                }
+
+            } else if (CHECK_OPTION("PLACEMENT_REGION")) {
+                if (!ParsePlacementRegion(OPTION_VALUE(Line), &CurrentEntry->Placement.Region)) {
+                    WARN("Invalid placement region `%a`, must be one of default, low or high", OPTION_VALUE(Line));
                 }
 
             //------------------------------------------
             // module
             //------------------------------------------
-            } else if (CHECK_OPTION(L"MODULE_PATH")) {
-                CHAR16* Path = StrStr(Line, L"=") + 1;
+            } else if (CHECK_OPTION("MODULE_PATH")) {
+                CHAR8* Path = OPTION_VALUE(Line);
 
                 BOOT_MODULE* Module = AllocateZeroPool(sizeof(BOOT_MODULE));
                 Module->Fs = FS;
@@ -316,7 +395,16 @@ static EFI_STATUS LoadBootEntries(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FS, LIST_ENTR
                     CurrentModuleString = Module;
                 }
 
-            } else if (CHECK_OPTION(L"MODULE_STRING")) {
+            } else if (CHECK_OPTION("MODULE_PLACEMENT")) {
+                CHECK_TRACE(!IsListEmpty(&CurrentEntry->BootModules), "MODULE_PLACEMENT must only appear after a MODULE_PATH");
+
+                // applies to the module right before it
+                BOOT_MODULE* Module = BASE_CR(CurrentEntry->BootModules.BackLink, BOOT_MODULE, Link);
+                if (!ParsePlacementRegion(OPTION_VALUE(Line), &Module->Region)) {
+                    WARN("Invalid placement region `%a`, must be one of default, low or high", OPTION_VALUE(Line));
+                }
+
+            } else if (CHECK_OPTION("MODULE_STRING")) {
                 CHECK_TRACE(
                         CurrentEntry->Protocol == BOOT_MB2 ||
                         CurrentEntry->Protocol == BOOT_STIVALE ||
@@ -325,7 +413,7 @@ static EFI_STATUS LoadBootEntries(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FS, LIST_ENTR
                 CHECK_TRACE(CurrentModuleString != NULL, "MODULE_STRING must only appear after a MODULE_PATH");
 
                 // set the tag
-                CurrentModuleString->Tag = CopyString(StrStr(Line, L"=") + 1);
+                CurrentModuleString->Tag = CopyString(OPTION_VALUE(Line));
 
                 // next
                 if (IsNodeAtEnd(&CurrentEntry->BootModules, &CurrentModuleString->Link)) {
@@ -338,6 +426,10 @@ static EFI_STATUS LoadBootEntries(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FS, LIST_ENTR
     }
 
 cleanup:
+    if (Config != NULL) {
+        FreePool(Config);
+    }
+
     if (file != NULL) {
         FileHandleClose(file);
     }
@@ -364,8 +456,15 @@ EFI_STATUS GetBootEntries(LIST_ENTRY* Head) {
     EFI_CHECK(gBS->LocateDevicePath(&gEfiSimpleFileSystemProtocolGuid, &BootDevicePath, &FsHandle));
     EFI_CHECK(gBS->HandleProtocol(FsHandle, &gEfiSimpleFileSystemProtocolGuid, (void**)&BootFs));
 
+    // index the partitions once so the uris can be resolved quickly
+    UINTN Phase = TimelineBegin("uri index");
+    CHECK_AND_RETHROW(InitPartitionIndex());
+    TimelineEnd(Phase);
+
     // try to load a config from it
+    Phase = TimelineBegin("config parse");
     CHECK_AND_RETHROW(LoadBootEntries(BootFs, Head));
+    TimelineEnd(Phase);
 
 cleanup:
     return Status;
@@ -12,13 +12,44 @@ typedef enum _BOOT_PROTOCOL {
     BOOT_STIVALE2,
 } BOOT_PROTOCOL;
 
+/**
+ * Which part of the memory a module is placed in
+ */
+typedef enum _PLACEMENT_REGION {
+    // whatever the boot protocol prefers
+    PLACEMENT_DEFAULT,
+
+    // below 4GB
+    PLACEMENT_LOW,
+
+    // above 4GB when there is memory there, keeps the low memory free
+    PLACEMENT_HIGH,
+} PLACEMENT_REGION;
+
 typedef struct _BOOT_MODULE {
     LIST_ENTRY Link;
     EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Fs;
     CHAR16* Path;
     CHAR16* Tag;
+    PLACEMENT_REGION Region;
 } BOOT_MODULE;
 
+/**
+ * Where the loader places the modules of an entry
+ */
+typedef struct _PLACEMENT_POLICY {
+    // the wanted alignment of modules and relocatable kernels, 0 for page aligned
+    UINTN Alignment;
+
+    // the region of the modules that don't have one of their own
+    PLACEMENT_REGION Region;
+
+    // the NUMA proximity domain to place things in, without one
+    // the domain of the cpu we are running on is used
+    BOOLEAN HasDomain;
+    UINT32 Domain;
+} PLACEMENT_POLICY;
+
 typedef struct _BOOT_ENTRY {
     BOOT_PROTOCOL Protocol;
     CHAR16* Name;
@@ -26,6 +57,7 @@ typedef struct _BOOT_ENTRY {
     CHAR16* Path;
     CHAR16* Cmdline;
     LIST_ENTRY BootModules;
+    PLACEMENT_POLICY Placement;
     LIST_ENTRY Link;
 } BOOT_ENTRY;
 
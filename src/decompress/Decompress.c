@@ -0,0 +1,164 @@
+#include "Decompress.h"
+
+#include <util/Except.h>
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+COMPRESSION_FORMAT DetectCompression(UINT8* Head, UINTN HeadSize) {
+    if (HeadSize >= 3 && Head[0] == 0x1F && Head[1] == 0x8B && Head[2] == 0x08) {
+        return COMPRESSION_GZIP;
+    }
+
+    if (HeadSize >= 4) {
+        UINT32 Magic = ReadUnaligned32((UINT32*)Head);
+        if (Magic == 0x184D2204 || Magic == 0x184C2102) {
+            return COMPRESSION_LZ4;
+        } else if (Magic == 0xFD2FB528) {
+            return COMPRESSION_ZSTD;
+        }
+    }
+
+    return COMPRESSION_NONE;
+}
+
+UINT64 GetDecompressedSize(COMPRESSION_FORMAT Format, UINT8* Head, UINTN HeadSize, UINT8* Tail) {
+    switch (Format) {
+        case COMPRESSION_GZIP:
+            // the size modulo 4GB of the last member, which is all we
+            // can get without going over the whole file
+            return Tail != NULL ? ReadUnaligned32((UINT32*)Tail) : 0;
+
+        case COMPRESSION_LZ4: {
+            // legacy frames never have it, the normal ones
+            // have it right after the flags if present
+            if (HeadSize < 14 || ReadUnaligned32((UINT32*)Head) != 0x184D2204 || (Head[4] & BIT3) == 0) {
+                return 0;
+            }
+            return ReadUnaligned64((UINT64*)(Head + 6));
+        }
+
+        case COMPRESSION_ZSTD: {
+            static UINT8 DictIdSizes[] = { 0, 1, 2, 4 };
+            if (HeadSize < 5) {
+                return 0;
+            }
+
+            UINT8 Descriptor = Head[4];
+            BOOLEAN SingleSegment = (Descriptor & BIT5) != 0;
+            UINTN Offset = 5 + (SingleSegment ? 0 : 1) + DictIdSizes[Descriptor & 3];
+            switch (Descriptor >> 6) {
+                case 0: return (SingleSegment && Offset + 1 <= HeadSize) ? Head[Offset] : 0;
+                case 1: return Offset + 2 <= HeadSize ? ReadUnaligned16((UINT16*)(Head + Offset)) + 256 : 0;
+                case 2: return Offset + 4 <= HeadSize ? ReadUnaligned32((UINT32*)(Head + Offset)) : 0;
+                default: return Offset + 8 <= HeadSize ? ReadUnaligned64((UINT64*)(Head + Offset)) : 0;
+            }
+        }
+
+        default:
+            return 0;
+    }
+}
+
+EFI_STATUS Decompress(COMPRESSION_FORMAT Format, DECOMPRESS_STREAM* Stream) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK(Stream != NULL);
+    CHECK(Stream->Read != NULL);
+    CHECK(Stream->In != NULL && Stream->InCapacity != 0);
+
+    switch (Format) {
+        case COMPRESSION_GZIP: CHECK_AND_RETHROW(GzipDecompress(Stream)); break;
+        case COMPRESSION_LZ4: CHECK_AND_RETHROW(Lz4Decompress(Stream)); break;
+        case COMPRESSION_ZSTD: CHECK_AND_RETHROW(ZstdDecompress(Stream)); break;
+        default: CHECK_FAIL_TRACE("Unknown compression format %d", Format);
+    }
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS StreamRefill(DECOMPRESS_STREAM* Stream) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    // keep what was not read yet
+    UINTN Left = Stream->InSize - Stream->InPos;
+    if (Stream->InPos != 0) {
+        CopyMem(Stream->In, Stream->In + Stream->InPos, Left);
+        Stream->InSize = Left;
+        Stream->InPos = 0;
+    }
+
+    while (!Stream->InEnd && Stream->InSize < Stream->InCapacity) {
+        UINTN Size = Stream->InCapacity - Stream->InSize;
+        CHECK_AND_RETHROW(Stream->Read(Stream->ReadContext, Stream->In + Stream->InSize, &Size));
+        if (Size == 0) {
+            Stream->InEnd = TRUE;
+        }
+        Stream->InSize += Size;
+    }
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS StreamReadByte(DECOMPRESS_STREAM* Stream, UINT8* Byte) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Stream->InPos == Stream->InSize) {
+        CHECK_AND_RETHROW(StreamRefill(Stream));
+        CHECK_ERROR_TRACE(Stream->InPos < Stream->InSize, EFI_VOLUME_CORRUPTED, "Compressed data is truncated");
+    }
+
+    *Byte = Stream->In[Stream->InPos++];
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS StreamReadBytes(DECOMPRESS_STREAM* Stream, void* Buffer, UINTN Size) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8* Out = Buffer;
+
+    while (Size != 0) {
+        if (Stream->InPos == Stream->InSize) {
+            CHECK_AND_RETHROW(StreamRefill(Stream));
+            CHECK_ERROR_TRACE(Stream->InPos < Stream->InSize, EFI_VOLUME_CORRUPTED, "Compressed data is truncated");
+        }
+
+        UINTN Chunk = MIN(Size, Stream->InSize - Stream->InPos);
+        CopyMem(Out, Stream->In + Stream->InPos, Chunk);
+        Stream->InPos += Chunk;
+        Out += Chunk;
+        Size -= Chunk;
+    }
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS StreamAtEnd(DECOMPRESS_STREAM* Stream, BOOLEAN* AtEnd) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Stream->InPos == Stream->InSize) {
+        CHECK_AND_RETHROW(StreamRefill(Stream));
+    }
+    *AtEnd = Stream->InPos == Stream->InSize;
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS StreamReserveOutput(DECOMPRESS_STREAM* Stream, UINTN Size) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Stream->OutPos + Size > Stream->OutCapacity) {
+        CHECK_ERROR_TRACE(Stream->Grow != NULL, EFI_BUFFER_TOO_SMALL, "Decompressed data is bigger than expected");
+        CHECK_ERROR(Stream->OutPos + Size >= Stream->OutPos, EFI_BAD_BUFFER_SIZE);
+        CHECK_AND_RETHROW(Stream->Grow(Stream->GrowContext, &Stream->Out, &Stream->OutCapacity, Stream->OutPos + Size));
+        CHECK(Stream->OutPos + Size <= Stream->OutCapacity);
+    }
+
+cleanup:
+    return Status;
+}
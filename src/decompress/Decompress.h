@@ -0,0 +1,102 @@
+#ifndef __DECOMPRESS_DECOMPRESS_H__
+#define __DECOMPRESS_DECOMPRESS_H__
+
+#include <Uefi.h>
+
+typedef enum _COMPRESSION_FORMAT {
+    COMPRESSION_NONE,
+    COMPRESSION_GZIP,
+    COMPRESSION_LZ4,
+    COMPRESSION_ZSTD,
+} COMPRESSION_FORMAT;
+
+/**
+ * How many bytes of the start of the file are needed to detect
+ * the format and get the size from the frame header
+ */
+#define DECOMPRESS_HEAD_SIZE 32
+
+/**
+ * Pull more compressed input into the buffer, Size is how much can be read
+ * and is set to how much was actually read, reading 0 means the input ended
+ */
+typedef EFI_STATUS (*DECOMPRESS_READ)(void* Context, void* Buffer, UINTN* Size);
+
+/**
+ * Grow the output to at least NeededSize bytes while keeping its contents,
+ * the output is used as the window so it has to stay contiguous
+ */
+typedef EFI_STATUS (*DECOMPRESS_GROW)(void* Context, UINT8** Buffer, UINTN* Size, UINTN NeededSize);
+
+typedef struct _DECOMPRESS_STREAM {
+    // the compressed input, refilled as needed
+    DECOMPRESS_READ Read;
+    void* ReadContext;
+    UINT8* In;
+    UINTN InCapacity;
+    UINTN InSize;
+    UINTN InPos;
+    BOOLEAN InEnd;
+
+    // the decompressed output
+    DECOMPRESS_GROW Grow;
+    void* GrowContext;
+    UINT8* Out;
+    UINTN OutCapacity;
+    UINTN OutPos;
+} DECOMPRESS_STREAM;
+
+/**
+ * Detect the format from the start of the file
+ */
+COMPRESSION_FORMAT DetectCompression(UINT8* Head, UINTN HeadSize);
+
+/**
+ * Get the decompressed size if the format records it, Tail is the last
+ * 4 bytes of the file (used by gzip). Returns 0 if it is not known.
+ */
+UINT64 GetDecompressedSize(COMPRESSION_FORMAT Format, UINT8* Head, UINTN HeadSize, UINT8* Tail);
+
+/**
+ * Decompress the whole input into the output
+ */
+EFI_STATUS Decompress(COMPRESSION_FORMAT Format, DECOMPRESS_STREAM* Stream);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Stream helpers for the decompressors
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Move the unread input to the start of the buffer and fill the rest
+ */
+EFI_STATUS StreamRefill(DECOMPRESS_STREAM* Stream);
+
+/**
+ * Read a single byte, fails if the input ended
+ */
+EFI_STATUS StreamReadByte(DECOMPRESS_STREAM* Stream, UINT8* Byte);
+
+/**
+ * Read exactly Size bytes, fails if the input ended
+ */
+EFI_STATUS StreamReadBytes(DECOMPRESS_STREAM* Stream, void* Buffer, UINTN Size);
+
+/**
+ * Check if there is no more input
+ */
+EFI_STATUS StreamAtEnd(DECOMPRESS_STREAM* Stream, BOOLEAN* AtEnd);
+
+/**
+ * Make sure there is room for Size more bytes of output
+ */
+EFI_STATUS StreamReserveOutput(DECOMPRESS_STREAM* Stream, UINTN Size);
+
+//----------------------------------------------------------------------------------------------------------------------
+// The decompressors
+//----------------------------------------------------------------------------------------------------------------------
+
+EFI_STATUS GzipDecompress(DECOMPRESS_STREAM* Stream);
+EFI_STATUS Lz4Decompress(DECOMPRESS_STREAM* Stream);
+EFI_STATUS ZstdDecompress(DECOMPRESS_STREAM* Stream);
+
+#endif //__DECOMPRESS_DECOMPRESS_H__
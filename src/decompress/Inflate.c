@@ -0,0 +1,539 @@
+#include "Decompress.h"
+
+#include <util/Except.h>
+
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+/**
+ * Implementation References
+ * - https://tools.ietf.org/html/rfc1951
+ * - https://tools.ietf.org/html/rfc1952
+ * - https://github.com/madler/zlib/blob/master/contrib/puff/puff.c
+ */
+
+#define MAX_BITS 15
+#define MAX_LITLEN_CODES 288
+#define MAX_DIST_CODES 30
+
+/**
+ * Codes up to this length are decoded with a single table lookup,
+ * the rest go over the canonical code one bit at a time
+ */
+#define FAST_BITS 10
+#define FAST_MASK ((1u << FAST_BITS) - 1)
+
+typedef struct _HUFFMAN {
+    UINT16 Count[MAX_BITS + 1];
+    UINT16 Symbol[MAX_LITLEN_CODES];
+
+    // (symbol << 4) | length, 0 for codes longer than FAST_BITS
+    UINT16 Fast[1u << FAST_BITS];
+} HUFFMAN;
+
+typedef struct _INFLATE_STATE {
+    DECOMPRESS_STREAM* Stream;
+
+    // bits are consumed from the bottom
+    UINT64 BitBuf;
+    UINTN BitCount;
+
+    // zero bits added after the input ended, consuming any of
+    // them means the input is truncated
+    UINTN PaddingBits;
+
+    HUFFMAN LitLen;
+    HUFFMAN Dist;
+} INFLATE_STATE;
+
+static UINT16 LengthBase[] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static UINT8 LengthExtra[] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static UINT16 DistBase[] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+
+static UINT8 DistExtra[] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+static UINT8 CodeLengthOrder[] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Bit reading
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static EFI_STATUS NeedBits(INFLATE_STATE* State, UINTN Count) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    DECOMPRESS_STREAM* Stream = State->Stream;
+
+    while (State->BitCount < Count) {
+        if (Stream->InPos == Stream->InSize) {
+            CHECK_AND_RETHROW(StreamRefill(Stream));
+        }
+
+        if (Stream->InPos < Stream->InSize) {
+            State->BitBuf |= (UINT64)Stream->In[Stream->InPos++] << State->BitCount;
+        } else {
+            // allow peeking past the end, as long as the
+            // padding is never actually consumed
+            State->PaddingBits += 8;
+            CHECK_ERROR_TRACE(State->PaddingBits <= 32, EFI_VOLUME_CORRUPTED, "Compressed data is truncated");
+        }
+        State->BitCount += 8;
+    }
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS DropBits(INFLATE_STATE* State, UINTN Count) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    State->BitBuf >>= Count;
+    State->BitCount -= Count;
+    CHECK_ERROR_TRACE(State->BitCount >= State->PaddingBits, EFI_VOLUME_CORRUPTED, "Compressed data is truncated");
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS GetBits(INFLATE_STATE* State, UINTN Count, UINT32* Value) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK_AND_RETHROW(NeedBits(State, Count));
+    *Value = (UINT32)(State->BitBuf & ((1ull << Count) - 1));
+    CHECK_AND_RETHROW(DropBits(State, Count));
+
+cleanup:
+    return Status;
+}
+
+/**
+ * Read a byte on a byte boundary, used for the gzip header and trailer
+ * and for stored blocks
+ */
+static EFI_STATUS GetAlignedByte(INFLATE_STATE* State, UINT8* Byte) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT32 Value = 0;
+
+    CHECK_AND_RETHROW(DropBits(State, State->BitCount % 8));
+    CHECK_AND_RETHROW(GetBits(State, 8, &Value));
+    *Byte = (UINT8)Value;
+
+cleanup:
+    return Status;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Huffman codes
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static UINT32 ReverseBits(UINT32 Code, UINTN Length) {
+    UINT32 Result = 0;
+    for (int i = 0; i < Length; i++) {
+        Result = (Result << 1) | (Code & 1);
+        Code >>= 1;
+    }
+    return Result;
+}
+
+static EFI_STATUS BuildHuffman(HUFFMAN* Huffman, UINT8* Lengths, UINTN Count) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT16 Offsets[MAX_BITS + 2];
+
+    ZeroMem(Huffman->Count, sizeof(Huffman->Count));
+    for (int i = 0; i < Count; i++) {
+        Huffman->Count[Lengths[i]]++;
+    }
+    Huffman->Count[0] = 0;
+
+    // make sure the code is not over-subscribed, incomplete
+    // codes are allowed (a single distance code for example)
+    INT32 Left = 1;
+    for (int Length = 1; Length <= MAX_BITS; Length++) {
+        Left <<= 1;
+        Left -= Huffman->Count[Length];
+        CHECK_ERROR_TRACE(Left >= 0, EFI_VOLUME_CORRUPTED, "Over-subscribed huffman code");
+    }
+
+    // sort the symbols by length, keeping their order
+    Offsets[1] = 0;
+    for (int Length = 1; Length <= MAX_BITS; Length++) {
+        Offsets[Length + 1] = Offsets[Length] + Huffman->Count[Length];
+    }
+    for (int i = 0; i < Count; i++) {
+        if (Lengths[i] != 0) {
+            Huffman->Symbol[Offsets[Lengths[i]]++] = i;
+        }
+    }
+
+    // fill the lookup table with the short codes, the codes are stored
+    // bit reversed in the stream so index by the reversed code
+    ZeroMem(Huffman->Fast, sizeof(Huffman->Fast));
+    UINT32 Code = 0;
+    UINTN Index = 0;
+    for (int Length = 1; Length <= FAST_BITS; Length++) {
+        for (int i = 0; i < Huffman->Count[Length]; i++) {
+            UINT16 Entry = (UINT16)((Huffman->Symbol[Index++] << 4) | Length);
+            for (UINT32 Slot = ReverseBits(Code, Length); Slot < ARRAY_SIZE(Huffman->Fast); Slot += 1u << Length) {
+                Huffman->Fast[Slot] = Entry;
+            }
+            Code++;
+        }
+        Code <<= 1;
+    }
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS DecodeSymbol(INFLATE_STATE* State, HUFFMAN* Huffman, UINTN* Symbol) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK_AND_RETHROW(NeedBits(State, MAX_BITS));
+    UINT32 Bits = (UINT32)State->BitBuf;
+
+    UINT16 Entry = Huffman->Fast[Bits & FAST_MASK];
+    if (Entry != 0) {
+        *Symbol = Entry >> 4;
+        CHECK_AND_RETHROW(DropBits(State, Entry & 0xF));
+        goto cleanup;
+    }
+
+    // a long code, walk the canonical code
+    INT32 Code = 0;
+    INT32 First = 0;
+    INT32 Index = 0;
+    for (int Length = 1; Length <= MAX_BITS; Length++) {
+        Code |= (Bits >> (Length - 1)) & 1;
+        INT32 Count = Huffman->Count[Length];
+        if (Code - Count < First) {
+            *Symbol = Huffman->Symbol[Index + (Code - First)];
+            CHECK_AND_RETHROW(DropBits(State, Length));
+            goto cleanup;
+        }
+        Index += Count;
+        First += Count;
+        First <<= 1;
+        Code <<= 1;
+    }
+
+    CHECK_FAIL_ERROR(EFI_VOLUME_CORRUPTED);
+
+cleanup:
+    return Status;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Blocks
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static EFI_STATUS InflateStored(INFLATE_STATE* State) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    DECOMPRESS_STREAM* Stream = State->Stream;
+    UINT8 Header[4];
+
+    for (int i = 0; i < ARRAY_SIZE(Header); i++) {
+        CHECK_AND_RETHROW(GetAlignedByte(State, &Header[i]));
+    }
+
+    UINT16 Length = Header[0] | (Header[1] << 8);
+    UINT16 NotLength = Header[2] | (Header[3] << 8);
+    CHECK_ERROR_TRACE(Length == (UINT16)~NotLength, EFI_VOLUME_CORRUPTED, "Invalid stored block length");
+    CHECK_AND_RETHROW(StreamReserveOutput(Stream, Length));
+
+    // whatever is still in the bit buffer goes first
+    while (Length != 0 && State->BitCount >= 8) {
+        CHECK_AND_RETHROW(GetAlignedByte(State, &Stream->Out[Stream->OutPos++]));
+        Length--;
+    }
+
+    // and the rest directly from the input
+    CHECK_AND_RETHROW(StreamReadBytes(Stream, Stream->Out + Stream->OutPos, Length));
+    Stream->OutPos += Length;
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS InflateCodes(INFLATE_STATE* State, UINTN MemberStart) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    DECOMPRESS_STREAM* Stream = State->Stream;
+    UINTN Symbol = 0;
+    UINT32 Extra = 0;
+
+    while (TRUE) {
+        CHECK_AND_RETHROW(DecodeSymbol(State, &State->LitLen, &Symbol));
+
+        if (Symbol < 256) {
+            // literal
+            if (Stream->OutPos == Stream->OutCapacity) {
+                CHECK_AND_RETHROW(StreamReserveOutput(Stream, 1));
+            }
+            Stream->Out[Stream->OutPos++] = (UINT8)Symbol;
+
+        } else if (Symbol == 256) {
+            // end of block
+            break;
+
+        } else {
+            // length and distance pair
+            Symbol -= 257;
+            CHECK_ERROR_TRACE(Symbol < ARRAY_SIZE(LengthBase), EFI_VOLUME_CORRUPTED, "Invalid length code");
+            CHECK_AND_RETHROW(GetBits(State, LengthExtra[Symbol], &Extra));
+            UINTN Length = LengthBase[Symbol] + Extra;
+
+            CHECK_AND_RETHROW(DecodeSymbol(State, &State->Dist, &Symbol));
+            CHECK_ERROR_TRACE(Symbol < ARRAY_SIZE(DistBase), EFI_VOLUME_CORRUPTED, "Invalid distance code");
+            CHECK_AND_RETHROW(GetBits(State, DistExtra[Symbol], &Extra));
+            UINTN Distance = DistBase[Symbol] + Extra;
+            CHECK_ERROR_TRACE(Distance <= Stream->OutPos - MemberStart, EFI_VOLUME_CORRUPTED, "Distance too far back");
+
+            CHECK_AND_RETHROW(StreamReserveOutput(Stream, Length));
+            UINT8* Out = Stream->Out + Stream->OutPos;
+            UINT8* From = Out - Distance;
+            if (Distance >= Length) {
+                CopyMem(Out, From, Length);
+            } else {
+                for (int i = 0; i < Length; i++) {
+                    Out[i] = From[i];
+                }
+            }
+            Stream->OutPos += Length;
+        }
+    }
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS InflateFixed(INFLATE_STATE* State, UINTN MemberStart) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8 Lengths[MAX_LITLEN_CODES];
+
+    int i = 0;
+    for (; i < 144; i++) Lengths[i] = 8;
+    for (; i < 256; i++) Lengths[i] = 9;
+    for (; i < 280; i++) Lengths[i] = 7;
+    for (; i < 288; i++) Lengths[i] = 8;
+    CHECK_AND_RETHROW(BuildHuffman(&State->LitLen, Lengths, MAX_LITLEN_CODES));
+
+    SetMem(Lengths, MAX_DIST_CODES, 5);
+    CHECK_AND_RETHROW(BuildHuffman(&State->Dist, Lengths, MAX_DIST_CODES));
+
+    CHECK_AND_RETHROW(InflateCodes(State, MemberStart));
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS InflateDynamic(INFLATE_STATE* State, UINTN MemberStart) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8 Lengths[MAX_LITLEN_CODES + MAX_DIST_CODES + 2];
+    UINT32 LitLenCount = 0;
+    UINT32 DistCount = 0;
+    UINT32 CodeLengthCount = 0;
+    UINT32 Value = 0;
+
+    CHECK_AND_RETHROW(GetBits(State, 5, &LitLenCount));
+    CHECK_AND_RETHROW(GetBits(State, 5, &DistCount));
+    CHECK_AND_RETHROW(GetBits(State, 4, &CodeLengthCount));
+    LitLenCount += 257;
+    DistCount += 1;
+    CodeLengthCount += 4;
+    CHECK_ERROR_TRACE(LitLenCount <= 286 && DistCount <= MAX_DIST_CODES, EFI_VOLUME_CORRUPTED, "Invalid dynamic block header");
+
+    // the code for the code lengths, uses the lit/len table for now
+    ZeroMem(Lengths, 19);
+    for (int i = 0; i < CodeLengthCount; i++) {
+        CHECK_AND_RETHROW(GetBits(State, 3, &Value));
+        Lengths[CodeLengthOrder[i]] = (UINT8)Value;
+    }
+    CHECK_AND_RETHROW(BuildHuffman(&State->LitLen, Lengths, 19));
+
+    // the lit/len and distance code lengths
+    UINTN Index = 0;
+    while (Index < LitLenCount + DistCount) {
+        UINTN Symbol = 0;
+        CHECK_AND_RETHROW(DecodeSymbol(State, &State->LitLen, &Symbol));
+
+        if (Symbol < 16) {
+            Lengths[Index++] = (UINT8)Symbol;
+            continue;
+        }
+
+        UINT8 Length = 0;
+        UINTN Repeat = 0;
+        if (Symbol == 16) {
+            CHECK_ERROR_TRACE(Index != 0, EFI_VOLUME_CORRUPTED, "Repeat with no previous length");
+            Length = Lengths[Index - 1];
+            CHECK_AND_RETHROW(GetBits(State, 2, &Value));
+            Repeat = 3 + Value;
+        } else if (Symbol == 17) {
+            CHECK_AND_RETHROW(GetBits(State, 3, &Value));
+            Repeat = 3 + Value;
+        } else {
+            CHECK_AND_RETHROW(GetBits(State, 7, &Value));
+            Repeat = 11 + Value;
+        }
+
+        CHECK_ERROR_TRACE(Index + Repeat <= LitLenCount + DistCount, EFI_VOLUME_CORRUPTED, "Too many code lengths");
+        SetMem(Lengths + Index, Repeat, Length);
+        Index += Repeat;
+    }
+
+    CHECK_ERROR_TRACE(Lengths[256] != 0, EFI_VOLUME_CORRUPTED, "Missing end of block code");
+    CHECK_AND_RETHROW(BuildHuffman(&State->LitLen, Lengths, LitLenCount));
+    CHECK_AND_RETHROW(BuildHuffman(&State->Dist, Lengths + LitLenCount, DistCount));
+
+    CHECK_AND_RETHROW(InflateCodes(State, MemberStart));
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS Inflate(INFLATE_STATE* State, UINTN MemberStart) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT32 Last = 0;
+    UINT32 Type = 0;
+
+    do {
+        CHECK_AND_RETHROW(GetBits(State, 1, &Last));
+        CHECK_AND_RETHROW(GetBits(State, 2, &Type));
+
+        switch (Type) {
+            case 0: CHECK_AND_RETHROW(InflateStored(State)); break;
+            case 1: CHECK_AND_RETHROW(InflateFixed(State, MemberStart)); break;
+            case 2: CHECK_AND_RETHROW(InflateDynamic(State, MemberStart)); break;
+            default: CHECK_FAIL_TRACE("Invalid deflate block type");
+        }
+    } while (!Last);
+
+cleanup:
+    return Status;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Gzip members
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static EFI_STATUS SkipBytes(INFLATE_STATE* State, UINTN Count) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8 Byte = 0;
+
+    for (int i = 0; i < Count; i++) {
+        CHECK_AND_RETHROW(GetAlignedByte(State, &Byte));
+    }
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS SkipString(INFLATE_STATE* State) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8 Byte = 0;
+
+    do {
+        CHECK_AND_RETHROW(GetAlignedByte(State, &Byte));
+    } while (Byte != 0);
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS GzipMember(INFLATE_STATE* State) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8 Header[10];
+    UINT8 Trailer[8];
+
+    for (int i = 0; i < ARRAY_SIZE(Header); i++) {
+        CHECK_AND_RETHROW(GetAlignedByte(State, &Header[i]));
+    }
+    CHECK_ERROR_TRACE(Header[0] == 0x1F && Header[1] == 0x8B && Header[2] == 0x08, EFI_VOLUME_CORRUPTED, "Invalid gzip header");
+
+    // the optional fields
+    UINT8 Flags = Header[3];
+    if (Flags & BIT2) {
+        UINT8 Size[2];
+        CHECK_AND_RETHROW(GetAlignedByte(State, &Size[0]));
+        CHECK_AND_RETHROW(GetAlignedByte(State, &Size[1]));
+        CHECK_AND_RETHROW(SkipBytes(State, Size[0] | (Size[1] << 8)));
+    }
+    if (Flags & BIT3) {
+        CHECK_AND_RETHROW(SkipString(State));
+    }
+    if (Flags & BIT4) {
+        CHECK_AND_RETHROW(SkipString(State));
+    }
+    if (Flags & BIT1) {
+        CHECK_AND_RETHROW(SkipBytes(State, 2));
+    }
+
+    UINTN MemberStart = State->Stream->OutPos;
+    CHECK_AND_RETHROW(Inflate(State, MemberStart));
+
+    // we don't verify the crc, but the size is a cheap sanity check
+    for (int i = 0; i < ARRAY_SIZE(Trailer); i++) {
+        CHECK_AND_RETHROW(GetAlignedByte(State, &Trailer[i]));
+    }
+    UINT32 Size = Trailer[4] | (Trailer[5] << 8) | (Trailer[6] << 16) | ((UINT32)Trailer[7] << 24);
+    CHECK_ERROR_TRACE(Size == (UINT32)(State->Stream->OutPos - MemberStart), EFI_VOLUME_CORRUPTED, "Gzip size mismatch");
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS GzipDecompress(DECOMPRESS_STREAM* Stream) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    INFLATE_STATE* State = NULL;
+    BOOLEAN AtEnd = FALSE;
+
+    State = AllocateZeroPool(sizeof(INFLATE_STATE));
+    CHECK_ERROR(State != NULL, EFI_OUT_OF_RESOURCES);
+    State->Stream = Stream;
+
+    // there can be multiple members, stop at the
+    // end or if there is padding after the last one
+    while (TRUE) {
+        CHECK_AND_RETHROW(GzipMember(State));
+
+        UINT8 Next = 0;
+        if (State->BitCount > State->PaddingBits) {
+            Next = (UINT8)State->BitBuf;
+        } else {
+            State->BitBuf = 0;
+            State->BitCount = 0;
+            State->PaddingBits = 0;
+
+            CHECK_AND_RETHROW(StreamAtEnd(Stream, &AtEnd));
+            if (AtEnd) {
+                break;
+            }
+            Next = Stream->In[Stream->InPos];
+        }
+
+        if (Next != 0x1F) {
+            break;
+        }
+    }
+
+cleanup:
+    if (State != NULL) {
+        FreePool(State);
+    }
+
+    return Status;
+}
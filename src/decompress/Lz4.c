@@ -0,0 +1,230 @@
+#include "Decompress.h"
+
+#include <util/Except.h>
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+
+/**
+ * Implementation References
+ * - https://github.com/lz4/lz4/blob/dev/doc/lz4_Frame_format.md
+ * - https://github.com/lz4/lz4/blob/dev/doc/lz4_Block_format.md
+ */
+
+#define LZ4_MAGIC 0x184D2204
+#define LZ4_LEGACY_MAGIC 0x184C2102
+#define LZ4_LEGACY_BLOCK_SIZE SIZE_8MB
+#define LZ4_BLOCK_BOUND(size) ((size) + (size) / 255 + 16)
+
+static EFI_STATUS ReadLe32(DECOMPRESS_STREAM* Stream, UINT32* Value) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8 Bytes[4];
+
+    CHECK_AND_RETHROW(StreamReadBytes(Stream, Bytes, sizeof(Bytes)));
+    *Value = ReadUnaligned32((UINT32*)Bytes);
+
+cleanup:
+    return Status;
+}
+
+/**
+ * Read a length which is continued with 255 bytes
+ */
+static EFI_STATUS ReadLength(DECOMPRESS_STREAM* Stream, UINTN* Length, UINTN* Left) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8 Byte = 0;
+
+    do {
+        CHECK_ERROR_TRACE(*Left != 0, EFI_VOLUME_CORRUPTED, "LZ4 block overrun");
+        CHECK_AND_RETHROW(StreamReadByte(Stream, &Byte));
+        (*Left)--;
+        *Length += Byte;
+    } while (Byte == 255);
+
+cleanup:
+    return Status;
+}
+
+/**
+ * Decode a single block straight from the input, the matches can
+ * reference all of the output of the frame
+ */
+static EFI_STATUS Lz4DecodeBlock(DECOMPRESS_STREAM* Stream, UINTN BlockSize, UINTN FrameStart) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINTN Left = BlockSize;
+    UINT8 Token = 0;
+    UINT8 OffsetBytes[2];
+
+    while (Left != 0) {
+        CHECK_AND_RETHROW(StreamReadByte(Stream, &Token));
+        Left--;
+
+        // the literals
+        UINTN Literals = Token >> 4;
+        if (Literals == 15) {
+            CHECK_AND_RETHROW(ReadLength(Stream, &Literals, &Left));
+        }
+        CHECK_ERROR_TRACE(Literals <= Left, EFI_VOLUME_CORRUPTED, "LZ4 block overrun");
+        CHECK_AND_RETHROW(StreamReserveOutput(Stream, Literals));
+        CHECK_AND_RETHROW(StreamReadBytes(Stream, Stream->Out + Stream->OutPos, Literals));
+        Stream->OutPos += Literals;
+        Left -= Literals;
+
+        // the last sequence only has literals
+        if (Left == 0) {
+            break;
+        }
+
+        // the match
+        CHECK_ERROR_TRACE(Left >= 2, EFI_VOLUME_CORRUPTED, "LZ4 block overrun");
+        CHECK_AND_RETHROW(StreamReadBytes(Stream, OffsetBytes, sizeof(OffsetBytes)));
+        Left -= 2;
+        UINTN Offset = OffsetBytes[0] | (OffsetBytes[1] << 8);
+        CHECK_ERROR_TRACE(Offset != 0 && Offset <= Stream->OutPos - FrameStart, EFI_VOLUME_CORRUPTED, "Invalid LZ4 match offset");
+
+        UINTN Length = Token & 0xF;
+        if (Length == 15) {
+            CHECK_AND_RETHROW(ReadLength(Stream, &Length, &Left));
+        }
+        Length += 4;
+
+        CHECK_AND_RETHROW(StreamReserveOutput(Stream, Length));
+        UINT8* Out = Stream->Out + Stream->OutPos;
+        UINT8* From = Out - Offset;
+        if (Offset >= Length) {
+            CopyMem(Out, From, Length);
+        } else {
+            for (int i = 0; i < Length; i++) {
+                Out[i] = From[i];
+            }
+        }
+        Stream->OutPos += Length;
+    }
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS Lz4Frame(DECOMPRESS_STREAM* Stream) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8 Descriptor[2];
+    UINT8 Skip[4];
+    UINT32 BlockSize = 0;
+    UINTN FrameStart = Stream->OutPos;
+
+    CHECK_AND_RETHROW(StreamReadBytes(Stream, Descriptor, sizeof(Descriptor)));
+    UINT8 Flags = Descriptor[0];
+    CHECK_ERROR_TRACE((Flags >> 6) == 1, EFI_UNSUPPORTED, "Unsupported LZ4 frame version");
+    CHECK_ERROR_TRACE((Flags & BIT0) == 0, EFI_UNSUPPORTED, "LZ4 dictionaries are not supported");
+
+    UINTN MaxBlockSize = 1u << (8 + 2 * ((Descriptor[1] >> 4) & 7));
+    CHECK_ERROR_TRACE(MaxBlockSize >= SIZE_64KB, EFI_VOLUME_CORRUPTED, "Invalid LZ4 block size");
+
+    // the content size (only used as a hint) and the header checksum
+    if (Flags & BIT3) {
+        UINT64 ContentSize;
+        CHECK_AND_RETHROW(StreamReadBytes(Stream, &ContentSize, sizeof(ContentSize)));
+    }
+    UINT8 HeaderChecksum;
+    CHECK_AND_RETHROW(StreamReadBytes(Stream, &HeaderChecksum, sizeof(HeaderChecksum)));
+
+    while (TRUE) {
+        CHECK_AND_RETHROW(ReadLe32(Stream, &BlockSize));
+        if (BlockSize == 0) {
+            break;
+        }
+
+        BOOLEAN Uncompressed = (BlockSize & BIT31) != 0;
+        BlockSize &= ~BIT31;
+        CHECK_ERROR_TRACE(BlockSize <= MaxBlockSize, EFI_VOLUME_CORRUPTED, "LZ4 block is too big");
+
+        if (Uncompressed) {
+            CHECK_AND_RETHROW(StreamReserveOutput(Stream, BlockSize));
+            CHECK_AND_RETHROW(StreamReadBytes(Stream, Stream->Out + Stream->OutPos, BlockSize));
+            Stream->OutPos += BlockSize;
+        } else {
+            CHECK_AND_RETHROW(Lz4DecodeBlock(Stream, BlockSize, FrameStart));
+        }
+
+        // block checksum, not verified
+        if (Flags & BIT4) {
+            CHECK_AND_RETHROW(StreamReadBytes(Stream, Skip, 4));
+        }
+    }
+
+    // content checksum, not verified
+    if (Flags & BIT2) {
+        CHECK_AND_RETHROW(StreamReadBytes(Stream, Skip, 4));
+    }
+
+cleanup:
+    return Status;
+}
+
+/**
+ * The legacy format (lz4 -l), used for linux initrds, is just a list of
+ * blocks until the end of the input or the start of another frame
+ */
+static EFI_STATUS Lz4LegacyFrame(DECOMPRESS_STREAM* Stream, UINT32* NextMagic) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT32 BlockSize = 0;
+    BOOLEAN AtEnd = FALSE;
+    UINTN FrameStart = Stream->OutPos;
+
+    *NextMagic = 0;
+    while (TRUE) {
+        CHECK_AND_RETHROW(StreamAtEnd(Stream, &AtEnd));
+        if (AtEnd) {
+            break;
+        }
+
+        CHECK_AND_RETHROW(ReadLe32(Stream, &BlockSize));
+        if (BlockSize == LZ4_LEGACY_MAGIC || BlockSize == LZ4_MAGIC) {
+            *NextMagic = BlockSize;
+            break;
+        }
+
+        CHECK_ERROR_TRACE(BlockSize <= LZ4_BLOCK_BOUND(LZ4_LEGACY_BLOCK_SIZE), EFI_VOLUME_CORRUPTED, "LZ4 block is too big");
+        CHECK_AND_RETHROW(Lz4DecodeBlock(Stream, BlockSize, FrameStart));
+    }
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS Lz4Decompress(DECOMPRESS_STREAM* Stream) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT32 Magic = 0;
+    BOOLEAN AtEnd = FALSE;
+
+    CHECK_AND_RETHROW(ReadLe32(Stream, &Magic));
+    while (TRUE) {
+        if (Magic == LZ4_MAGIC) {
+            CHECK_AND_RETHROW(Lz4Frame(Stream));
+        } else if (Magic == LZ4_LEGACY_MAGIC) {
+            CHECK_AND_RETHROW(Lz4LegacyFrame(Stream, &Magic));
+            if (Magic != 0) {
+                continue;
+            }
+        } else if ((Magic & 0xFFFFFFF0) == 0x184D2A50) {
+            // skippable frame
+            UINT32 Size = 0;
+            UINT8 Byte = 0;
+            CHECK_AND_RETHROW(ReadLe32(Stream, &Size));
+            for (int i = 0; i < Size; i++) {
+                CHECK_AND_RETHROW(StreamReadByte(Stream, &Byte));
+            }
+        } else {
+            CHECK_FAIL_TRACE("Invalid LZ4 frame magic %x", Magic);
+        }
+
+        CHECK_AND_RETHROW(StreamAtEnd(Stream, &AtEnd));
+        if (AtEnd) {
+            break;
+        }
+        CHECK_AND_RETHROW(ReadLe32(Stream, &Magic));
+    }
+
+cleanup:
+    return Status;
+}
@@ -0,0 +1,840 @@
+#include "Decompress.h"
+
+#include <util/Except.h>
+
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+
+/**
+ * Implementation References
+ * - https://tools.ietf.org/html/rfc8878
+ * - https://github.com/facebook/zstd/blob/dev/doc/educational_decoder/zstd_decompress.c
+ *
+ * Dictionaries are not supported and the checksums are not verified.
+ */
+
+#define ZSTD_MAGIC 0xFD2FB528
+#define ZSTD_BLOCK_SIZE_MAX SIZE_128KB
+
+#define HUF_MAX_BITS 11
+#define HUF_MAX_WEIGHTS 255
+#define HUF_WEIGHTS_MAX_LOG 6
+
+#define FSE_MAX_LOG 9
+#define LL_MAX_LOG 9
+#define ML_MAX_LOG 9
+#define OF_MAX_LOG 8
+#define LL_MAX_CODE 35
+#define ML_MAX_CODE 52
+#define OF_MAX_CODE 31
+
+typedef struct _FSE_ENTRY {
+    UINT8 Symbol;
+    UINT8 Bits;
+    UINT16 Base;
+} FSE_ENTRY;
+
+typedef struct _FSE_TABLE {
+    FSE_ENTRY Entries[1u << FSE_MAX_LOG];
+    UINTN Log;
+    BOOLEAN Valid;
+} FSE_TABLE;
+
+typedef struct _HUF_ENTRY {
+    UINT8 Symbol;
+    UINT8 Bits;
+} HUF_ENTRY;
+
+typedef struct _HUF_TABLE {
+    HUF_ENTRY Entries[1u << HUF_MAX_BITS];
+    UINTN MaxBits;
+    BOOLEAN Valid;
+} HUF_TABLE;
+
+typedef struct _ZSTD_STATE {
+    DECOMPRESS_STREAM* Stream;
+    UINTN FrameStart;
+
+    // the current compressed block and its literals
+    UINT8 Block[ZSTD_BLOCK_SIZE_MAX];
+    UINT8 LiteralsBuffer[ZSTD_BLOCK_SIZE_MAX];
+    UINT8* Literals;
+    UINTN LiteralsSize;
+
+    // these carry over between the blocks of a frame
+    HUF_TABLE Huffman;
+    FSE_TABLE LitLen;
+    FSE_TABLE Offset;
+    FSE_TABLE MatchLen;
+    UINT64 Rep[3];
+
+    FSE_TABLE Weights;
+} ZSTD_STATE;
+
+static INT16 LitLenDefault[LL_MAX_CODE + 1] = {
+    4, 3, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 2, 1, 1, 1,
+    2, 2, 2, 2, 2, 2, 2, 2, 2, 3, 2, 1, 1, 1, 1, 1,
+    -1, -1, -1, -1
+};
+
+static INT16 MatchLenDefault[ML_MAX_CODE + 1] = {
+    1, 4, 3, 2, 2, 2, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, -1, -1,
+    -1, -1, -1, -1, -1
+};
+
+static INT16 OffsetDefault[] = {
+    1, 1, 1, 1, 1, 1, 2, 2, 2, 1, 1, 1, 1, 1, 1, 1,
+    1, 1, 1, 1, 1, 1, 1, 1, -1, -1, -1, -1, -1
+};
+
+static UINT32 LitLenBase[LL_MAX_CODE + 1] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+    16, 18, 20, 22, 24, 28, 32, 40, 48, 64, 128, 256, 512, 1024, 2048, 4096,
+    8192, 16384, 32768, 65536
+};
+
+static UINT8 LitLenBits[LL_MAX_CODE + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 6, 7, 8, 9, 10, 11, 12,
+    13, 14, 15, 16
+};
+
+static UINT32 MatchLenBase[ML_MAX_CODE + 1] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18,
+    19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31, 32, 33, 34,
+    35, 37, 39, 41, 43, 47, 51, 59, 67, 83, 99, 131, 259, 515, 1027, 2051,
+    4099, 8195, 16387, 32771, 65539
+};
+
+static UINT8 MatchLenBits[ML_MAX_CODE + 1] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+    1, 1, 1, 1, 2, 2, 3, 3, 4, 4, 5, 7, 8, 9, 10, 11,
+    12, 13, 14, 15, 16
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Bit streams
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Forward little endian bit stream, only used for the small table headers
+ */
+typedef struct _FORWARD_BITS {
+    UINT8* Data;
+    UINTN Size;
+    UINTN Pos;
+} FORWARD_BITS;
+
+static UINT32 PeekForward(FORWARD_BITS* Bits, UINTN Count) {
+    UINT32 Value = 0;
+    for (int i = 0; i < Count; i++) {
+        UINTN Pos = Bits->Pos + i;
+        if (Pos / 8 < Bits->Size && ((Bits->Data[Pos / 8] >> (Pos % 8)) & 1)) {
+            Value |= 1u << i;
+        }
+    }
+    return Value;
+}
+
+static UINT32 ReadForward(FORWARD_BITS* Bits, UINTN Count) {
+    UINT32 Value = PeekForward(Bits, Count);
+    Bits->Pos += Count;
+    return Value;
+}
+
+/**
+ * Backward bit stream, read from the last bit (after the padding) to the
+ * first one, reading past the start gives zeros and makes Left negative
+ */
+typedef struct _BACKWARD_BITS {
+    UINT8* Data;
+    UINTN Size;
+    INTN Left;
+} BACKWARD_BITS;
+
+static EFI_STATUS InitBackward(BACKWARD_BITS* Bits, UINT8* Data, UINTN Size) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK_ERROR_TRACE(Size != 0 && Data[Size - 1] != 0, EFI_VOLUME_CORRUPTED, "Invalid zstd bit stream");
+    Bits->Data = Data;
+    Bits->Size = Size;
+    Bits->Left = (Size - 1) * 8 + HighBitSet32(Data[Size - 1]);
+
+cleanup:
+    return Status;
+}
+
+static UINT64 LoadBits(BACKWARD_BITS* Bits, UINTN Pos) {
+    UINTN Byte = Pos / 8;
+    UINT64 Value = 0;
+    if (Byte + 8 <= Bits->Size) {
+        Value = ReadUnaligned64((UINT64*)(Bits->Data + Byte));
+    } else {
+        for (int i = 0; Byte + i < Bits->Size; i++) {
+            Value |= (UINT64)Bits->Data[Byte + i] << (i * 8);
+        }
+    }
+    return Value >> (Pos % 8);
+}
+
+static UINT64 PeekBackward(BACKWARD_BITS* Bits, UINTN Count) {
+    if (Count == 0) {
+        return 0;
+    }
+
+    UINT64 Mask = (1ull << Count) - 1;
+    INTN Start = Bits->Left - (INTN)Count;
+    if (Start >= 0) {
+        return LoadBits(Bits, Start) & Mask;
+    } else if (Bits->Left > 0) {
+        return (LoadBits(Bits, 0) << -Start) & Mask;
+    } else {
+        return 0;
+    }
+}
+
+static UINT64 ReadBackward(BACKWARD_BITS* Bits, UINTN Count) {
+    UINT64 Value = PeekBackward(Bits, Count);
+    Bits->Left -= Count;
+    return Value;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// FSE tables
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static EFI_STATUS BuildFseTable(FSE_TABLE* Table, INT16* Frequencies, UINTN Count, UINTN Log) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT16 NextState[256];
+
+    UINTN Size = 1u << Log;
+    UINTN HighThreshold = Size;
+
+    // the less than one probability symbols go at the end
+    for (int Symbol = 0; Symbol < Count; Symbol++) {
+        if (Frequencies[Symbol] == -1) {
+            CHECK_ERROR(HighThreshold != 0, EFI_VOLUME_CORRUPTED);
+            Table->Entries[--HighThreshold].Symbol = Symbol;
+            NextState[Symbol] = 1;
+        }
+    }
+
+    // spread the rest
+    UINTN Step = (Size >> 1) + (Size >> 3) + 3;
+    UINTN Mask = Size - 1;
+    UINTN Pos = 0;
+    for (int Symbol = 0; Symbol < Count; Symbol++) {
+        if (Frequencies[Symbol] <= 0) {
+            continue;
+        }
+
+        NextState[Symbol] = Frequencies[Symbol];
+        for (int i = 0; i < Frequencies[Symbol]; i++) {
+            Table->Entries[Pos].Symbol = Symbol;
+            do {
+                Pos = (Pos + Step) & Mask;
+            } while (Pos >= HighThreshold);
+        }
+    }
+    CHECK_ERROR_TRACE(Pos == 0, EFI_VOLUME_CORRUPTED, "Invalid FSE distribution");
+
+    // and the state transitions
+    for (int i = 0; i < Size; i++) {
+        UINT16 State = NextState[Table->Entries[i].Symbol]++;
+        Table->Entries[i].Bits = (UINT8)(Log - HighBitSet32(State));
+        Table->Entries[i].Base = (UINT16)((State << Table->Entries[i].Bits) - Size);
+    }
+
+    Table->Log = Log;
+    Table->Valid = TRUE;
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS ReadFseTable(FSE_TABLE* Table, UINT8* Data, UINTN Size, UINTN MaxLog, UINTN MaxSymbol, UINTN* Used) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    FORWARD_BITS Bits = { .Data = Data, .Size = Size, .Pos = 0 };
+    INT16 Frequencies[256];
+
+    UINTN Log = ReadForward(&Bits, 4) + 5;
+    CHECK_ERROR_TRACE(Log <= MaxLog, EFI_VOLUME_CORRUPTED, "FSE accuracy log too big");
+
+    INT32 Remaining = (1 << Log) + 1;
+    INT32 Threshold = 1 << Log;
+    UINTN BitCount = Log + 1;
+    UINTN Symbol = 0;
+    while (Remaining > 1 && Symbol <= MaxSymbol) {
+        INT32 Max = (2 * Threshold - 1) - Remaining;
+        INT32 Count = 0;
+        UINT32 Value = PeekForward(&Bits, BitCount);
+        if ((INT32)(Value & (Threshold - 1)) < Max) {
+            Count = Value & (Threshold - 1);
+            Bits.Pos += BitCount - 1;
+        } else {
+            Count = Value & (2 * Threshold - 1);
+            if (Count >= Threshold) {
+                Count -= Max;
+            }
+            Bits.Pos += BitCount;
+        }
+
+        Count--;
+        Remaining -= Count < 0 ? -Count : Count;
+        Frequencies[Symbol++] = (INT16)Count;
+
+        // zero is followed by a repeat count of more zeros
+        if (Count == 0) {
+            UINT32 Repeat = ReadForward(&Bits, 2);
+            while (TRUE) {
+                for (int i = 0; i < Repeat && Symbol <= MaxSymbol; i++) {
+                    Frequencies[Symbol++] = 0;
+                }
+                if (Repeat != 3) {
+                    break;
+                }
+                Repeat = ReadForward(&Bits, 2);
+            }
+        }
+
+        while (Remaining < Threshold) {
+            BitCount--;
+            Threshold >>= 1;
+        }
+    }
+
+    CHECK_ERROR_TRACE(Remaining == 1 && Bits.Pos <= Size * 8, EFI_VOLUME_CORRUPTED, "Invalid FSE table description");
+    CHECK_AND_RETHROW(BuildFseTable(Table, Frequencies, Symbol, Log));
+    *Used = (Bits.Pos + 7) / 8;
+
+cleanup:
+    return Status;
+}
+
+static void BuildRleTable(FSE_TABLE* Table, UINT8 Symbol) {
+    Table->Entries[0].Symbol = Symbol;
+    Table->Entries[0].Bits = 0;
+    Table->Entries[0].Base = 0;
+    Table->Log = 0;
+    Table->Valid = TRUE;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Literals
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static EFI_STATUS ReadHuffmanTable(ZSTD_STATE* State, UINT8* Data, UINTN Size, UINTN* Used) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8 Weights[HUF_MAX_WEIGHTS + 1];
+    UINTN Count = 0;
+    HUF_TABLE* Huffman = &State->Huffman;
+
+    CHECK_ERROR(Size >= 1, EFI_VOLUME_CORRUPTED);
+    UINT8 Header = Data[0];
+    if (Header >= 128) {
+        // 4 bit weights
+        Count = Header - 127;
+        CHECK_ERROR(1 + (Count + 1) / 2 <= Size, EFI_VOLUME_CORRUPTED);
+        for (int i = 0; i < Count; i++) {
+            UINT8 Byte = Data[1 + i / 2];
+            Weights[i] = (i % 2 == 0) ? (Byte >> 4) : (Byte & 0xF);
+        }
+        *Used = 1 + (Count + 1) / 2;
+    } else {
+        // fse compressed weights, with two interleaved states
+        UINTN TableSize = 0;
+        BACKWARD_BITS Bits;
+        CHECK_ERROR(1 + Header <= Size, EFI_VOLUME_CORRUPTED);
+        CHECK_AND_RETHROW(ReadFseTable(&State->Weights, Data + 1, Header, HUF_WEIGHTS_MAX_LOG, HUF_MAX_BITS + 1, &TableSize));
+        CHECK_ERROR(TableSize < Header, EFI_VOLUME_CORRUPTED);
+        CHECK_AND_RETHROW(InitBackward(&Bits, Data + 1 + TableSize, Header - TableSize));
+
+        FSE_ENTRY* Entries = State->Weights.Entries;
+        UINTN State1 = ReadBackward(&Bits, State->Weights.Log);
+        UINTN State2 = ReadBackward(&Bits, State->Weights.Log);
+        while (TRUE) {
+            CHECK_ERROR(Count + 2 <= HUF_MAX_WEIGHTS, EFI_VOLUME_CORRUPTED);
+            Weights[Count++] = Entries[State1].Symbol;
+            State1 = Entries[State1].Base + ReadBackward(&Bits, Entries[State1].Bits);
+            if (Bits.Left < 0) {
+                Weights[Count++] = Entries[State2].Symbol;
+                break;
+            }
+
+            CHECK_ERROR(Count + 2 <= HUF_MAX_WEIGHTS, EFI_VOLUME_CORRUPTED);
+            Weights[Count++] = Entries[State2].Symbol;
+            State2 = Entries[State2].Base + ReadBackward(&Bits, Entries[State2].Bits);
+            if (Bits.Left < 0) {
+                Weights[Count++] = Entries[State1].Symbol;
+                break;
+            }
+        }
+        *Used = 1 + Header;
+    }
+
+    // the weight of the last symbol is implied by the rest
+    UINT32 Total = 0;
+    for (int i = 0; i < Count; i++) {
+        CHECK_ERROR(Weights[i] <= HUF_MAX_BITS, EFI_VOLUME_CORRUPTED);
+        if (Weights[i] != 0) {
+            Total += 1u << (Weights[i] - 1);
+        }
+    }
+    CHECK_ERROR(Total != 0, EFI_VOLUME_CORRUPTED);
+
+    UINTN MaxBits = HighBitSet32(Total) + 1;
+    UINT32 Rest = (1u << MaxBits) - Total;
+    CHECK_ERROR_TRACE(MaxBits <= HUF_MAX_BITS && (Rest & (Rest - 1)) == 0, EFI_VOLUME_CORRUPTED, "Invalid huffman weights");
+    Weights[Count++] = (UINT8)(HighBitSet32(Rest) + 1);
+
+    // each weight gets a range of the table, in symbol order
+    UINT32 RankStart[HUF_MAX_BITS + 2] = { 0 };
+    for (int i = 0; i < Count; i++) {
+        RankStart[Weights[i]]++;
+    }
+    UINT32 Next = 0;
+    for (int Weight = 1; Weight <= HUF_MAX_BITS; Weight++) {
+        UINT32 Current = Next;
+        Next += RankStart[Weight] << (Weight - 1);
+        RankStart[Weight] = Current;
+    }
+
+    for (int i = 0; i < Count; i++) {
+        UINT8 Weight = Weights[i];
+        if (Weight == 0) {
+            continue;
+        }
+
+        UINTN Length = 1u << (Weight - 1);
+        for (int j = 0; j < Length; j++) {
+            Huffman->Entries[RankStart[Weight] + j].Symbol = i;
+            Huffman->Entries[RankStart[Weight] + j].Bits = (UINT8)(MaxBits + 1 - Weight);
+        }
+        RankStart[Weight] += Length;
+    }
+
+    Huffman->MaxBits = MaxBits;
+    Huffman->Valid = TRUE;
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS DecodeHuffmanStream(HUF_TABLE* Huffman, UINT8* Data, UINTN Size, UINT8* Out, UINTN Count) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    BACKWARD_BITS Bits;
+
+    CHECK_AND_RETHROW(InitBackward(&Bits, Data, Size));
+    for (int i = 0; i < Count; i++) {
+        HUF_ENTRY* Entry = &Huffman->Entries[PeekBackward(&Bits, Huffman->MaxBits)];
+        Out[i] = Entry->Symbol;
+        Bits.Left -= Entry->Bits;
+    }
+    CHECK_ERROR_TRACE(Bits.Left == 0, EFI_VOLUME_CORRUPTED, "Invalid huffman stream");
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS DecodeLiterals(ZSTD_STATE* State, UINT8* Data, UINTN Size, UINTN* Used) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK_ERROR(Size >= 1, EFI_VOLUME_CORRUPTED);
+    UINT8 Type = Data[0] & 3;
+    UINT8 SizeFormat = (Data[0] >> 2) & 3;
+
+    if (Type == 0 || Type == 1) {
+        // raw and rle literals
+        UINTN HeaderSize = 0;
+        UINTN Regenerated = 0;
+        switch (SizeFormat) {
+            case 0:
+            case 2:
+                HeaderSize = 1;
+                Regenerated = Data[0] >> 3;
+                break;
+
+            case 1:
+                HeaderSize = 2;
+                CHECK_ERROR(Size >= HeaderSize, EFI_VOLUME_CORRUPTED);
+                Regenerated = (Data[0] >> 4) + (Data[1] << 4);
+                break;
+
+            default:
+                HeaderSize = 3;
+                CHECK_ERROR(Size >= HeaderSize, EFI_VOLUME_CORRUPTED);
+                Regenerated = (Data[0] >> 4) + (Data[1] << 4) + (Data[2] << 12);
+                break;
+        }
+        CHECK_ERROR(Regenerated <= ZSTD_BLOCK_SIZE_MAX, EFI_VOLUME_CORRUPTED);
+
+        if (Type == 0) {
+            CHECK_ERROR(HeaderSize + Regenerated <= Size, EFI_VOLUME_CORRUPTED);
+            State->Literals = Data + HeaderSize;
+            *Used = HeaderSize + Regenerated;
+        } else {
+            CHECK_ERROR(HeaderSize + 1 <= Size, EFI_VOLUME_CORRUPTED);
+            SetMem(State->LiteralsBuffer, Regenerated, Data[HeaderSize]);
+            State->Literals = State->LiteralsBuffer;
+            *Used = HeaderSize + 1;
+        }
+        State->LiteralsSize = Regenerated;
+
+    } else {
+        // huffman compressed literals, either with a new
+        // table or with the one of the previous block
+        UINTN Streams = SizeFormat == 0 ? 1 : 4;
+        UINTN HeaderSize = SizeFormat <= 1 ? 3 : (SizeFormat == 2 ? 4 : 5);
+        UINTN SizeBits = SizeFormat <= 1 ? 10 : (SizeFormat == 2 ? 14 : 18);
+        CHECK_ERROR(Size >= HeaderSize, EFI_VOLUME_CORRUPTED);
+
+        UINT64 Header = 0;
+        for (int i = 0; i < HeaderSize; i++) {
+            Header |= (UINT64)Data[i] << (i * 8);
+        }
+        UINTN Regenerated = (Header >> 4) & ((1u << SizeBits) - 1);
+        UINTN Compressed = (Header >> (4 + SizeBits)) & ((1u << SizeBits) - 1);
+        CHECK_ERROR(Regenerated <= ZSTD_BLOCK_SIZE_MAX && HeaderSize + Compressed <= Size, EFI_VOLUME_CORRUPTED);
+
+        UINT8* Src = Data + HeaderSize;
+        UINTN SrcSize = Compressed;
+        if (Type == 2) {
+            UINTN TableSize = 0;
+            CHECK_AND_RETHROW(ReadHuffmanTable(State, Src, SrcSize, &TableSize));
+            Src += TableSize;
+            SrcSize -= TableSize;
+        } else {
+            CHECK_ERROR_TRACE(State->Huffman.Valid, EFI_VOLUME_CORRUPTED, "Missing huffman table for treeless literals");
+        }
+
+        UINT8* Out = State->LiteralsBuffer;
+        if (Streams == 1) {
+            CHECK_AND_RETHROW(DecodeHuffmanStream(&State->Huffman, Src, SrcSize, Out, Regenerated));
+        } else {
+            CHECK_ERROR(SrcSize >= 6, EFI_VOLUME_CORRUPTED);
+            UINTN Sizes[4];
+            Sizes[0] = ReadUnaligned16((UINT16*)Src);
+            Sizes[1] = ReadUnaligned16((UINT16*)(Src + 2));
+            Sizes[2] = ReadUnaligned16((UINT16*)(Src + 4));
+            CHECK_ERROR(6 + Sizes[0] + Sizes[1] + Sizes[2] <= SrcSize, EFI_VOLUME_CORRUPTED);
+            Sizes[3] = SrcSize - 6 - Sizes[0] - Sizes[1] - Sizes[2];
+
+            UINTN Segment = (Regenerated + 3) / 4;
+            CHECK_ERROR(Segment * 3 <= Regenerated, EFI_VOLUME_CORRUPTED);
+
+            Src += 6;
+            for (int i = 0; i < 4; i++) {
+                UINTN Count = i == 3 ? Regenerated - Segment * 3 : Segment;
+                CHECK_AND_RETHROW(DecodeHuffmanStream(&State->Huffman, Src, Sizes[i], Out, Count));
+                Src += Sizes[i];
+                Out += Count;
+            }
+        }
+
+        State->Literals = State->LiteralsBuffer;
+        State->LiteralsSize = Regenerated;
+        *Used = HeaderSize + Compressed;
+    }
+
+cleanup:
+    return Status;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Sequences
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static EFI_STATUS ReadSequenceTable(FSE_TABLE* Table, UINTN Mode, UINT8* Data, UINTN Size, UINTN* Used,
+                                    INT16* Default, UINTN DefaultCount, UINTN DefaultLog, UINTN MaxLog, UINTN MaxSymbol) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    *Used = 0;
+    switch (Mode) {
+        case 0:
+            CHECK_AND_RETHROW(BuildFseTable(Table, Default, DefaultCount, DefaultLog));
+            break;
+
+        case 1:
+            CHECK_ERROR(Size >= 1 && Data[0] <= MaxSymbol, EFI_VOLUME_CORRUPTED);
+            BuildRleTable(Table, Data[0]);
+            *Used = 1;
+            break;
+
+        case 2:
+            CHECK_AND_RETHROW(ReadFseTable(Table, Data, Size, MaxLog, MaxSymbol, Used));
+            break;
+
+        default:
+            CHECK_ERROR_TRACE(Table->Valid, EFI_VOLUME_CORRUPTED, "Repeat mode with no previous table");
+            break;
+    }
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS CopyLiterals(ZSTD_STATE* State, UINTN* LiteralsPos, UINTN Count) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    DECOMPRESS_STREAM* Stream = State->Stream;
+
+    CHECK_ERROR(*LiteralsPos + Count <= State->LiteralsSize, EFI_VOLUME_CORRUPTED);
+    CHECK_AND_RETHROW(StreamReserveOutput(Stream, Count));
+    CopyMem(Stream->Out + Stream->OutPos, State->Literals + *LiteralsPos, Count);
+    Stream->OutPos += Count;
+    *LiteralsPos += Count;
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS DecodeSequences(ZSTD_STATE* State, UINT8* Data, UINTN Size) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    DECOMPRESS_STREAM* Stream = State->Stream;
+    UINTN LiteralsPos = 0;
+    UINTN Pos = 0;
+    UINTN Used = 0;
+    BACKWARD_BITS Bits;
+
+    // the number of sequences
+    CHECK_ERROR(Size >= 1, EFI_VOLUME_CORRUPTED);
+    UINTN Count = Data[Pos++];
+    if (Count >= 128) {
+        CHECK_ERROR(Size >= Pos + 1, EFI_VOLUME_CORRUPTED);
+        if (Count < 255) {
+            Count = ((Count - 128) << 8) + Data[Pos++];
+        } else {
+            CHECK_ERROR(Size >= Pos + 2, EFI_VOLUME_CORRUPTED);
+            Count = Data[Pos] + (Data[Pos + 1] << 8) + 0x7F00;
+            Pos += 2;
+        }
+    }
+
+    if (Count != 0) {
+        // the tables
+        CHECK_ERROR(Size >= Pos + 1, EFI_VOLUME_CORRUPTED);
+        UINT8 Modes = Data[Pos++];
+        CHECK_ERROR((Modes & 3) == 0, EFI_VOLUME_CORRUPTED);
+        CHECK_AND_RETHROW(ReadSequenceTable(&State->LitLen, Modes >> 6, Data + Pos, Size - Pos, &Used, LitLenDefault, ARRAY_SIZE(LitLenDefault), 6, LL_MAX_LOG, LL_MAX_CODE));
+        Pos += Used;
+        CHECK_AND_RETHROW(ReadSequenceTable(&State->Offset, (Modes >> 4) & 3, Data + Pos, Size - Pos, &Used, OffsetDefault, ARRAY_SIZE(OffsetDefault), 5, OF_MAX_LOG, OF_MAX_CODE));
+        Pos += Used;
+        CHECK_AND_RETHROW(ReadSequenceTable(&State->MatchLen, (Modes >> 2) & 3, Data + Pos, Size - Pos, &Used, MatchLenDefault, ARRAY_SIZE(MatchLenDefault), 6, ML_MAX_LOG, ML_MAX_CODE));
+        Pos += Used;
+
+        // the sequences bit stream is the rest of the block
+        CHECK_ERROR(Pos < Size, EFI_VOLUME_CORRUPTED);
+        CHECK_AND_RETHROW(InitBackward(&Bits, Data + Pos, Size - Pos));
+
+        FSE_ENTRY* LitLenEntries = State->LitLen.Entries;
+        FSE_ENTRY* OffsetEntries = State->Offset.Entries;
+        FSE_ENTRY* MatchLenEntries = State->MatchLen.Entries;
+        UINTN LitLenState = ReadBackward(&Bits, State->LitLen.Log);
+        UINTN OffsetState = ReadBackward(&Bits, State->Offset.Log);
+        UINTN MatchLenState = ReadBackward(&Bits, State->MatchLen.Log);
+
+        for (int i = 0; i < Count; i++) {
+            UINT8 OffsetCode = OffsetEntries[OffsetState].Symbol;
+            UINT8 MatchLenCode = MatchLenEntries[MatchLenState].Symbol;
+            UINT8 LitLenCode = LitLenEntries[LitLenState].Symbol;
+            CHECK_ERROR(OffsetCode <= OF_MAX_CODE, EFI_VOLUME_CORRUPTED);
+
+            UINT64 OffsetValue = (1ull << OffsetCode) + ReadBackward(&Bits, OffsetCode);
+            UINTN MatchLength = MatchLenBase[MatchLenCode] + (UINTN)ReadBackward(&Bits, MatchLenBits[MatchLenCode]);
+            UINTN LiteralLength = LitLenBase[LitLenCode] + (UINTN)ReadBackward(&Bits, LitLenBits[LitLenCode]);
+
+            if (i + 1 < Count) {
+                LitLenState = LitLenEntries[LitLenState].Base + ReadBackward(&Bits, LitLenEntries[LitLenState].Bits);
+                MatchLenState = MatchLenEntries[MatchLenState].Base + ReadBackward(&Bits, MatchLenEntries[MatchLenState].Bits);
+                OffsetState = OffsetEntries[OffsetState].Base + ReadBackward(&Bits, OffsetEntries[OffsetState].Bits);
+            }
+
+            // resolve the repeat offsets
+            UINT64 Offset = 0;
+            if (OffsetValue > 3) {
+                Offset = OffsetValue - 3;
+                State->Rep[2] = State->Rep[1];
+                State->Rep[1] = State->Rep[0];
+                State->Rep[0] = Offset;
+            } else {
+                UINTN Index = OffsetValue - 1 + (LiteralLength == 0 ? 1 : 0);
+                if (Index == 0) {
+                    Offset = State->Rep[0];
+                } else {
+                    Offset = Index == 3 ? State->Rep[0] - 1 : State->Rep[Index];
+                    if (Index != 1) {
+                        State->Rep[2] = State->Rep[1];
+                    }
+                    State->Rep[1] = State->Rep[0];
+                    State->Rep[0] = Offset;
+                }
+            }
+
+            // execute the sequence
+            CHECK_AND_RETHROW(CopyLiterals(State, &LiteralsPos, LiteralLength));
+            CHECK_ERROR_TRACE(Offset != 0 && Offset <= Stream->OutPos - State->FrameStart, EFI_VOLUME_CORRUPTED, "Invalid zstd match offset");
+            CHECK_AND_RETHROW(StreamReserveOutput(Stream, MatchLength));
+            UINT8* Out = Stream->Out + Stream->OutPos;
+            UINT8* From = Out - Offset;
+            if (Offset >= MatchLength) {
+                CopyMem(Out, From, MatchLength);
+            } else {
+                for (int j = 0; j < MatchLength; j++) {
+                    Out[j] = From[j];
+                }
+            }
+            Stream->OutPos += MatchLength;
+        }
+
+        CHECK_ERROR_TRACE(Bits.Left == 0, EFI_VOLUME_CORRUPTED, "Invalid zstd sequence stream");
+    } else {
+        CHECK_ERROR(Pos == Size, EFI_VOLUME_CORRUPTED);
+    }
+
+    // whatever literals are left
+    CHECK_AND_RETHROW(CopyLiterals(State, &LiteralsPos, State->LiteralsSize - LiteralsPos));
+
+cleanup:
+    return Status;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Frames
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static EFI_STATUS ReadLe(DECOMPRESS_STREAM* Stream, UINTN Size, UINT64* Value) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8 Bytes[8];
+
+    CHECK(Size <= sizeof(Bytes));
+    CHECK_AND_RETHROW(StreamReadBytes(Stream, Bytes, Size));
+    *Value = 0;
+    for (int i = 0; i < Size; i++) {
+        *Value |= (UINT64)Bytes[i] << (i * 8);
+    }
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS ZstdFrame(ZSTD_STATE* State) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    DECOMPRESS_STREAM* Stream = State->Stream;
+    static UINT8 DictIdSizes[] = { 0, 1, 2, 4 };
+    static UINT8 ContentSizeSizes[] = { 0, 2, 4, 8 };
+    UINT8 Descriptor = 0;
+    UINT64 Value = 0;
+
+    CHECK_AND_RETHROW(StreamReadByte(Stream, &Descriptor));
+    CHECK_ERROR_TRACE((Descriptor & BIT3) == 0, EFI_VOLUME_CORRUPTED, "Invalid zstd frame header");
+    BOOLEAN SingleSegment = (Descriptor & BIT5) != 0;
+
+    // we use the whole output as the window so we don't care
+    // about its size, and the content size is only a hint
+    if (!SingleSegment) {
+        CHECK_AND_RETHROW(ReadLe(Stream, 1, &Value));
+    }
+    CHECK_AND_RETHROW(ReadLe(Stream, DictIdSizes[Descriptor & 3], &Value));
+    CHECK_ERROR_TRACE(Value == 0, EFI_UNSUPPORTED, "zstd dictionaries are not supported");
+    UINTN ContentSizeSize = ContentSizeSizes[Descriptor >> 6];
+    if (ContentSizeSize == 0 && SingleSegment) {
+        ContentSizeSize = 1;
+    }
+    CHECK_AND_RETHROW(ReadLe(Stream, ContentSizeSize, &Value));
+
+    // every frame starts fresh
+    State->FrameStart = Stream->OutPos;
+    State->Huffman.Valid = FALSE;
+    State->LitLen.Valid = FALSE;
+    State->Offset.Valid = FALSE;
+    State->MatchLen.Valid = FALSE;
+    State->Rep[0] = 1;
+    State->Rep[1] = 4;
+    State->Rep[2] = 8;
+
+    BOOLEAN Last = FALSE;
+    while (!Last) {
+        CHECK_AND_RETHROW(ReadLe(Stream, 3, &Value));
+        Last = (Value & 1) != 0;
+        UINTN Type = (Value >> 1) & 3;
+        UINTN BlockSize = Value >> 3;
+
+        switch (Type) {
+            // raw
+            case 0:
+                CHECK_AND_RETHROW(StreamReserveOutput(Stream, BlockSize));
+                CHECK_AND_RETHROW(StreamReadBytes(Stream, Stream->Out + Stream->OutPos, BlockSize));
+                Stream->OutPos += BlockSize;
+                break;
+
+            // rle
+            case 1: {
+                UINT8 Byte = 0;
+                CHECK_AND_RETHROW(StreamReadByte(Stream, &Byte));
+                CHECK_AND_RETHROW(StreamReserveOutput(Stream, BlockSize));
+                SetMem(Stream->Out + Stream->OutPos, BlockSize, Byte);
+                Stream->OutPos += BlockSize;
+            } break;
+
+            // compressed
+            case 2: {
+                UINTN Used = 0;
+                CHECK_ERROR_TRACE(BlockSize <= ZSTD_BLOCK_SIZE_MAX, EFI_VOLUME_CORRUPTED, "zstd block is too big");
+                CHECK_AND_RETHROW(StreamReadBytes(Stream, State->Block, BlockSize));
+                CHECK_AND_RETHROW(DecodeLiterals(State, State->Block, BlockSize, &Used));
+                CHECK_AND_RETHROW(DecodeSequences(State, State->Block + Used, BlockSize - Used));
+            } break;
+
+            default:
+                CHECK_FAIL_ERROR(EFI_VOLUME_CORRUPTED);
+        }
+    }
+
+    // the checksum, not verified
+    if (Descriptor & BIT2) {
+        CHECK_AND_RETHROW(ReadLe(Stream, 4, &Value));
+    }
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS ZstdDecompress(DECOMPRESS_STREAM* Stream) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    ZSTD_STATE* State = NULL;
+    BOOLEAN AtEnd = FALSE;
+    UINT64 Magic = 0;
+
+    State = AllocateZeroPool(sizeof(ZSTD_STATE));
+    CHECK_ERROR(State != NULL, EFI_OUT_OF_RESOURCES);
+    State->Stream = Stream;
+
+    do {
+        CHECK_AND_RETHROW(ReadLe(Stream, 4, &Magic));
+        if (Magic == ZSTD_MAGIC) {
+            CHECK_AND_RETHROW(ZstdFrame(State));
+        } else if ((Magic & 0xFFFFFFF0) == 0x184D2A50) {
+            // skippable frame
+            UINT64 Size = 0;
+            UINT8 Byte = 0;
+            CHECK_AND_RETHROW(ReadLe(Stream, 4, &Size));
+            for (UINT64 i = 0; i < Size; i++) {
+                CHECK_AND_RETHROW(StreamReadByte(Stream, &Byte));
+            }
+        } else {
+            CHECK_FAIL_TRACE("Invalid zstd frame magic %x", Magic);
+        }
+
+        CHECK_AND_RETHROW(StreamAtEnd(Stream, &AtEnd));
+    } while (!AtEnd);
+
+cleanup:
+    if (State != NULL) {
+        FreePool(State);
+    }
+
+    return Status;
+}
@@ -0,0 +1,198 @@
+#include "KernelImage.h"
+
+#include "Prefetch.h"
+
+#include <util/FileUtils.h>
+#include <util/TaskRuntime.h>
+#include <util/Except.h>
+
+#include <Library/FileHandleLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+static KERNEL_IMAGE* mKernelImage = NULL;
+
+void CloseKernelImage() {
+    KERNEL_IMAGE* Image = mKernelImage;
+    if (Image == NULL) {
+        return;
+    }
+    mKernelImage = NULL;
+
+    if (Image->SectionHeaders != NULL) {
+        FreePool(Image->SectionHeaders);
+    }
+
+    if (Image->ProgramHeaders != NULL) {
+        FreePool(Image->ProgramHeaders);
+    }
+
+    if (Image->HeadPrefetched) {
+        gBS->FreePages((EFI_PHYSICAL_ADDRESS)Image->Head, EFI_SIZE_TO_PAGES(Image->HeadSize));
+    } else if (Image->Head != NULL) {
+        FreePool(Image->Head);
+    }
+
+    if (Image->File != NULL) {
+        FileHandleClose(Image->File);
+    }
+
+    if (Image->Root != NULL) {
+        FileHandleClose(Image->Root);
+    }
+
+    FreePool(Image);
+}
+
+EFI_STATUS OpenKernelImage(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Fs, CHAR16* Path, KERNEL_IMAGE** Image) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK(Fs != NULL);
+    CHECK(Path != NULL);
+    CHECK(Image != NULL);
+
+    // reuse the image if this is the same file
+    if (mKernelImage != NULL) {
+        if (mKernelImage->Fs == Fs && StrCmp(mKernelImage->Path, Path) == 0) {
+            *Image = mKernelImage;
+            goto cleanup;
+        }
+
+        CloseKernelImage();
+    }
+
+    mKernelImage = AllocateZeroPool(sizeof(KERNEL_IMAGE));
+    CHECK_ERROR(mKernelImage != NULL, EFI_OUT_OF_RESOURCES);
+    mKernelImage->Fs = Fs;
+    mKernelImage->Path = Path;
+
+    // open the executable file
+    Print(L"Loading image `%s`\n", Path);
+
+    // the whole file was already read during the menu countdown,
+    // use it as the head so nothing needs to go to the disk
+    UINTN PrefetchBase = 0;
+    UINTN PrefetchSize = 0;
+    if (TakePrefetchedFile(Fs, Path, &PrefetchBase, &PrefetchSize)) {
+        mKernelImage->Head = (UINT8*)PrefetchBase;
+        mKernelImage->HeadSize = PrefetchSize;
+        mKernelImage->HeadPrefetched = TRUE;
+        mKernelImage->Size = PrefetchSize;
+        *Image = mKernelImage;
+        goto cleanup;
+    }
+
+    EFI_CHECK(Fs->OpenVolume(Fs, &mKernelImage->Root));
+    EFI_CHECK(mKernelImage->Root->Open(mKernelImage->Root, &mKernelImage->File, Path, EFI_FILE_MODE_READ, 0));
+    EFI_CHECK(FileHandleGetSize(mKernelImage->File, &mKernelImage->Size));
+
+    // read the head of the file
+    mKernelImage->HeadSize = MIN(mKernelImage->Size, KERNEL_IMAGE_HEAD_SIZE);
+    mKernelImage->Head = AllocatePool(mKernelImage->HeadSize);
+    CHECK_ERROR(mKernelImage->Head != NULL, EFI_OUT_OF_RESOURCES);
+    CHECK_AND_RETHROW(FileRead(mKernelImage->File, mKernelImage->Head, mKernelImage->HeadSize, 0));
+
+    *Image = mKernelImage;
+
+cleanup:
+    if (EFI_ERROR(Status)) {
+        CloseKernelImage();
+    }
+
+    return Status;
+}
+
+EFI_STATUS ReleaseKernelImageRange(KERNEL_IMAGE* Image, EFI_PHYSICAL_ADDRESS Base, UINTN Size) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK(Image != NULL);
+
+    // the modules are just read again
+    ReleasePrefetchedRange(Base, Size);
+
+    if (!Image->HeadPrefetched) {
+        goto cleanup;
+    }
+
+    EFI_PHYSICAL_ADDRESS HeadBase = (EFI_PHYSICAL_ADDRESS)Image->Head;
+    EFI_PHYSICAL_ADDRESS HeadTop = HeadBase + EFI_PAGES_TO_SIZE(EFI_SIZE_TO_PAGES(Image->HeadSize));
+    if (HeadBase >= Base + Size || HeadTop <= Base) {
+        goto cleanup;
+    }
+
+    TRACE("Prefetched image is in the way of %p - %p, reading it from the file", Base, Base + Size);
+
+    // open the file like we would have without the prefetch and
+    // only keep the head, the rest is read from the file again
+    EFI_CHECK(Image->Fs->OpenVolume(Image->Fs, &Image->Root));
+    EFI_CHECK(Image->Root->Open(Image->Root, &Image->File, Image->Path, EFI_FILE_MODE_READ, 0));
+
+    UINTN HeadSize = MIN(Image->Size, KERNEL_IMAGE_HEAD_SIZE);
+    UINT8* Head = AllocateCopyPool(HeadSize, Image->Head);
+    CHECK_ERROR(Head != NULL, EFI_OUT_OF_RESOURCES);
+
+    gBS->FreePages(HeadBase, EFI_SIZE_TO_PAGES(Image->HeadSize));
+    Image->Head = Head;
+    Image->HeadSize = HeadSize;
+    Image->HeadPrefetched = FALSE;
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS KernelImageRead(KERNEL_IMAGE* Image, void* Buffer, UINTN Size, UINTN Offset) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK(Image != NULL);
+    CHECK_TRACE(Offset + Size >= Offset && Offset + Size <= Image->Size, "Read outside of the image (%d bytes at %d)", Size, Offset);
+
+    if (Offset + Size <= Image->HeadSize) {
+        ParallelCopyMem(Buffer, Image->Head + Offset, Size);
+    } else {
+        CHECK_AND_RETHROW(FileRead(Image->File, Buffer, Size, Offset));
+    }
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS GetKernelImageTable(KERNEL_IMAGE* Image, UINTN Offset, UINTN Size, void** Table, UINTN* TableSize, void** Out) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK(Image != NULL);
+    CHECK(Out != NULL);
+
+    // the table is inside of the head, no need to copy it
+    if (Offset + Size <= Image->HeadSize) {
+        *Out = Image->Head + Offset;
+        goto cleanup;
+    }
+
+    // read it once
+    if (*Table == NULL) {
+        *Table = AllocatePool(Size);
+        CHECK_ERROR(*Table != NULL, EFI_OUT_OF_RESOURCES);
+        *TableSize = Size;
+        CHECK_AND_RETHROW(KernelImageRead(Image, *Table, Size, Offset));
+    }
+
+    CHECK(*TableSize == Size);
+    *Out = *Table;
+
+cleanup:
+    if (EFI_ERROR(Status) && *Table != NULL) {
+        FreePool(*Table);
+        *Table = NULL;
+    }
+
+    return Status;
+}
+
+EFI_STATUS GetKernelImageProgramHeaders(KERNEL_IMAGE* Image, UINTN Offset, UINTN Size, void** ProgramHeaders) {
+    return GetKernelImageTable(Image, Offset, Size, &Image->ProgramHeaders, &Image->ProgramHeadersSize, ProgramHeaders);
+}
+
+EFI_STATUS GetKernelImageSectionHeaders(KERNEL_IMAGE* Image, UINTN Offset, UINTN Size, void** SectionHeaders) {
+    return GetKernelImageTable(Image, Offset, Size, &Image->SectionHeaders, &Image->SectionHeadersSize, SectionHeaders);
+}
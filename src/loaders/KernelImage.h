@@ -0,0 +1,72 @@
+#ifndef __LOADERS_KERNELIMAGE_H__
+#define __LOADERS_KERNELIMAGE_H__
+
+#include <Uefi.h>
+#include <Protocol/SimpleFileSystem.h>
+
+/**
+ * How much of the start of the image we read right away, this covers
+ * the elf header (and usually the program headers) and the whole area
+ * in which the multiboot2 header can be found
+ */
+#define KERNEL_IMAGE_HEAD_SIZE SIZE_32KB
+
+/**
+ * A kernel image that is opened once per boot and shared by all
+ * the loaders, the headers and tables are read with a single read
+ * each and served from memory after that
+ */
+typedef struct _KERNEL_IMAGE {
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Fs;
+    CHAR16* Path;
+    EFI_FILE_PROTOCOL* Root;
+    EFI_FILE_PROTOCOL* File;
+    UINT64 Size;
+
+    // the start of the file, or all of it if it was prefetched
+    UINT8* Head;
+    UINTN HeadSize;
+    BOOLEAN HeadPrefetched;
+
+    // the elf tables, read on first use
+    void* ProgramHeaders;
+    UINTN ProgramHeadersSize;
+    void* SectionHeaders;
+    UINTN SectionHeadersSize;
+} KERNEL_IMAGE;
+
+/**
+ * Get the image of the given file, if the same image is already open
+ * it will be returned as is, otherwise the old one will be closed
+ */
+EFI_STATUS OpenKernelImage(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Fs, CHAR16* Path, KERNEL_IMAGE** Image);
+
+/**
+ * Read from the image, served from memory if the range is inside of
+ * the head of the image
+ */
+EFI_STATUS KernelImageRead(KERNEL_IMAGE* Image, void* Buffer, UINTN Size, UINTN Offset);
+
+/**
+ * Get the program header table, read with a single read on first use
+ */
+EFI_STATUS GetKernelImageProgramHeaders(KERNEL_IMAGE* Image, UINTN Offset, UINTN Size, void** ProgramHeaders);
+
+/**
+ * Get the section header table, read with a single read on first use
+ */
+EFI_STATUS GetKernelImageSectionHeaders(KERNEL_IMAGE* Image, UINTN Offset, UINTN Size, void** SectionHeaders);
+
+/**
+ * Make sure the image and the prefetched files are not in the given range, so it
+ * can be allocated at a fixed address. A prefetched image goes back to reading
+ * from the file, so the tables have to be taken again after this.
+ */
+EFI_STATUS ReleaseKernelImageRange(KERNEL_IMAGE* Image, EFI_PHYSICAL_ADDRESS Base, UINTN Size);
+
+/**
+ * Close the cached image and free everything related to it
+ */
+void CloseKernelImage();
+
+#endif //__LOADERS_KERNELIMAGE_H__
@@ -1,11 +1,40 @@
 #include <util/FileUtils.h>
+#include <util/TaskRuntime.h>
+#include <util/Timeline.h>
+#include <util/AcpiUtils.h>
 #include <Library/FileHandleLib.h>
+#include <Library/PrintLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/UefiBootServicesTableLib.h>
 #include <loaders/elf/ElfLoader.h>
+#include <loaders/KernelImage.h>
+#include <loaders/Prefetch.h>
+#include <decompress/Decompress.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/LocalApicLib.h>
 #include "Loaders.h"
 
-EFI_STATUS LoadBootModule(BOOT_MODULE* Module, UINTN* Base, UINTN* Size) {
+EFI_MEMORY_TYPE gBootInfoMemoryType = 0x80000001;
+
+void* AllocateBootInfoPool(UINTN Size) {
+    void* Buffer = NULL;
+    if (EFI_ERROR(gBS->AllocatePool(gBootInfoMemoryType, Size, &Buffer))) {
+        return NULL;
+    }
+    ZeroMem(Buffer, Size);
+    return Buffer;
+}
+
+void* AllocateBootInfoPages(UINTN Pages) {
+    EFI_PHYSICAL_ADDRESS Base = 0;
+    if (EFI_ERROR(gBS->AllocatePages(AllocateAnyPages, gBootInfoMemoryType, Pages, &Base))) {
+        return NULL;
+    }
+    ZeroMem((void*)Base, EFI_PAGES_TO_SIZE(Pages));
+    return (void*)Base;
+}
+
+EFI_STATUS OpenBootModule(BOOT_MODULE* Module, EFI_FILE_PROTOCOL** File, UINTN* Size) {
     EFI_STATUS Status = EFI_SUCCESS;
     EFI_FILE_PROTOCOL* root = NULL;
     EFI_FILE_PROTOCOL* moduleImage = NULL;
@@ -13,16 +42,16 @@ EFI_STATUS LoadBootModule(BOOT_MODULE* Module, UINTN* Base, UINTN* Size) {
     CHECK(Module != NULL);
     CHECK(Module->Fs != NULL);
     CHECK(Module->Path != NULL);
+    CHECK(File != NULL);
+    CHECK(Size != NULL);
 
-    // open the executable file
+    // open the file and get its size
     EFI_CHECK(Module->Fs->OpenVolume(Module->Fs, &root));
     EFI_CHECK(root->Open(root, &moduleImage, Module->Path, EFI_FILE_MODE_READ, 0));
-
-    // read it all
-    *Base = BASE_4GB;
     EFI_CHECK(FileHandleGetSize(moduleImage, Size));
-    EFI_CHECK(gBS->AllocatePages(AllocateMaxAddress, gKernelAndModulesMemoryType, EFI_SIZE_TO_PAGES(*Size), Base));
-    CHECK_AND_RETHROW(FileRead(moduleImage, (void*)*Base, *Size, 0));
+
+    *File = moduleImage;
+    moduleImage = NULL;
 
 cleanup:
     if (root != NULL) {
@@ -33,8 +62,487 @@ cleanup:
         FileHandleClose(moduleImage);
     }
 
-    if (EFI_ERROR(Status) && Base != NULL && Size != NULL) {
-        gBS->FreePages(*Base, EFI_SIZE_TO_PAGES(*Size));
+    return Status;
+}
+
+/**
+ * How much compressed input we read at once, big enough for the
+ * reads to be queued asynchronously
+ */
+#define DECOMPRESS_INPUT_SIZE SIZE_4MB
+
+/**
+ * The best ratio deflate can get, used to not trust a broken gzip size
+ */
+#define DEFLATE_MAX_RATIO 1032
+
+/**
+ * The compressed module, either a file or a prefetched buffer
+ */
+typedef struct _MODULE_INPUT {
+    EFI_FILE_PROTOCOL* File;
+    UINT8* Buffer;
+    UINTN Size;
+    UINTN Offset;
+} MODULE_INPUT;
+
+static EFI_STATUS ReadModuleInput(MODULE_INPUT* Input, void* Buffer, UINTN Size, UINTN Offset) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK(Offset + Size <= Input->Size);
+    if (Input->File != NULL) {
+        CHECK_AND_RETHROW(FileRead(Input->File, Buffer, Size, Offset));
+    } else {
+        CopyMem(Buffer, Input->Buffer + Offset, Size);
+    }
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS ReadCompressedModule(void* Context, void* Buffer, UINTN* Size) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    MODULE_INPUT* Input = Context;
+
+    *Size = MIN(*Size, Input->Size - Input->Offset);
+    CHECK_AND_RETHROW(ReadModuleInput(Input, Buffer, *Size, Input->Offset));
+    Input->Offset += *Size;
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS GrowDecompressedModule(void* Context, UINT8** Buffer, UINTN* Size, UINTN NeededSize) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    PLACEMENT_REQUEST* Request = Context;
+
+    // the output is the window so it has to be moved as a whole
+    UINTN NewSize = MAX(NeededSize, *Size * 2);
+    EFI_PHYSICAL_ADDRESS NewBase = 0;
+    Request->Pages = EFI_SIZE_TO_PAGES(NewSize);
+    CHECK_AND_RETHROW(AllocatePlacedPages(Request, &NewBase));
+    ParallelCopyMem((void*)NewBase, *Buffer, *Size);
+    gBS->FreePages((EFI_PHYSICAL_ADDRESS)*Buffer, EFI_SIZE_TO_PAGES(*Size));
+
+    *Buffer = (UINT8*)NewBase;
+    *Size = EFI_PAGES_TO_SIZE(EFI_SIZE_TO_PAGES(NewSize));
+
+cleanup:
+    return Status;
+}
+
+/**
+ * A module on its way to its place, the input stays open until it is loaded
+ */
+typedef struct _MODULE_LOAD {
+    BOOT_MODULE* Module;
+    MODULE_INPUT Input;
+    UINTN PrefetchBase;
+    UINT8 Head[DECOMPRESS_HEAD_SIZE];
+    UINTN HeadSize;
+    COMPRESSION_FORMAT Format;
+
+    // the slot of the module in the packed region of its memory region,
+    // modules we could not size up front are placed on their own
+    PLACEMENT_REGION Region;
+    BOOLEAN Packed;
+    UINTN SlotOffset;
+    UINTN SlotSize;
+} MODULE_LOAD;
+
+static EFI_STATUS OpenModuleLoad(BOOT_MODULE* Module, MODULE_LOAD* Load) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    Load->Module = Module;
+
+    // either it was already read during the menu countdown, or
+    // open the file so we can check what it is
+    if (TakePrefetchedFile(Module->Fs, Module->Path, &Load->PrefetchBase, &Load->Input.Size)) {
+        Load->Input.Buffer = (UINT8*)Load->PrefetchBase;
+    } else {
+        CHECK_AND_RETHROW(OpenBootModule(Module, &Load->Input.File, &Load->Input.Size));
+    }
+
+    // check if the module is compressed
+    Load->HeadSize = MIN(sizeof(Load->Head), Load->Input.Size);
+    CHECK_AND_RETHROW(ReadModuleInput(&Load->Input, Load->Head, Load->HeadSize, 0));
+    Load->Format = DetectCompression(Load->Head, Load->HeadSize);
+
+cleanup:
+    return Status;
+}
+
+static void CloseModuleLoad(MODULE_LOAD* Load) {
+    if (Load->Input.File != NULL) {
+        FileHandleClose(Load->Input.File);
+        Load->Input.File = NULL;
+    }
+
+    if (Load->PrefetchBase != 0) {
+        gBS->FreePages(Load->PrefetchBase, EFI_SIZE_TO_PAGES(Load->Input.Size));
+        Load->PrefetchBase = 0;
+    }
+}
+
+/**
+ * The decompressed size from the headers, 0 if they don't tell or can't be trusted
+ */
+static EFI_STATUS MeasureCompressedModule(MODULE_LOAD* Load, UINT64* OutputSize) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8 Tail[4];
+
+    UINTN TailSize = MIN(sizeof(Tail), Load->Input.Size);
+    CHECK_AND_RETHROW(ReadModuleInput(&Load->Input, Tail, TailSize, Load->Input.Size - TailSize));
+    *OutputSize = GetDecompressedSize(Load->Format, Load->Head, Load->HeadSize, TailSize == sizeof(Tail) ? Tail : NULL);
+    if (Load->Format == COMPRESSION_GZIP && *OutputSize > (UINT64)Load->Input.Size * DEFLATE_MAX_RATIO) {
+        *OutputSize = 0;
+    }
+
+cleanup:
+    return Status;
+}
+
+/**
+ * Decompress the whole module into the output of the stream, the
+ * compressed file is only ever read a chunk at a time
+ */
+static EFI_STATUS DecompressModule(MODULE_LOAD* Load, DECOMPRESS_STREAM* Stream) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    Load->Input.Offset = 0;
+    Stream->Read = ReadCompressedModule;
+    Stream->ReadContext = &Load->Input;
+    Stream->In = AllocatePool(DECOMPRESS_INPUT_SIZE);
+    CHECK_ERROR(Stream->In != NULL, EFI_OUT_OF_RESOURCES);
+    Stream->InCapacity = DECOMPRESS_INPUT_SIZE;
+
+    CHECK_AND_RETHROW(Decompress(Load->Format, Stream));
+
+cleanup:
+    if (Stream->In != NULL) {
+        FreePool(Stream->In);
+        Stream->In = NULL;
+    }
+
+    return Status;
+}
+
+static void GetRegionPlacement(BOOT_ENTRY* Entry, CONST PLACEMENT_POLICY* Policy, PLACEMENT_REGION Region, UINTN Size, PLACEMENT_REQUEST* Request) {
+    UINT32 Domain = GetPlacementDomain(Entry);
+    Request->Type = gKernelAndModulesMemoryType;
+    Request->Pages = EFI_SIZE_TO_PAGES(Size);
+    Request->MinAddress = 0;
+    Request->MaxAddress = Region == PLACEMENT_HIGH ? MAX_UINT64 : BASE_4GB - 1;
+    Request->Alignment = Policy->Alignment;
+    Request->PreferHigh = Region == PLACEMENT_HIGH;
+    Request->PreferDomain = Domain != NUMA_NO_DOMAIN;
+    Request->Domain = Domain;
+}
+
+static EFI_STATUS LoadCompressedModule(BOOT_ENTRY* Entry, CONST PLACEMENT_POLICY* Policy, MODULE_LOAD* Load, UINTN* Base, UINTN* Size) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    PLACEMENT_REQUEST Request = { 0 };
+    DECOMPRESS_STREAM Stream = {
+        .Grow = GrowDecompressedModule,
+        .GrowContext = &Request,
+    };
+
+    // size the output from the headers if we can, otherwise guess and grow as needed
+    UINT64 OutputSize = 0;
+    CHECK_AND_RETHROW(MeasureCompressedModule(Load, &OutputSize));
+    if (OutputSize == 0) {
+        OutputSize = (UINT64)Load->Input.Size * 4;
+    }
+
+    EFI_PHYSICAL_ADDRESS Output = 0;
+    GetRegionPlacement(Entry, Policy, GetModuleRegion(Entry, Load->Module), OutputSize, &Request);
+    CHECK_AND_RETHROW(AllocatePlacedPages(&Request, &Output));
+    Stream.Out = (UINT8*)Output;
+    Stream.OutCapacity = EFI_PAGES_TO_SIZE(EFI_SIZE_TO_PAGES(OutputSize));
+
+    CHECK_AND_RETHROW(DecompressModule(Load, &Stream));
+
+    // give back whatever we did not use
+    UINTN UsedPages = MAX(1, EFI_SIZE_TO_PAGES(Stream.OutPos));
+    UINTN Pages = EFI_SIZE_TO_PAGES(Stream.OutCapacity);
+    if (Pages > UsedPages) {
+        gBS->FreePages((EFI_PHYSICAL_ADDRESS)Stream.Out + EFI_PAGES_TO_SIZE(UsedPages), Pages - UsedPages);
+    }
+
+    *Base = (UINTN)Stream.Out;
+    *Size = Stream.OutPos;
+    Stream.Out = NULL;
+
+cleanup:
+    if (Stream.Out != NULL) {
+        gBS->FreePages((EFI_PHYSICAL_ADDRESS)Stream.Out, EFI_SIZE_TO_PAGES(Stream.OutCapacity));
+    }
+
+    return Status;
+}
+
+PLACEMENT_REGION GetModuleRegion(BOOT_ENTRY* Entry, BOOT_MODULE* Module) {
+    PLACEMENT_REGION Region = Entry->Placement.Region;
+    if (Module != NULL && Module->Region != PLACEMENT_DEFAULT) {
+        Region = Module->Region;
+    }
+
+    switch (Entry->Protocol) {
+        case BOOT_MB2:
+            return PLACEMENT_LOW;
+
+        case BOOT_LINUX:
+        case BOOT_STIVALE2:
+            return Region == PLACEMENT_DEFAULT ? PLACEMENT_HIGH : Region;
+
+        default:
+            return Region == PLACEMENT_DEFAULT ? PLACEMENT_LOW : Region;
+    }
+}
+
+UINT32 GetPlacementDomain(BOOT_ENTRY* Entry) {
+    if (Entry->Placement.HasDomain) {
+        return Entry->Placement.Domain;
+    }
+
+    // we only ever load on the BSP
+    return GetProcessorDomain(GetApicId());
+}
+
+void GetBootInfoPlacement(BOOT_ENTRY* Entry, UINTN Size, PLACEMENT_REQUEST* Request) {
+    UINT32 Domain = GetPlacementDomain(Entry);
+    Request->Type = gBootInfoMemoryType;
+    Request->Pages = EFI_SIZE_TO_PAGES(Size);
+    Request->MinAddress = 0;
+    Request->MaxAddress = BASE_4GB - 1;
+    Request->Alignment = 0;
+    Request->PreferHigh = FALSE;
+    Request->PreferDomain = Domain != NUMA_NO_DOMAIN;
+    Request->Domain = Domain;
+}
+
+void GetModulePlacement(BOOT_ENTRY* Entry, BOOT_MODULE* Module, UINTN Size, PLACEMENT_REQUEST* Request) {
+    GetRegionPlacement(Entry, &Entry->Placement, GetModuleRegion(Entry, Module), Size, Request);
+}
+
+/**
+ * Place the module in an allocation of its own
+ */
+static EFI_STATUS PlaceModule(BOOT_ENTRY* Entry, CONST PLACEMENT_POLICY* Policy, MODULE_LOAD* Load, LOADED_MODULE* Loaded) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Load->Format != COMPRESSION_NONE) {
+        CHECK_AND_RETHROW(LoadCompressedModule(Entry, Policy, Load, &Loaded->Base, &Loaded->Size));
+
+    } else if (Load->PrefetchBase != 0 && GetPlacementAlignment(Load->PrefetchBase) >= Policy->Alignment) {
+        // use the prefetched buffer as is, it was placed like any other module
+        Loaded->Base = Load->PrefetchBase;
+        Loaded->Size = Load->Input.Size;
+        Load->PrefetchBase = 0;
+
+    } else {
+        // read it all, or move the prefetched copy if the kernel
+        // asked for a better alignment after it was prefetched
+        PLACEMENT_REQUEST Request = { 0 };
+        EFI_PHYSICAL_ADDRESS NewBase = 0;
+        GetRegionPlacement(Entry, Policy, GetModuleRegion(Entry, Load->Module), Load->Input.Size, &Request);
+        CHECK_AND_RETHROW(AllocatePlacedPages(&Request, &NewBase));
+        Loaded->Base = NewBase;
+        Loaded->Size = Load->Input.Size;
+        if (Load->PrefetchBase != 0) {
+            ParallelCopyMem((void*)Loaded->Base, (void*)Load->PrefetchBase, Loaded->Size);
+        } else {
+            CHECK_AND_RETHROW(FileRead(Load->Input.File, (void*)Loaded->Base, Loaded->Size, 0));
+        }
+    }
+
+cleanup:
+    if (EFI_ERROR(Status) && Loaded->Base != 0) {
+        gBS->FreePages(Loaded->Base, EFI_SIZE_TO_PAGES(Loaded->Size));
+        Loaded->Base = 0;
+        Loaded->Size = 0;
+    }
+
+    return Status;
+}
+
+/**
+ * Stream the module into its slot of the packed region, the slot is exactly as
+ * big as the module said it would be so there is no growing the output
+ */
+static EFI_STATUS FillModuleSlot(MODULE_LOAD* Load, UINT8* Slot, LOADED_MODULE* Loaded) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Load->Format != COMPRESSION_NONE) {
+        DECOMPRESS_STREAM Stream = {
+            .Out = Slot,
+            .OutCapacity = Load->SlotSize,
+        };
+        CHECK_AND_RETHROW(DecompressModule(Load, &Stream));
+        Loaded->Size = Stream.OutPos;
+    } else if (Load->PrefetchBase != 0) {
+        ParallelCopyMem(Slot, (void*)Load->PrefetchBase, Load->Input.Size);
+        Loaded->Size = Load->Input.Size;
+    } else {
+        CHECK_AND_RETHROW(FileRead(Load->Input.File, Slot, Load->Input.Size, 0));
+        Loaded->Size = Load->Input.Size;
+    }
+    Loaded->Base = (UINTN)Slot;
+
+cleanup:
+    return Status;
+}
+
+static EFI_STATUS LoadModule(BOOT_ENTRY* Entry, CONST PLACEMENT_POLICY* Policy, MODULE_LOAD* Load, UINT8* Region, LOADED_MODULE* Loaded) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHAR8 PhaseName[TIMELINE_NAME_SIZE];
+    AsciiSPrint(PhaseName, sizeof(PhaseName), "module %s", Load->Module->Tag);
+    UINTN Phase = TimelineBegin(PhaseName);
+
+    if (Load->Format != COMPRESSION_NONE) {
+        Print(L"Decompressing module `%s`\n", Load->Module->Path);
+    }
+
+    // a module that does not fit the slot it was measured for is placed on its
+    // own, its slot is left as a hole in the region, anything else is an error
+    if (Region != NULL && Load->Packed) {
+        Status = FillModuleSlot(Load, Region + Load->SlotOffset, Loaded);
+        if (Status == EFI_BUFFER_TOO_SMALL) {
+            WARN("Module `%s` does not fit its slot, placing it on its own", Load->Module->Path);
+            Load->Packed = FALSE;
+            Status = EFI_SUCCESS;
+        }
+        CHECK_AND_RETHROW(Status);
+    }
+
+    if (Region == NULL || !Load->Packed) {
+        CHECK_AND_RETHROW(PlaceModule(Entry, Policy, Load, Loaded));
+    }
+
+    Loaded->Alignment = GetPlacementAlignment(Loaded->Base);
+    Loaded->Domain = GetMemoryDomain(Loaded->Base);
+    WARN_ON(Loaded->Alignment < Policy->Alignment, "Module `%s` is only aligned to %lx", Load->Module->Path, Loaded->Alignment);
+
+cleanup:
+    TimelineEnd(Phase);
+    CloseModuleLoad(Load);
+
+    return Status;
+}
+
+/**
+ * The packed region of all the modules going to the same part of the memory
+ */
+typedef struct _MODULE_REGION {
+    EFI_PHYSICAL_ADDRESS Base;
+    UINTN Pages;
+    UINT64 Size;
+} MODULE_REGION;
+
+EFI_STATUS LoadBootModules(BOOT_ENTRY* Entry, CONST PLACEMENT_POLICY* Policy, LOADED_MODULE* Loaded, UINTN Count) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    MODULE_LOAD* Loads = NULL;
+    MODULE_REGION Regions[PLACEMENT_HIGH + 1] = { 0 };
+    UINTN Phase = MAX_UINTN;
+
+    CHECK(Entry != NULL);
+    CHECK(Policy != NULL);
+    CHECK(Loaded != NULL || Count == 0);
+    if (Count == 0) {
+        goto cleanup;
+    }
+
+    Loads = AllocateZeroPool(sizeof(MODULE_LOAD) * Count);
+    CHECK_ERROR(Loads != NULL, EFI_OUT_OF_RESOURCES);
+
+    // open all of them first to learn how big the regions have to be, every
+    // slot starts at the alignment of the entry just like a module on its
+    // own would, compressed modules take the size their headers claim
+    Phase = TimelineBegin("measure modules");
+    UINTN Alignment = MAX(Policy->Alignment, EFI_PAGE_SIZE);
+    UINTN Index = 0;
+    for (LIST_ENTRY* Link = Entry->BootModules.ForwardLink; Link != &Entry->BootModules; Link = Link->ForwardLink, Index++) {
+        CHECK(Index < Count);
+        MODULE_LOAD* Load = &Loads[Index];
+        CHECK_AND_RETHROW(OpenModuleLoad(BASE_CR(Link, BOOT_MODULE, Link), Load));
+        Load->Region = GetModuleRegion(Entry, Load->Module);
+
+        UINT64 Size = Load->Input.Size;
+        if (Load->Format != COMPRESSION_NONE) {
+            CHECK_AND_RETHROW(MeasureCompressedModule(Load, &Size));
+            if (Size == 0) {
+                continue;
+            }
+        }
+
+        MODULE_REGION* Region = &Regions[Load->Region];
+        Load->Packed = TRUE;
+        Load->SlotOffset = ALIGN_VALUE(Region->Size, Alignment);
+        Load->SlotSize = Size;
+        Region->Size = Load->SlotOffset + Size;
+    }
+    CHECK(Index == Count);
+    TimelineEnd(Phase);
+    Phase = MAX_UINTN;
+
+    // one region for each part of the memory, if the memory is too
+    // fragmented for that its modules are placed on their own instead
+    for (UINTN i = 0; i < ARRAY_SIZE(Regions); i++) {
+        if (Regions[i].Size == 0) {
+            continue;
+        }
+
+        PLACEMENT_REQUEST Request = { 0 };
+        GetRegionPlacement(Entry, Policy, i, Regions[i].Size, &Request);
+        if (EFI_ERROR(AllocatePlacedPages(&Request, &Regions[i].Base))) {
+            WARN("No room for one module region of %ld bytes, placing modules on their own", Regions[i].Size);
+            Regions[i].Base = 0;
+        } else {
+            Regions[i].Pages = Request.Pages;
+        }
+    }
+
+    for (Index = 0; Index < Count; Index++) {
+        CHECK_AND_RETHROW(LoadModule(Entry, Policy, &Loads[Index], (UINT8*)Regions[Loads[Index].Region].Base, &Loaded[Index]));
+    }
+
+    // give back the end of the regions if the compressed modules came out smaller
+    for (UINTN i = 0; i < ARRAY_SIZE(Regions); i++) {
+        if (Regions[i].Base == 0) {
+            continue;
+        }
+
+        UINTN UsedSize = 0;
+        for (Index = 0; Index < Count; Index++) {
+            if (Loads[Index].Packed && Loads[Index].Region == i) {
+                UsedSize = MAX(UsedSize, Loads[Index].SlotOffset + Loaded[Index].Size);
+            }
+        }
+
+        UINTN UsedPages = EFI_SIZE_TO_PAGES(UsedSize);
+        if (Regions[i].Pages > UsedPages) {
+            gBS->FreePages(Regions[i].Base + EFI_PAGES_TO_SIZE(UsedPages), Regions[i].Pages - UsedPages);
+        }
+        TRACE("Packed modules in %p - %p", Regions[i].Base, Regions[i].Base + EFI_PAGES_TO_SIZE(UsedPages));
+    }
+
+cleanup:
+    TimelineEnd(Phase);
+
+    if (Loads != NULL) {
+        for (UINTN Index = 0; Index < Count; Index++) {
+            CloseModuleLoad(&Loads[Index]);
+        }
+        FreePool(Loads);
+    }
+
+    if (EFI_ERROR(Status)) {
+        for (UINTN i = 0; i < ARRAY_SIZE(Regions); i++) {
+            if (Regions[i].Base != 0) {
+                gBS->FreePages(Regions[i].Base, Regions[i].Pages);
+            }
+        }
     }
 
     return Status;
@@ -45,6 +553,12 @@ EFI_STATUS LoadKernel(BOOT_ENTRY* Entry) {
 
     CHECK(Entry != NULL);
 
+    // whatever was prefetched for another entry is of no use now
+    CancelPrefetch(Entry);
+
+    // get the APs going so the loader can spread its work on them
+    WARN_ON(EFI_ERROR(StartTaskRuntime()), "Failed to start the task runtime, running on the BSP only");
+
     gST->ConOut->ClearScreen(gST->ConOut);
     gST->ConOut->SetCursorPosition(gST->ConOut, 0, 0);
 
@@ -70,5 +584,10 @@ EFI_STATUS LoadKernel(BOOT_ENTRY* Entry) {
     }
 
 cleanup:
+    // we only get here if the boot failed
+    StopTaskRuntime();
+    CloseKernelImage();
+    CancelPrefetch(NULL);
+
     return Status;
 }
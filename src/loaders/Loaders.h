@@ -2,12 +2,76 @@
 #define __LOADERS_LOADERS_H__
 
 #include <config/BootEntries.h>
+#include <loaders/Placement.h>
 #include <util/Except.h>
 
 #include <Uefi.h>
 #include <Protocol/SimpleFileSystem.h>
 
-EFI_STATUS LoadBootModule(BOOT_MODULE* Module, UINTN* Base, UINTN* Size);
+/**
+ * This is the memory type of the boot information handed to the kernel,
+ * it is reported as bootloader reclaimable in the memory map
+ */
+extern EFI_MEMORY_TYPE gBootInfoMemoryType;
+
+/**
+ * Allocate zeroed memory for the boot information, for
+ * protocols which pass it in separate allocations
+ */
+void* AllocateBootInfoPool(UINTN Size);
+void* AllocateBootInfoPages(UINTN Pages);
+
+/**
+ * Open the file of the module and get its size, for loaders that
+ * want to read the file directly to its final place
+ */
+EFI_STATUS OpenBootModule(BOOT_MODULE* Module, EFI_FILE_PROTOCOL** File, UINTN* Size);
+
+/**
+ * The region a module of the entry goes to, when neither the module nor the entry
+ * ask for one it is what the protocol prefers. mb2 only has 32bit module addresses
+ * so its modules always go low, linux can still move its initrd low if the kernel
+ * can't take it above 4GB
+ */
+PLACEMENT_REGION GetModuleRegion(BOOT_ENTRY* Entry, BOOT_MODULE* Module);
+
+/**
+ * The NUMA proximity domain everything of the entry is placed in, the one the entry
+ * asks for or the one of the BSP, NUMA_NO_DOMAIN if there is no SRAT
+ */
+UINT32 GetPlacementDomain(BOOT_ENTRY* Entry);
+
+/**
+ * Where the boot information of the entry should be placed, always below 4GB
+ */
+void GetBootInfoPlacement(BOOT_ENTRY* Entry, UINTN Size, PLACEMENT_REQUEST* Request);
+
+/**
+ * Where a module of the entry should be placed, the module is NULL for the kernel file
+ */
+void GetModulePlacement(BOOT_ENTRY* Entry, BOOT_MODULE* Module, UINTN Size, PLACEMENT_REQUEST* Request);
+
+/**
+ * A loaded module, the alignment and domain are the ones it actually
+ * got which might not be what the entry asked for
+ */
+typedef struct _LOADED_MODULE {
+    UINTN Base;
+    UINTN Size;
+    UINTN Alignment;
+    UINT32 Domain;
+} LOADED_MODULE;
+
+/**
+ * Load all the modules of the entry in order, Count is how many modules the entry has.
+ * The alignment comes from the policy, which is the one of the entry unless the kernel
+ * asked for something else (the entry is shared with the menu so it is not changed).
+ *
+ * The sizes are learned before anything is loaded so the modules can be packed into one
+ * region, each at the alignment of the entry, which keeps the memory map the kernel gets
+ * compact. Compressed modules without a size in their headers are placed on their own.
+ */
+EFI_STATUS LoadBootModules(BOOT_ENTRY* Entry, CONST PLACEMENT_POLICY* Policy, LOADED_MODULE* Loaded, UINTN Count);
 
 EFI_STATUS LoadLinuxKernel(BOOT_ENTRY* Entry);
 EFI_STATUS LoadMB2Kernel(BOOT_ENTRY* Entry);
@@ -0,0 +1,180 @@
+#include "MemoryMap.h"
+
+#include <util/Except.h>
+#include <loaders/elf/ElfLoader.h>
+#include <loaders/Loaders.h>
+
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+EFI_STATUS MeasureMemoryMap(UINTN* BufferSize, UINTN* MaxEntries) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8 TmpMemoryMap[1];
+    UINTN MemoryMapSize = sizeof(TmpMemoryMap);
+    UINTN MapKey = 0;
+    UINTN DescriptorSize = 0;
+    UINT32 DescriptorVersion = 0;
+
+    CHECK(BufferSize != NULL);
+    CHECK(MaxEntries != NULL);
+
+    CHECK(gBS->GetMemoryMap(&MemoryMapSize, (EFI_MEMORY_DESCRIPTOR*)TmpMemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion) == EFI_BUFFER_TOO_SMALL);
+    CHECK(DescriptorSize >= sizeof(EFI_MEMORY_DESCRIPTOR));
+
+    // take into account that allocating the buffer and
+    // whatever else comes next will change the map
+    *BufferSize = MemoryMapSize + EFI_PAGE_SIZE;
+    *MaxEntries = *BufferSize / DescriptorSize;
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS SnapshotMemoryMap(MEMORY_MAP* Map) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK(Map != NULL);
+    CHECK(Map->Buffer != NULL);
+
+    Map->MapSize = Map->BufferSize;
+    EFI_CHECK(gBS->GetMemoryMap(&Map->MapSize, (EFI_MEMORY_DESCRIPTOR*)Map->Buffer, &Map->MapKey, &Map->DescriptorSize, &Map->DescriptorVersion));
+
+cleanup:
+    return Status;
+}
+
+static EFI_MEMORY_DESCRIPTOR* GetDescriptor(MEMORY_MAP* Map, UINTN Index) {
+    return (EFI_MEMORY_DESCRIPTOR*)(Map->Buffer + Map->DescriptorSize * Index);
+}
+
+static void SwapDescriptors(MEMORY_MAP* Map, UINTN A, UINTN B) {
+    UINT8* First = (UINT8*)GetDescriptor(Map, A);
+    UINT8* Second = (UINT8*)GetDescriptor(Map, B);
+    for (UINTN i = 0; i < Map->DescriptorSize; i++) {
+        UINT8 Tmp = First[i];
+        First[i] = Second[i];
+        Second[i] = Tmp;
+    }
+}
+
+/**
+ * Insertion sort, firmwares give the map sorted (or almost sorted)
+ * so this is usually a single pass over it
+ */
+static void SortMemoryMap(MEMORY_MAP* Map, UINTN Count) {
+    for (UINTN i = 1; i < Count; i++) {
+        for (UINTN j = i; j > 0 && GetDescriptor(Map, j - 1)->PhysicalStart > GetDescriptor(Map, j)->PhysicalStart; j--) {
+            SwapDescriptors(Map, j - 1, j);
+        }
+    }
+}
+
+static UINT32 TranslateType(CONST MEMORY_MAP_TYPES* Types, UINT32 EfiType) {
+    if (EfiType == gKernelAndModulesMemoryType) {
+        return Types->KernelAndModules;
+    }
+
+    if (EfiType == gBootInfoMemoryType) {
+        return Types->BootInfo;
+    }
+
+    if (EfiType < Types->TableSize && Types->Table[EfiType] != 0) {
+        return Types->Table[EfiType];
+    }
+
+    return Types->Reserved;
+}
+
+UINTN ConvertMemoryMap(MEMORY_MAP* Map, CONST MEMORY_MAP_TYPES* Types, MEMORY_MAP_ENTRY* Output) {
+    UINTN Count = Map->MapSize / Map->DescriptorSize;
+    UINTN OutputCount = 0;
+
+    SortMemoryMap(Map, Count);
+
+    for (UINTN i = 0; i < Count; i++) {
+        EFI_MEMORY_DESCRIPTOR* Desc = GetDescriptor(Map, i);
+        UINT64 Length = EFI_PAGES_TO_SIZE(Desc->NumberOfPages);
+        UINT32 Type = TranslateType(Types, Desc->Type);
+
+        // merge with the last one if it is the same type and right before us
+        if (OutputCount != 0) {
+            MEMORY_MAP_ENTRY* Last = &Output[OutputCount - 1];
+            if (Last->Type == Type && Last->Base + Last->Length == Desc->PhysicalStart) {
+                Last->Length += Length;
+                continue;
+            }
+        }
+
+        MEMORY_MAP_ENTRY* Entry = &Output[OutputCount++];
+        Entry->Base = Desc->PhysicalStart;
+        Entry->Length = Length;
+        Entry->Type = Type;
+        Entry->Unused = 0;
+    }
+
+    return OutputCount;
+}
+
+EFI_STATUS MeasurePageBitmap(CONST MEMORY_MAP_TYPES* Types, UINT32 UsableType, UINT64* PageCount) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    MEMORY_MAP Map = { 0 };
+    UINTN MaxEntries = 0;
+
+    CHECK(Types != NULL);
+    CHECK(PageCount != NULL);
+
+    CHECK_AND_RETHROW(MeasureMemoryMap(&Map.BufferSize, &MaxEntries));
+    Map.Buffer = AllocatePool(Map.BufferSize);
+    CHECK_ERROR(Map.Buffer != NULL, EFI_OUT_OF_RESOURCES);
+    CHECK_AND_RETHROW(SnapshotMemoryMap(&Map));
+
+    *PageCount = 0;
+    for (UINTN Offset = 0; Offset < Map.MapSize; Offset += Map.DescriptorSize) {
+        EFI_MEMORY_DESCRIPTOR* Desc = (EFI_MEMORY_DESCRIPTOR*)(Map.Buffer + Offset);
+        if (TranslateType(Types, Desc->Type) == UsableType) {
+            *PageCount = MAX(*PageCount, Desc->PhysicalStart / EFI_PAGE_SIZE + Desc->NumberOfPages);
+        }
+    }
+
+cleanup:
+    if (Map.Buffer != NULL) {
+        FreePool(Map.Buffer);
+    }
+
+    return Status;
+}
+
+static void SetPageBits(UINT64* Bitmap, UINT64 First, UINT64 End) {
+    // the partial word at the start, then whole words, then the partial word at the end
+    for (; First < End && (First % 64) != 0; First++) {
+        Bitmap[First / 64] |= 1ull << (First % 64);
+    }
+    for (; End - First >= 64; First += 64) {
+        Bitmap[First / 64] = MAX_UINT64;
+    }
+    for (; First < End; First++) {
+        Bitmap[First / 64] |= 1ull << (First % 64);
+    }
+}
+
+UINT64 BuildPageBitmap(CONST MEMORY_MAP_ENTRY* Entries, UINTN Count, UINT32 UsableType, UINT64* Bitmap, UINT64 PageCount) {
+    UINT64 FreePages = 0;
+
+    ZeroMem(Bitmap, ALIGN_VALUE(PageCount, 64) / 8);
+
+    for (UINTN i = 0; i < Count; i++) {
+        if (Entries[i].Type != UsableType) {
+            continue;
+        }
+
+        UINT64 First = EFI_SIZE_TO_PAGES(Entries[i].Base);
+        UINT64 End = MIN((Entries[i].Base + Entries[i].Length) / EFI_PAGE_SIZE, PageCount);
+        if (First < End) {
+            SetPageBits(Bitmap, First, End);
+            FreePages += End - First;
+        }
+    }
+
+    return FreePages;
+}
@@ -0,0 +1,79 @@
+#ifndef __LOADERS_MEMORYMAP_H__
+#define __LOADERS_MEMORYMAP_H__
+
+#include <Uefi.h>
+
+/**
+ * The entry layout shared by stivale, stivale2 and mb2
+ */
+#pragma pack(1)
+typedef struct _MEMORY_MAP_ENTRY {
+    UINT64 Base;
+    UINT64 Length;
+    UINT32 Type;
+    UINT32 Unused;
+} MEMORY_MAP_ENTRY;
+#pragma pack()
+
+/**
+ * How EFI memory types translate to the types of a protocol, types
+ * which are not in the table (or are 0 in it) are reported as Reserved
+ */
+typedef struct _MEMORY_MAP_TYPES {
+    CONST UINT32* Table;
+    UINTN TableSize;
+    UINT32 KernelAndModules;
+    UINT32 BootInfo;
+    UINT32 Reserved;
+} MEMORY_MAP_TYPES;
+
+/**
+ * A snapshot of the EFI memory map, the buffer is provided by the caller
+ */
+typedef struct _MEMORY_MAP {
+    UINT8* Buffer;
+    UINTN BufferSize;
+    UINTN MapSize;
+    UINTN MapKey;
+    UINTN DescriptorSize;
+    UINT32 DescriptorVersion;
+} MEMORY_MAP;
+
+/**
+ * Get the buffer size needed for a snapshot, with room for the changes
+ * that happen until the snapshot is taken, and the most entries it can have
+ */
+EFI_STATUS MeasureMemoryMap(UINTN* BufferSize, UINTN* MaxEntries);
+
+/**
+ * Take the snapshot into the buffer, does not allocate so the map key
+ * can be used right away to exit the boot services
+ */
+EFI_STATUS SnapshotMemoryMap(MEMORY_MAP* Map);
+
+/**
+ * Sort the snapshot and emit it in the protocol format, adjacent ranges
+ * of the same type are merged.
+ *
+ * The output needs room for as many entries as there are descriptors,
+ * returns the amount of entries written. Does not use any boot service.
+ */
+UINTN ConvertMemoryMap(MEMORY_MAP* Map, CONST MEMORY_MAP_TYPES* Types, MEMORY_MAP_ENTRY* Output);
+
+/**
+ * How many pages a bitmap of the free memory has to cover, up to the end of the
+ * highest range in the current map that translates to the usable type (this
+ * includes the boot services memory, which is usable once they are exited)
+ */
+EFI_STATUS MeasurePageBitmap(CONST MEMORY_MAP_TYPES* Types, UINT32 UsableType, UINT64* PageCount);
+
+/**
+ * Set the bit of every page that is fully inside an entry of the usable type,
+ * a set bit is a free page. Pages past the end of the bitmap are left out, they
+ * are still in the memory map. Returns how many pages are free.
+ *
+ * Does not use any boot service.
+ */
+UINT64 BuildPageBitmap(CONST MEMORY_MAP_ENTRY* Entries, UINTN Count, UINT32 UsableType, UINT64* Bitmap, UINT64 PageCount);
+
+#endif //__LOADERS_MEMORYMAP_H__
@@ -0,0 +1,301 @@
+#include "PageTables.h"
+
+#include <util/Except.h>
+#include <loaders/Loaders.h>
+#include <loaders/MemoryMap.h>
+
+#include <Register/Intel/ArchitecturalMsr.h>
+#include <Library/BaseLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+#define PTE_PRESENT         BIT0
+#define PTE_WRITE           BIT1
+#define PTE_HUGE            BIT7
+#define PTE_NX              BIT63
+#define PTE_ADDRESS_MASK    0x000ffffffffff000ull
+
+/**
+ * Level 1 maps 4KB pages, level 2 maps 2MB pages and level 3 maps 1GB pages,
+ * the root is level 4 (or 5)
+ */
+#define LEVEL_SHIFT(level) (12 + 9 * ((level) - 1))
+#define LEVEL_PAGE_SIZE(level) (1ull << LEVEL_SHIFT(level))
+#define LEVEL_INDEX(address, level) (((address) >> LEVEL_SHIFT(level)) & 0x1ff)
+
+/**
+ * How many pages are allocated at once for tables, so building
+ * the tables does not grow the memory map much
+ */
+#define PAGE_TABLES_CHUNK_PAGES 64
+
+/**
+ * Physical memory above this can not be in the HHDM, it would run into the kernel
+ */
+#define HHDM_MAX_PHYSICAL(tables) (PAGE_TABLES_KERNEL_BASE - (tables)->HhdmBase)
+
+static EFI_STATUS AllocateTable(PAGE_TABLES* Tables, UINT64** Table) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    if (Tables->ChunkPages == 0) {
+        EFI_PHYSICAL_ADDRESS Base = BASE_4GB - 1;
+        EFI_CHECK(gBS->AllocatePages(AllocateMaxAddress, gBootInfoMemoryType, PAGE_TABLES_CHUNK_PAGES, &Base));
+        ZeroMem((void*)Base, EFI_PAGES_TO_SIZE(PAGE_TABLES_CHUNK_PAGES));
+        Tables->Chunk = (UINT8*)Base;
+        Tables->ChunkPages = PAGE_TABLES_CHUNK_PAGES;
+    }
+
+    *Table = (UINT64*)Tables->Chunk;
+    Tables->Chunk += EFI_PAGE_SIZE;
+    Tables->ChunkPages--;
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS InitPageTables(PAGE_TABLES* Tables, BOOLEAN Level5) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT32 MaxBasic = 0;
+    UINT32 MaxExtended = 0;
+    UINT32 Ecx = 0;
+    UINT32 Edx = 0;
+
+    CHECK(Tables != NULL);
+    Tables->Chunk = NULL;
+    Tables->ChunkPages = 0;
+    Tables->Levels = 4;
+    Tables->HhdmBase = PAGE_TABLES_HHDM_BASE;
+    Tables->Huge1G = FALSE;
+    Tables->NoExecute = FALSE;
+
+    // LA57 is in the structured extended features
+    AsmCpuid(0, &MaxBasic, NULL, NULL, NULL);
+    if (Level5 && MaxBasic >= 7) {
+        AsmCpuidEx(7, 0, NULL, NULL, &Ecx, NULL);
+        if (Ecx & BIT16) {
+            Tables->Levels = 5;
+            Tables->HhdmBase = PAGE_TABLES_HHDM_BASE_LEVEL5;
+        }
+    }
+    WARN_ON(Level5 && Tables->Levels != 5, "5 level paging is not supported, using 4 level paging");
+
+    // 1GB pages and NX are in the extended features
+    AsmCpuid(0x80000000, &MaxExtended, NULL, NULL, NULL);
+    if (MaxExtended >= 0x80000001) {
+        AsmCpuid(0x80000001, NULL, NULL, NULL, &Edx);
+        Tables->Huge1G = (Edx & BIT26) != 0;
+        Tables->NoExecute = (Edx & BIT20) != 0;
+    }
+
+    CHECK_AND_RETHROW(AllocateTable(Tables, &Tables->Root));
+
+cleanup:
+    return Status;
+}
+
+/**
+ * Get the entry of the address at the given level, creating the tables on
+ * the way, huge pages on the way are split into the next level
+ */
+static EFI_STATUS GetEntry(PAGE_TABLES* Tables, UINT64 Virtual, UINTN Level, UINT64** Entry) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT64* Table = Tables->Root;
+
+    for (UINTN Current = Tables->Levels; Current > Level; Current--) {
+        UINT64* Slot = &Table[LEVEL_INDEX(Virtual, Current)];
+
+        if (!(*Slot & PTE_PRESENT)) {
+            UINT64* Next = NULL;
+            CHECK_AND_RETHROW(AllocateTable(Tables, &Next));
+            *Slot = (UINT64)Next | PTE_PRESENT | PTE_WRITE;
+
+        } else if (*Slot & PTE_HUGE) {
+            // the same mapping with pages of the next level, at the
+            // 4KB level the huge bit is the PAT bit so it goes away
+            UINT64* Next = NULL;
+            CHECK_AND_RETHROW(AllocateTable(Tables, &Next));
+            UINT64 Physical = *Slot & PTE_ADDRESS_MASK;
+            UINT64 Flags = *Slot & ~PTE_ADDRESS_MASK;
+            if (Current - 1 == 1) {
+                Flags &= ~PTE_HUGE;
+            }
+            for (UINTN i = 0; i < 512; i++) {
+                Next[i] = (Physical + i * LEVEL_PAGE_SIZE(Current - 1)) | Flags;
+            }
+            *Slot = (UINT64)Next | PTE_PRESENT | PTE_WRITE;
+        }
+
+        Table = (UINT64*)(*Slot & PTE_ADDRESS_MASK);
+    }
+
+    *Entry = &Table[LEVEL_INDEX(Virtual, Level)];
+
+cleanup:
+    return Status;
+}
+
+static BOOLEAN FitsLevel(UINT64 Virtual, UINT64 Physical, UINT64 Size, UINTN Level) {
+    UINT64 PageSize = LEVEL_PAGE_SIZE(Level);
+    return ((Virtual | Physical) & (PageSize - 1)) == 0 && Size >= PageSize;
+}
+
+EFI_STATUS MapPages(PAGE_TABLES* Tables, UINT64 Virtual, UINT64 Physical, UINT64 Size, UINT32 Permissions) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK(Tables != NULL);
+    CHECK(Tables->Root != NULL);
+    CHECK(((Virtual | Physical | Size) & EFI_PAGE_MASK) == 0);
+
+    // the intermediate tables allow everything, the leaves decide
+    UINT64 Flags = PTE_PRESENT;
+    if (Permissions & PAGE_MAP_WRITE) {
+        Flags |= PTE_WRITE;
+    }
+    if (!(Permissions & PAGE_MAP_EXECUTE) && Tables->NoExecute) {
+        Flags |= PTE_NX;
+    }
+
+    while (Size != 0) {
+        UINTN Level = 1;
+        if (Tables->Huge1G && FitsLevel(Virtual, Physical, Size, 3)) {
+            Level = 3;
+        } else if (FitsLevel(Virtual, Physical, Size, 2)) {
+            Level = 2;
+        }
+
+        UINT64* Entry = NULL;
+        CHECK_AND_RETHROW(GetEntry(Tables, Virtual, Level, &Entry));
+        *Entry = Physical | Flags | (Level > 1 ? PTE_HUGE : 0);
+
+        Virtual += LEVEL_PAGE_SIZE(Level);
+        Physical += LEVEL_PAGE_SIZE(Level);
+        Size -= LEVEL_PAGE_SIZE(Level);
+    }
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS MapPhysicalRange(PAGE_TABLES* Tables, UINT64 Base, UINT64 Size) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK(Tables != NULL);
+
+    // round it to the biggest pages, this maps a bit more than
+    // the range but keeps the amount of entries tiny
+    UINT64 Alignment = Tables->Huge1G ? SIZE_1GB : SIZE_2MB;
+    UINT64 Start = Base & ~(Alignment - 1);
+    UINT64 End = ALIGN_VALUE(Base + Size, Alignment);
+    if (End > HHDM_MAX_PHYSICAL(Tables)) {
+        WARN("Memory above %p can not be mapped (%p-%p)", HHDM_MAX_PHYSICAL(Tables), Base, Base + Size);
+        End = HHDM_MAX_PHYSICAL(Tables);
+    }
+
+    if (Start < End) {
+        CHECK_AND_RETHROW(MapPages(Tables, Start, Start, End - Start, PAGE_MAP_WRITE | PAGE_MAP_EXECUTE));
+        CHECK_AND_RETHROW(MapPages(Tables, Tables->HhdmBase + Start, Start, End - Start, PAGE_MAP_WRITE | PAGE_MAP_EXECUTE));
+    }
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS MapPhysicalMemory(PAGE_TABLES* Tables) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    MEMORY_MAP MemoryMap = { 0 };
+    UINTN MaxEntries = 0;
+
+    // the first 4GB are always mapped, the local apic, the io apic
+    // and usually the framebuffer are in there
+    CHECK_AND_RETHROW(MapPhysicalRange(Tables, 0, SIZE_4GB));
+
+    // everything else the firmware knows about, the tables we allocate
+    // meanwhile change the map but not the memory it covers
+    CHECK_AND_RETHROW(MeasureMemoryMap(&MemoryMap.BufferSize, &MaxEntries));
+    MemoryMap.Buffer = AllocatePool(MemoryMap.BufferSize);
+    CHECK_ERROR(MemoryMap.Buffer != NULL, EFI_OUT_OF_RESOURCES);
+    CHECK_AND_RETHROW(SnapshotMemoryMap(&MemoryMap));
+
+    for (UINTN Offset = 0; Offset < MemoryMap.MapSize; Offset += MemoryMap.DescriptorSize) {
+        EFI_MEMORY_DESCRIPTOR* Desc = (EFI_MEMORY_DESCRIPTOR*)(MemoryMap.Buffer + Offset);
+        UINT64 Length = EFI_PAGES_TO_SIZE(Desc->NumberOfPages);
+        if (Desc->PhysicalStart + Length > SIZE_4GB) {
+            CHECK_AND_RETHROW(MapPhysicalRange(Tables, Desc->PhysicalStart, Length));
+        }
+    }
+
+    // higher half kernels get the first 2GB, the segments
+    // are mapped on top of it with their own permissions
+    CHECK_AND_RETHROW(MapPages(Tables, PAGE_TABLES_KERNEL_BASE, 0, SIZE_2GB, PAGE_MAP_WRITE | PAGE_MAP_EXECUTE));
+
+cleanup:
+    if (MemoryMap.Buffer != NULL) {
+        FreePool(MemoryMap.Buffer);
+    }
+
+    return Status;
+}
+
+static UINT32 GetSegmentPermissions(ELF_SEGMENT* Segment) {
+    UINT32 Permissions = 0;
+    if (Segment->Write) {
+        Permissions |= PAGE_MAP_WRITE;
+    }
+    if (Segment->Execute) {
+        Permissions |= PAGE_MAP_EXECUTE;
+    }
+    return Permissions;
+}
+
+/**
+ * Segments don't have to be page aligned, a page that has
+ * multiple segments in it gets the permissions of all of them
+ */
+static EFI_STATUS MapSharedPage(PAGE_TABLES* Tables, ELF_INFO* Elf, UINT64 Virtual, UINT64 Physical) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT32 Permissions = 0;
+
+    for (UINTN i = 0; i < Elf->SegmentCount; i++) {
+        ELF_SEGMENT* Segment = &Elf->Segments[i];
+        if (Segment->VirtualBase < Virtual + EFI_PAGE_SIZE && Virtual < Segment->VirtualBase + Segment->Size) {
+            Permissions |= GetSegmentPermissions(Segment);
+        }
+    }
+
+    CHECK_AND_RETHROW(MapPages(Tables, Virtual, Physical, EFI_PAGE_SIZE, Permissions));
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS MapKernelSegments(PAGE_TABLES* Tables, ELF_INFO* Elf) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK(Tables != NULL);
+    CHECK(Elf != NULL);
+
+    for (UINTN i = 0; i < Elf->SegmentCount; i++) {
+        ELF_SEGMENT* Segment = &Elf->Segments[i];
+        UINT64 Start = Segment->VirtualBase & ~EFI_PAGE_MASK;
+        UINT64 End = ALIGN_VALUE(Segment->VirtualBase + Segment->Size, EFI_PAGE_SIZE);
+        UINT64 Physical = Segment->PhysicalBase & ~EFI_PAGE_MASK;
+
+        CHECK_AND_RETHROW(MapPages(Tables, Start, Physical, End - Start, GetSegmentPermissions(Segment)));
+        CHECK_AND_RETHROW(MapSharedPage(Tables, Elf, Start, Physical));
+        CHECK_AND_RETHROW(MapSharedPage(Tables, Elf, End - EFI_PAGE_SIZE, Physical + (End - EFI_PAGE_SIZE - Start)));
+    }
+
+cleanup:
+    return Status;
+}
+
+void ActivatePageTables(PAGE_TABLES* Tables) {
+    if (Tables->NoExecute) {
+        AsmMsrOr64(MSR_IA32_EFER, BIT11);
+    }
+
+    if (Tables->Levels == 4) {
+        AsmWriteCr3((UINTN)Tables->Root);
+    }
+}
@@ -0,0 +1,87 @@
+#ifndef __LOADERS_PAGETABLES_H__
+#define __LOADERS_PAGETABLES_H__
+
+#include <Uefi.h>
+
+#include <loaders/elf/ElfLoader.h>
+
+/**
+ * Where all of the physical memory is mapped, with 5 level paging the
+ * bigger address space leaves room for a lot more memory
+ */
+#define PAGE_TABLES_HHDM_BASE 0xffff800000000000ull
+#define PAGE_TABLES_HHDM_BASE_LEVEL5 0xff00000000000000ull
+
+/**
+ * Where higher half kernels are loaded, the first 2GB of the
+ * physical memory are mapped in there
+ */
+#define PAGE_TABLES_KERNEL_BASE 0xffffffff80000000ull
+
+/**
+ * Permissions of a mapping, a mapping is always readable
+ */
+#define PAGE_MAP_WRITE      BIT0
+#define PAGE_MAP_EXECUTE    BIT1
+
+/**
+ * Page tables built from scratch by the loader, the tables are allocated in
+ * the boot information memory type below 4GB so they can be loaded from
+ * 32bit code as well (the smp trampoline and the 5 level switch)
+ */
+typedef struct _PAGE_TABLES {
+    // the pml4, or the pml5 with 5 level paging
+    UINT64* Root;
+    UINTN Levels;
+    UINT64 HhdmBase;
+
+    // features of the cpu the tables are built for
+    BOOLEAN Huge1G;
+    BOOLEAN NoExecute;
+
+    // pages for the tables are taken from here
+    UINT8* Chunk;
+    UINTN ChunkPages;
+} PAGE_TABLES;
+
+/**
+ * Create empty tables, checks which page sizes and permissions the cpu supports,
+ * 5 level tables are only created if requested and the cpu supports them
+ */
+EFI_STATUS InitPageTables(PAGE_TABLES* Tables, BOOLEAN Level5);
+
+/**
+ * Map the range with the biggest pages that fit, later mappings replace
+ * earlier ones (huge pages are split as needed)
+ */
+EFI_STATUS MapPages(PAGE_TABLES* Tables, UINT64 Virtual, UINT64 Physical, UINT64 Size, UINT32 Permissions);
+
+/**
+ * Map a physical range both identity mapped and in the HHDM, it is
+ * rounded to the biggest page size so it can be mapped with huge pages
+ */
+EFI_STATUS MapPhysicalRange(PAGE_TABLES* Tables, UINT64 Base, UINT64 Size);
+
+/**
+ * Map the first 4GB and everything in the EFI memory map both identity
+ * mapped and in the HHDM, and the first 2GB at the kernel base
+ */
+EFI_STATUS MapPhysicalMemory(PAGE_TABLES* Tables);
+
+/**
+ * Map the segments of the kernel with their own permissions
+ */
+EFI_STATUS MapKernelSegments(PAGE_TABLES* Tables, ELF_INFO* Elf);
+
+/**
+ * Switch to the tables, enables NX if the tables use it.
+ *
+ * 5 level paging can only be turned on with paging disabled, so 5 level
+ * tables are not loaded and the jump stub switches to them instead.
+ *
+ * Only call after ExitBootServices, the firmware does not
+ * expect its tables to be replaced
+ */
+void ActivatePageTables(PAGE_TABLES* Tables);
+
+#endif //__LOADERS_PAGETABLES_H__
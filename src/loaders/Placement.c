@@ -0,0 +1,142 @@
+#include "Placement.h"
+
+#include <util/Except.h>
+#include <util/AcpiUtils.h>
+#include <loaders/MemoryMap.h>
+
+#include <Library/BaseLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+/**
+ * The alignments we fall back to, these are the page sizes so anything
+ * in between would not let the kernel use bigger pages anyways
+ */
+static CONST UINTN mFallbackAlignments[] = {
+    SIZE_1GB,
+    SIZE_2MB,
+    EFI_PAGE_SIZE,
+};
+
+/**
+ * The highest address in the free range with the given alignment, returns 0 if there is none
+ */
+static EFI_PHYSICAL_ADDRESS FindInRange(UINT64 Start, UINT64 End, UINT64 Size, UINTN Alignment) {
+    if (End <= Start || End < Size || End - Size < Start) {
+        return 0;
+    }
+
+    // never at zero since that is the failure
+    UINT64 Candidate = (End - Size) & ~((UINT64)Alignment - 1);
+    return Candidate >= Start ? Candidate : 0;
+}
+
+/**
+ * Find the highest free address in the range (and in the domain if there is one)
+ * with the given alignment, returns 0 if there is none
+ */
+static EFI_PHYSICAL_ADDRESS FindPlacement(MEMORY_MAP* Map, CONST PLACEMENT_REQUEST* Request, UINTN Alignment, UINT32 Domain) {
+    UINT64 Size = EFI_PAGES_TO_SIZE(Request->Pages);
+    EFI_PHYSICAL_ADDRESS Best = 0;
+    UINTN RangeCount = 0;
+    NUMA_MEMORY_RANGE* Ranges = Domain != NUMA_NO_DOMAIN ? GetNumaMemoryRanges(&RangeCount) : NULL;
+
+    for (UINTN Offset = 0; Offset < Map->MapSize; Offset += Map->DescriptorSize) {
+        EFI_MEMORY_DESCRIPTOR* Desc = (EFI_MEMORY_DESCRIPTOR*)(Map->Buffer + Offset);
+        if (Desc->Type != EfiConventionalMemory) {
+            continue;
+        }
+
+        // clip it to the range
+        UINT64 Start = MAX(Desc->PhysicalStart, Request->MinAddress);
+        UINT64 End = Desc->PhysicalStart + EFI_PAGES_TO_SIZE(Desc->NumberOfPages);
+        if (Request->MaxAddress != MAX_UINT64) {
+            End = MIN(End, Request->MaxAddress + 1);
+        }
+
+        // as high as we can, in the part that is in the domain
+        if (Domain == NUMA_NO_DOMAIN) {
+            Best = MAX(Best, FindInRange(Start, End, Size, Alignment));
+            continue;
+        }
+
+        for (UINTN i = 0; i < RangeCount; i++) {
+            if (Ranges[i].Domain == Domain) {
+                UINT64 RangeEnd = Ranges[i].Base + Ranges[i].Length;
+                Best = MAX(Best, FindInRange(MAX(Start, Ranges[i].Base), MIN(End, RangeEnd), Size, Alignment));
+            }
+        }
+    }
+
+    return Best;
+}
+
+/**
+ * Find the highest free address with the wanted alignment, and then with all the smaller page sizes
+ */
+static EFI_PHYSICAL_ADDRESS FindBestPlacement(MEMORY_MAP* Map, CONST PLACEMENT_REQUEST* Request, UINTN Wanted, UINT32 Domain) {
+    EFI_PHYSICAL_ADDRESS Found = FindPlacement(Map, Request, Wanted, Domain);
+    for (UINTN i = 0; Found == 0 && i < ARRAY_SIZE(mFallbackAlignments); i++) {
+        if (mFallbackAlignments[i] < Wanted) {
+            Found = FindPlacement(Map, Request, mFallbackAlignments[i], Domain);
+        }
+    }
+    return Found;
+}
+
+EFI_STATUS AllocatePlacedPages(CONST PLACEMENT_REQUEST* Request, EFI_PHYSICAL_ADDRESS* Base) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    MEMORY_MAP Map = { 0 };
+    UINTN MaxEntries = 0;
+
+    CHECK(Request != NULL);
+    CHECK(Base != NULL);
+    CHECK(Request->Pages != 0);
+
+    CHECK_AND_RETHROW(MeasureMemoryMap(&Map.BufferSize, &MaxEntries));
+    Map.Buffer = AllocatePool(Map.BufferSize);
+    CHECK_ERROR(Map.Buffer != NULL, EFI_OUT_OF_RESOURCES);
+    CHECK_AND_RETHROW(SnapshotMemoryMap(&Map));
+
+    UINTN Wanted = MAX(Request->Alignment, EFI_PAGE_SIZE);
+    CHECK((Wanted & (Wanted - 1)) == 0);
+
+    // a worse alignment above 4GB is better than a good one that takes
+    // away from the low memory, and the domain is tried before the others
+    UINT32 Domain = Request->PreferDomain ? Request->Domain : NUMA_NO_DOMAIN;
+    EFI_PHYSICAL_ADDRESS Found = 0;
+    if (Request->PreferHigh && Request->MaxAddress >= BASE_4GB) {
+        PLACEMENT_REQUEST High = *Request;
+        High.MinAddress = MAX(Request->MinAddress, BASE_4GB);
+        if (Domain != NUMA_NO_DOMAIN) {
+            Found = FindBestPlacement(&Map, &High, Wanted, Domain);
+        }
+        if (Found == 0) {
+            Found = FindBestPlacement(&Map, &High, Wanted, NUMA_NO_DOMAIN);
+        }
+    }
+    if (Found == 0 && Domain != NUMA_NO_DOMAIN) {
+        Found = FindBestPlacement(&Map, Request, Wanted, Domain);
+    }
+    if (Found == 0) {
+        Found = FindBestPlacement(&Map, Request, Wanted, NUMA_NO_DOMAIN);
+    }
+    CHECK_ERROR(Found != 0, EFI_OUT_OF_RESOURCES);
+
+    EFI_CHECK(gBS->AllocatePages(AllocateAddress, Request->Type, Request->Pages, &Found));
+    *Base = Found;
+
+cleanup:
+    if (Map.Buffer != NULL) {
+        FreePool(Map.Buffer);
+    }
+
+    return Status;
+}
+
+UINTN GetPlacementAlignment(EFI_PHYSICAL_ADDRESS Base) {
+    if (Base == 0 || (Base & (SIZE_1GB - 1)) == 0) {
+        return SIZE_1GB;
+    }
+    return (UINTN)(Base & -Base);
+}
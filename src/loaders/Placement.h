@@ -0,0 +1,41 @@
+#ifndef __LOADERS_PLACEMENT_H__
+#define __LOADERS_PLACEMENT_H__
+
+#include <Uefi.h>
+
+/**
+ * Where and how some pages should be allocated
+ */
+typedef struct _PLACEMENT_REQUEST {
+    EFI_MEMORY_TYPE Type;
+    UINTN Pages;
+
+    // the allocation has to be in this range, MaxAddress is inclusive
+    EFI_PHYSICAL_ADDRESS MinAddress;
+    EFI_PHYSICAL_ADDRESS MaxAddress;
+
+    // the wanted alignment, if it does not fit smaller
+    // page sizes are tried until page alignment
+    UINTN Alignment;
+
+    // try the part of the range above 4GB with every alignment
+    // first, the rest of the range is only used if that fails
+    BOOLEAN PreferHigh;
+
+    // try memory in this proximity domain first, with the high
+    // memory of the domain coming before the high memory of the others
+    BOOLEAN PreferDomain;
+    UINT32 Domain;
+} PLACEMENT_REQUEST;
+
+/**
+ * Allocate the pages as high as possible in the range with the best alignment that fits
+ */
+EFI_STATUS AllocatePlacedPages(CONST PLACEMENT_REQUEST* Request, EFI_PHYSICAL_ADDRESS* Base);
+
+/**
+ * The alignment an allocation actually got, capped at 1GB
+ */
+UINTN GetPlacementAlignment(EFI_PHYSICAL_ADDRESS Base);
+
+#endif //__LOADERS_PLACEMENT_H__
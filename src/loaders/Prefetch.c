@@ -0,0 +1,222 @@
+#include "Prefetch.h"
+#include "Loaders.h"
+
+#include <util/FileUtils.h>
+#include <util/Except.h>
+
+#include <Library/FileHandleLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+/**
+ * How much we read on every step, small enough to not make
+ * the menu feel stuck while we are reading
+ */
+#define PREFETCH_CHUNK_SIZE SIZE_1MB
+
+typedef struct _PREFETCH_FILE {
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Fs;
+    CHAR16* Path;
+
+    // the module the file is for, NULL for the kernel
+    BOOT_MODULE* Module;
+    EFI_FILE_PROTOCOL* File;
+    UINTN Base;
+    UINTN Size;
+
+    // how much was read so far
+    UINTN Offset;
+} PREFETCH_FILE;
+
+static BOOT_ENTRY* mPrefetchEntry = NULL;
+static PREFETCH_FILE* mPrefetchFiles = NULL;
+static UINTN mPrefetchCount = 0;
+static UINTN mPrefetchCurrent = 0;
+
+void StartPrefetch(BOOT_ENTRY* Entry) {
+    CancelPrefetch(NULL);
+    if (Entry == NULL || Entry->Path == NULL) {
+        return;
+    }
+
+    // the kernel and then all the modules
+    UINTN Count = 1;
+    for (LIST_ENTRY* Link = Entry->BootModules.ForwardLink; Link != &Entry->BootModules; Link = Link->ForwardLink) {
+        Count++;
+    }
+
+    mPrefetchFiles = AllocateZeroPool(Count * sizeof(PREFETCH_FILE));
+    if (mPrefetchFiles == NULL) {
+        return;
+    }
+
+    mPrefetchFiles[0].Fs = Entry->Fs;
+    mPrefetchFiles[0].Path = Entry->Path;
+    UINTN Index = 1;
+    for (LIST_ENTRY* Link = Entry->BootModules.ForwardLink; Link != &Entry->BootModules; Link = Link->ForwardLink) {
+        BOOT_MODULE* Module = BASE_CR(Link, BOOT_MODULE, Link);
+        mPrefetchFiles[Index].Fs = Module->Fs;
+        mPrefetchFiles[Index].Path = Module->Path;
+        mPrefetchFiles[Index].Module = Module;
+        Index++;
+    }
+
+    mPrefetchEntry = Entry;
+    mPrefetchCount = Count;
+    mPrefetchCurrent = 0;
+}
+
+static EFI_STATUS PrefetchOpen(PREFETCH_FILE* Prefetch) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    BOOT_MODULE Module = {
+        .Fs = Prefetch->Fs,
+        .Path = Prefetch->Path,
+    };
+
+    CHECK_AND_RETHROW(OpenBootModule(&Module, &Prefetch->File, &Prefetch->Size));
+    CHECK(Prefetch->Size != 0);
+
+    // allocate it like a module placed on its own so the buffer can be handed
+    // over as is if the modules can't be packed, the kernel (the first file)
+    // is only read from so it does not need to be placed
+    PLACEMENT_REQUEST Request = { 0 };
+    EFI_PHYSICAL_ADDRESS Base = 0;
+    GetModulePlacement(mPrefetchEntry, Prefetch->Module, Prefetch->Size, &Request);
+    if (Prefetch->Module == NULL) {
+        Request.Alignment = 0;
+    }
+    CHECK_AND_RETHROW(AllocatePlacedPages(&Request, &Base));
+    Prefetch->Base = Base;
+
+cleanup:
+    if (EFI_ERROR(Status)) {
+        Prefetch->Base = 0;
+    }
+
+    return Status;
+}
+
+static void PrefetchClose(PREFETCH_FILE* Prefetch) {
+    if (Prefetch->File != NULL) {
+        FileHandleClose(Prefetch->File);
+        Prefetch->File = NULL;
+    }
+}
+
+BOOLEAN PrefetchStep() {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    // skip the files that were already taken
+    while (mPrefetchCurrent < mPrefetchCount && mPrefetchFiles[mPrefetchCurrent].Path == NULL) {
+        mPrefetchCurrent++;
+    }
+
+    if (mPrefetchCurrent >= mPrefetchCount) {
+        return FALSE;
+    }
+
+    PREFETCH_FILE* Prefetch = &mPrefetchFiles[mPrefetchCurrent];
+    if (Prefetch->Base == 0) {
+        CHECK_AND_RETHROW(PrefetchOpen(Prefetch));
+    }
+
+    UINTN ChunkSize = MIN(PREFETCH_CHUNK_SIZE, Prefetch->Size - Prefetch->Offset);
+    CHECK_AND_RETHROW(FileRead(Prefetch->File, (void*)(Prefetch->Base + Prefetch->Offset), ChunkSize, Prefetch->Offset));
+    Prefetch->Offset += ChunkSize;
+
+    // this one is done, move to the next
+    if (Prefetch->Offset == Prefetch->Size) {
+        PrefetchClose(Prefetch);
+        mPrefetchCurrent++;
+    }
+
+cleanup:
+    if (EFI_ERROR(Status)) {
+        WARN("Prefetch of `%s` failed, stopping", Prefetch->Path);
+        CancelPrefetch(NULL);
+        return FALSE;
+    }
+
+    return mPrefetchCurrent < mPrefetchCount;
+}
+
+BOOLEAN TakePrefetchedFile(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Fs, CHAR16* Path, UINTN* Base, UINTN* Size) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    PREFETCH_FILE* Prefetch = NULL;
+
+    for (int i = 0; i < mPrefetchCount; i++) {
+        if (mPrefetchFiles[i].Base != 0 && mPrefetchFiles[i].Fs == Fs && mPrefetchFiles[i].Path != NULL && StrCmp(mPrefetchFiles[i].Path, Path) == 0) {
+            Prefetch = &mPrefetchFiles[i];
+            break;
+        }
+    }
+
+    if (Prefetch == NULL) {
+        return FALSE;
+    }
+
+    // read whatever is left in one go
+    if (Prefetch->Offset < Prefetch->Size) {
+        CHECK_AND_RETHROW(FileRead(Prefetch->File, (void*)(Prefetch->Base + Prefetch->Offset), Prefetch->Size - Prefetch->Offset, Prefetch->Offset));
+        Prefetch->Offset = Prefetch->Size;
+    }
+
+    *Base = Prefetch->Base;
+    *Size = Prefetch->Size;
+    Prefetch->Base = 0;
+
+cleanup:
+    // either way this file is not prefetched anymore
+    PrefetchClose(Prefetch);
+    Prefetch->Path = NULL;
+
+    if (EFI_ERROR(Status)) {
+        gBS->FreePages(Prefetch->Base, EFI_SIZE_TO_PAGES(Prefetch->Size));
+        Prefetch->Base = 0;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+void ReleasePrefetchedRange(EFI_PHYSICAL_ADDRESS Base, UINTN Size) {
+    for (int i = 0; i < mPrefetchCount; i++) {
+        PREFETCH_FILE* Prefetch = &mPrefetchFiles[i];
+        if (Prefetch->Base == 0) {
+            continue;
+        }
+
+        UINTN PrefetchTop = Prefetch->Base + EFI_PAGES_TO_SIZE(EFI_SIZE_TO_PAGES(Prefetch->Size));
+        if (Prefetch->Base >= Base + Size || PrefetchTop <= Base) {
+            continue;
+        }
+
+        TRACE("Prefetch of `%s` is in the way of %p - %p, dropping it", Prefetch->Path, Base, Base + Size);
+        PrefetchClose(Prefetch);
+        gBS->FreePages(Prefetch->Base, EFI_SIZE_TO_PAGES(Prefetch->Size));
+        Prefetch->Base = 0;
+        Prefetch->Path = NULL;
+    }
+}
+
+void CancelPrefetch(BOOT_ENTRY* Entry) {
+    if (Entry != NULL && Entry == mPrefetchEntry) {
+        return;
+    }
+
+    for (int i = 0; i < mPrefetchCount; i++) {
+        PrefetchClose(&mPrefetchFiles[i]);
+        if (mPrefetchFiles[i].Base != 0) {
+            gBS->FreePages(mPrefetchFiles[i].Base, EFI_SIZE_TO_PAGES(mPrefetchFiles[i].Size));
+        }
+    }
+
+    if (mPrefetchFiles != NULL) {
+        FreePool(mPrefetchFiles);
+    }
+
+    mPrefetchEntry = NULL;
+    mPrefetchFiles = NULL;
+    mPrefetchCount = 0;
+    mPrefetchCurrent = 0;
+}
@@ -0,0 +1,44 @@
+#ifndef __LOADERS_PREFETCH_H__
+#define __LOADERS_PREFETCH_H__
+
+#include <config/BootEntries.h>
+
+#include <Uefi.h>
+#include <Protocol/SimpleFileSystem.h>
+
+/**
+ * Start prefetching the kernel and modules of the given entry, nothing is
+ * read until PrefetchStep is called
+ */
+void StartPrefetch(BOOT_ENTRY* Entry);
+
+/**
+ * Read the next chunk of the prefetched files, returns FALSE once there
+ * is nothing more to read. A failure just stops the prefetch, the loader
+ * will read the files normally and report the error itself.
+ */
+BOOLEAN PrefetchStep();
+
+/**
+ * Take the buffer of a prefetched file, the rest of the file is read if
+ * the prefetch did not finish yet. The buffer is placed like a module
+ * of the entry (see GetModulePlacement) and is owned by the caller.
+ *
+ * Returns FALSE if the file was not prefetched.
+ */
+BOOLEAN TakePrefetchedFile(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Fs, CHAR16* Path, UINTN* Base, UINTN* Size);
+
+/**
+ * Free the prefetched files that are in the given range, so it can be allocated
+ * at a fixed address (like the segments of the kernel). The loader will just read
+ * those files again.
+ */
+void ReleasePrefetchedRange(EFI_PHYSICAL_ADDRESS Base, UINTN Size);
+
+/**
+ * Free whatever was prefetched and not taken, if Entry is not NULL only do
+ * it if the prefetch was done for another entry
+ */
+void CancelPrefetch(BOOT_ENTRY* Entry);
+
+#endif //__LOADERS_PREFETCH_H__
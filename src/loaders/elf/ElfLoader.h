@@ -4,6 +4,20 @@
 #include <Uefi.h>
 #include <Protocol/SimpleFileSystem.h>
 
+/**
+ * The most loadable segments that are recorded, for mapping
+ * them with their own permissions
+ */
+#define ELF_MAX_SEGMENTS 16
+
+typedef struct _ELF_SEGMENT {
+    UINT64 VirtualBase;
+    EFI_PHYSICAL_ADDRESS PhysicalBase;
+    UINT64 Size;
+    BOOLEAN Write;
+    BOOLEAN Execute;
+} ELF_SEGMENT;
+
 typedef struct _ELF_INFO {
     // will subtract this value from the Virtual address
     // if zero then physical address is used
@@ -14,6 +28,10 @@ typedef struct _ELF_INFO {
     // The entry of the image
     UINTN Entry;
 
+    // the loaded segments (64bit only)
+    ELF_SEGMENT Segments[ELF_MAX_SEGMENTS];
+    UINTN SegmentCount;
+
     // section entry info
     void* SectionHeaders;
     UINTN SectionHeadersSize;
@@ -1,10 +1,11 @@
 #include "ElfLoader.h"
 
 #include <util/Except.h>
-#include <util/FileUtils.h>
+#include <loaders/KernelImage.h>
+#include <util/TaskRuntime.h>
+#include <util/Timeline.h>
 
 #include <Uefi.h>
-#include <Library/FileHandleLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/UefiBootServicesTableLib.h>
@@ -13,20 +14,20 @@
 
 EFI_STATUS LoadElf32(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* fs, CHAR16* file, ELF_INFO* info) {
     EFI_STATUS Status = EFI_SUCCESS;
-    EFI_FILE_PROTOCOL* root = NULL;
-    EFI_FILE_PROTOCOL* elfFile = NULL;
+    KERNEL_IMAGE* image = NULL;
+    UINTN Phase = TimelineBegin("elf32 load");
 
     CHECK(info != NULL);
     info->PhysicalBase = MAX_INT64;
     info->PhysicalTop = 0;
 
-    // open the executable file
-    EFI_CHECK(fs->OpenVolume(fs, &root));
-    EFI_CHECK(root->Open(root, &elfFile, file, EFI_FILE_MODE_READ, 0));
+    // get the executable file
+    CHECK_AND_RETHROW(OpenKernelImage(fs, file, &image));
 
-    // read the header
+    // get the header
+    CHECK(image->HeadSize >= sizeof(Elf32_Ehdr));
     Elf32_Ehdr ehdr;
-    CHECK_AND_RETHROW(FileRead(elfFile, &ehdr, sizeof(Elf32_Ehdr), 0));
+    CopyMem(&ehdr, image->Head, sizeof(Elf32_Ehdr));
 
     // verify is an elf
     CHECK(IS_ELF(ehdr));
@@ -36,10 +37,15 @@ EFI_STATUS LoadElf32(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* fs, CHAR16* file, ELF_INFO
     CHECK(ehdr.e_ident[EI_CLASS] == ELFCLASS32);
     CHECK(ehdr.e_ident[EI_DATA] == ELFDATA2LSB);
 
+    // get all the program headers at once
+    UINT8* phdrs = NULL;
+    CHECK(ehdr.e_phentsize >= sizeof(Elf32_Phdr));
+    CHECK_AND_RETHROW(GetKernelImageProgramHeaders(image, ehdr.e_phoff, ehdr.e_phnum * ehdr.e_phentsize, (void**)&phdrs));
+
     // Load from section headers
     Elf32_Phdr phdr;
     for (int i = 0; i < ehdr.e_phnum; i++) {
-        CHECK_AND_RETHROW(FileRead(elfFile, &phdr, sizeof(Elf32_Phdr), ehdr.e_phoff + ehdr.e_phentsize * i));
+        CopyMem(&phdr, phdrs + ehdr.e_phentsize * i, sizeof(Elf32_Phdr));
 
         switch (phdr.p_type) {
             // normal section
@@ -53,9 +59,13 @@ EFI_STATUS LoadElf32(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* fs, CHAR16* file, ELF_INFO
                 // allocate the address
                 EFI_PHYSICAL_ADDRESS base = info->VirtualOffset ? phdr.p_vaddr - info->VirtualOffset : phdr.p_paddr;
                 TRACE("    BASE = %p, PAGES = %d", base, nPages);
+                // nothing we read ahead can stay where the segment goes, the
+                // program headers might have moved with the image so get them again
+                CHECK_AND_RETHROW(ReleaseKernelImageRange(image, base, EFI_PAGES_TO_SIZE(nPages)));
+                CHECK_AND_RETHROW(GetKernelImageProgramHeaders(image, ehdr.e_phoff, ehdr.e_phnum * ehdr.e_phentsize, (void**)&phdrs));
                 EFI_CHECK(gBS->AllocatePages(AllocateAddress, gKernelAndModulesMemoryType, nPages, &base));
-                CHECK_AND_RETHROW(FileRead(elfFile, (void*)base, phdr.p_filesz, phdr.p_offset));
-                ZeroMem((void*)(base + phdr.p_filesz), phdr.p_memsz - phdr.p_filesz);
+                CHECK_AND_RETHROW(KernelImageRead(image, (void*)base, phdr.p_filesz, phdr.p_offset));
+                ParallelZeroMem((void*)(base + phdr.p_filesz), phdr.p_memsz - phdr.p_filesz);
 
                 if (info->PhysicalBase > base) {
                     info->PhysicalBase = base;
@@ -73,23 +83,17 @@ EFI_STATUS LoadElf32(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* fs, CHAR16* file, ELF_INFO
     }
 
     // copy the section headers
+    void* shdrs = NULL;
     info->SectionHeadersSize = ehdr.e_shnum * ehdr.e_shentsize;
-    info->SectionHeaders = AllocatePool(info->SectionHeadersSize); // TODO: Delete if error
     info->SectionEntrySize = ehdr.e_shentsize;
     info->StringSectionIndex = ehdr.e_shstrndx;
-    CHECK_AND_RETHROW(FileRead(elfFile, info->SectionHeaders, info->SectionHeadersSize, ehdr.e_shoff));
+    CHECK_AND_RETHROW(GetKernelImageSectionHeaders(image, ehdr.e_shoff, info->SectionHeadersSize, &shdrs));
+    info->SectionHeaders = AllocateCopyPool(info->SectionHeadersSize, shdrs); // TODO: Delete if error
 
     // copy the entry
     info->Entry = ehdr.e_entry;
 
 cleanup:
-    if (root != NULL) {
-        FileHandleClose(root);
-    }
-
-    if (elfFile != NULL) {
-        FileHandleClose(elfFile);
-    }
-
+    TimelineEnd(Phase);
     return Status;
 }
@@ -1,10 +1,11 @@
 #include "ElfLoader.h"
 
 #include <util/Except.h>
-#include <util/FileUtils.h>
+#include <loaders/KernelImage.h>
+#include <util/TaskRuntime.h>
+#include <util/Timeline.h>
 
 #include <Uefi.h>
-#include <Library/FileHandleLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <Library/UefiBootServicesTableLib.h>
@@ -15,20 +16,21 @@ EFI_MEMORY_TYPE gKernelAndModulesMemoryType = 0x80000000;
 
 EFI_STATUS LoadElf64(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* fs, CHAR16* file, ELF_INFO* info) {
     EFI_STATUS Status = EFI_SUCCESS;
-    EFI_FILE_PROTOCOL* root = NULL;
-    EFI_FILE_PROTOCOL* elfFile = NULL;
+    KERNEL_IMAGE* image = NULL;
+    UINTN Phase = TimelineBegin("elf64 load");
 
     CHECK(info != NULL);
     info->PhysicalBase = MAX_INT64;
     info->PhysicalTop = 0;
+    info->SegmentCount = 0;
 
-    // open the executable file
-    EFI_CHECK(fs->OpenVolume(fs, &root));
-    EFI_CHECK(root->Open(root, &elfFile, file, EFI_FILE_MODE_READ, 0));
+    // get the executable file
+    CHECK_AND_RETHROW(OpenKernelImage(fs, file, &image));
 
-    // read the header
+    // get the header
+    CHECK(image->HeadSize >= sizeof(Elf64_Ehdr));
     Elf64_Ehdr ehdr;
-    CHECK_AND_RETHROW(FileRead(elfFile, &ehdr, sizeof(Elf64_Ehdr), 0));
+    CopyMem(&ehdr, image->Head, sizeof(Elf64_Ehdr));
 
     // verify is an elf
     CHECK(IS_ELF(ehdr));
@@ -38,10 +40,15 @@ EFI_STATUS LoadElf64(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* fs, CHAR16* file, ELF_INFO
     CHECK(ehdr.e_ident[EI_CLASS] == ELFCLASS64);
     CHECK(ehdr.e_ident[EI_DATA] == ELFDATA2LSB);
 
+    // get all the program headers at once
+    UINT8* phdrs = NULL;
+    CHECK(ehdr.e_phentsize >= sizeof(Elf64_Phdr));
+    CHECK_AND_RETHROW(GetKernelImageProgramHeaders(image, ehdr.e_phoff, ehdr.e_phnum * ehdr.e_phentsize, (void**)&phdrs));
+
     // Load from section headers
     Elf64_Phdr phdr;
     for (int i = 0; i < ehdr.e_phnum; i++) {
-        CHECK_AND_RETHROW(FileRead(elfFile, &phdr, sizeof(Elf64_Phdr), ehdr.e_phoff + ehdr.e_phentsize * i));
+        CopyMem(&phdr, phdrs + ehdr.e_phentsize * i, sizeof(Elf64_Phdr));
 
         switch (phdr.p_type) {
             // normal section
@@ -55,9 +62,25 @@ EFI_STATUS LoadElf64(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* fs, CHAR16* file, ELF_INFO
                 // allocate the address
                 EFI_PHYSICAL_ADDRESS base = info->VirtualOffset ? phdr.p_vaddr - info->VirtualOffset : phdr.p_paddr;
                 TRACE("    BASE = %p, PAGES = %d", base, nPages);
+                // nothing we read ahead can stay where the segment goes, the
+                // program headers might have moved with the image so get them again
+                CHECK_AND_RETHROW(ReleaseKernelImageRange(image, base, EFI_PAGES_TO_SIZE(nPages)));
+                CHECK_AND_RETHROW(GetKernelImageProgramHeaders(image, ehdr.e_phoff, ehdr.e_phnum * ehdr.e_phentsize, (void**)&phdrs));
                 EFI_CHECK(gBS->AllocatePages(AllocateAddress, gKernelAndModulesMemoryType, nPages, &base));
-                CHECK_AND_RETHROW(FileRead(elfFile, (void*)base, phdr.p_filesz, phdr.p_offset));
-                ZeroMem((void*)(base + phdr.p_filesz), phdr.p_memsz - phdr.p_filesz);
+                CHECK_AND_RETHROW(KernelImageRead(image, (void*)base, phdr.p_filesz, phdr.p_offset));
+                ParallelZeroMem((void*)(base + phdr.p_filesz), phdr.p_memsz - phdr.p_filesz);
+
+                // remember it so it can be mapped with its own permissions
+                if (info->SegmentCount < ELF_MAX_SEGMENTS) {
+                    ELF_SEGMENT* segment = &info->Segments[info->SegmentCount++];
+                    segment->VirtualBase = phdr.p_vaddr;
+                    segment->PhysicalBase = base;
+                    segment->Size = phdr.p_memsz;
+                    segment->Write = (phdr.p_flags & PF_W) != 0;
+                    segment->Execute = (phdr.p_flags & PF_X) != 0;
+                } else {
+                    WARN("Too many segments, %p will not get its own permissions", phdr.p_vaddr);
+                }
 
                 if (info->PhysicalBase > base) {
                     info->PhysicalBase = base;
@@ -75,23 +98,17 @@ EFI_STATUS LoadElf64(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* fs, CHAR16* file, ELF_INFO
     }
 
     // copy the section headers
+    void* shdrs = NULL;
     info->SectionHeadersSize = ehdr.e_shnum * ehdr.e_shentsize;
-    info->SectionHeaders = AllocatePool(info->SectionHeadersSize); // TODO: Delete if error
     info->SectionEntrySize = ehdr.e_shentsize;
     info->StringSectionIndex = ehdr.e_shstrndx;
-    CHECK_AND_RETHROW(FileRead(elfFile, info->SectionHeaders, info->SectionHeadersSize, ehdr.e_shoff));
+    CHECK_AND_RETHROW(GetKernelImageSectionHeaders(image, ehdr.e_shoff, info->SectionHeadersSize, &shdrs));
+    info->SectionHeaders = AllocateCopyPool(info->SectionHeadersSize, shdrs); // TODO: Delete if error
 
     // copy the entry
     info->Entry = ehdr.e_entry;
 
 cleanup:
-    if (root != NULL) {
-        FileHandleClose(root);
-    }
-
-    if (elfFile != NULL) {
-        FileHandleClose(elfFile);
-    }
-
+    TimelineEnd(Phase);
     return Status;
 }
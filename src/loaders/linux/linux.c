@@ -2,10 +2,19 @@
 #include <util/Except.h>
 #include <loaders/Loaders.h>
 #include <config/BootEntries.h>
-
+#include <loaders/KernelImage.h>
+#include <loaders/Prefetch.h>
+#include <util/FileUtils.h>
+#include <util/TaskRuntime.h>
+#include <util/Timeline.h>
+#include <util/AcpiUtils.h>
+
+#include <IndustryStandard/LinuxBzimage.h>
 #include <Library/LoadLinuxLib.h>
+#include <Library/FileHandleLib.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
 
 /**
  * Implementation References
@@ -15,18 +24,19 @@
  */
 EFI_STATUS LoadLinuxKernel(BOOT_ENTRY* Entry) {
     EFI_STATUS Status = EFI_SUCCESS;
-    UINTN KernelSize = 0;
-    UINT8* KernelImage = NULL;
+    KERNEL_IMAGE* Image = NULL;
+    EFI_FILE_PROTOCOL* InitrdFile = NULL;
+    UINTN PrefetchBase = 0;
+    UINTN PrefetchSize = 0;
+    UINTN Phase = TimelineBegin("kernel load");
 
-    Print(L"Loading kernel image\n");
-    BOOT_MODULE Module = {
-        .Path = Entry->Path,
-        .Fs = Entry->Fs,
-    };
-    CHECK_AND_RETHROW(LoadBootModule(&Module, (UINTN*)&KernelImage, &KernelSize));
+    CHECK_AND_RETHROW(OpenKernelImage(Entry->Fs, Entry->Path, &Image));
+    UINTN KernelSize = Image->Size;
 
     // get the setup size
-    UINTN SetupSize = KernelImage[0x1f1];
+    UINT8 SetupSects = 0;
+    CHECK_AND_RETHROW(KernelImageRead(Image, &SetupSects, sizeof(SetupSects), 0x1f1));
+    UINTN SetupSize = SetupSects;
     if(SetupSize == 0) {
         SetupSize = 4;
     }
@@ -35,10 +45,10 @@ EFI_STATUS LoadLinuxKernel(BOOT_ENTRY* Entry) {
     KernelSize -= SetupSize;
     Print(L"Setup Size: 0x%x\n", SetupSize);
 
-    // load the setup
+    // load the setup directly to its place
     UINT8* SetupBuf = LoadLinuxAllocateKernelSetupPages(EFI_SIZE_TO_PAGES(SetupSize));
     CHECK(SetupBuf != NULL);
-    CopyMem(SetupBuf, KernelImage, SetupSize);
+    CHECK_AND_RETHROW(KernelImageRead(Image, SetupBuf, SetupSize, 0));
     EFI_CHECK(LoadLinuxCheckKernelSetup(SetupBuf, SetupSize));
     EFI_CHECK(LoadLinuxInitializeKernelSetup(SetupBuf));
 
@@ -46,17 +56,42 @@ EFI_STATUS LoadLinuxKernel(BOOT_ENTRY* Entry) {
     SetupBuf[0x210] = 0xF;
     SetupBuf[0x211] = 0xF;
 
-    // load the kernel
+    // now that we know how much the kernel needs allocate it
+    // and read the payload right into it
     UINT64 KernelInitialSize  = LoadLinuxGetKernelSize(SetupBuf, KernelSize);
     CHECK(KernelInitialSize  != 0);
     Print(L"Kernel size: 0x%x\n", KernelSize);
-    UINT8* KernelBuf = LoadLinuxAllocateKernelPages(SetupBuf, EFI_SIZE_TO_PAGES(KernelInitialSize));
+    struct boot_params* Bp = (struct boot_params*)SetupBuf;
+    UINTN KernelPages = EFI_SIZE_TO_PAGES(MAX(KernelInitialSize, KernelSize));
+    UINT8* KernelBuf = NULL;
+    if (Bp->hdr.relocatable_kernel && Entry->Placement.Alignment > Bp->hdr.kernel_alignment) {
+        // a relocatable kernel can go anywhere above its preferred address
+        // with its own alignment, so give it the better one if we can
+        PLACEMENT_REQUEST Request = {
+            .Type = EfiLoaderData,
+            .Pages = KernelPages,
+            .MinAddress = Bp->hdr.pref_address,
+            .MaxAddress = BASE_4GB - 1,
+            .Alignment = Entry->Placement.Alignment,
+            .PreferDomain = GetPlacementDomain(Entry) != NUMA_NO_DOMAIN,
+            .Domain = GetPlacementDomain(Entry),
+        };
+        EFI_PHYSICAL_ADDRESS KernelBase = 0;
+        if (!EFI_ERROR(AllocatePlacedPages(&Request, &KernelBase))) {
+            if (KernelBase & (Bp->hdr.kernel_alignment - 1)) {
+                gBS->FreePages(KernelBase, KernelPages);
+            } else {
+                KernelBuf = (UINT8*)KernelBase;
+            }
+        }
+    }
+    if (KernelBuf == NULL) {
+        KernelBuf = LoadLinuxAllocateKernelPages(SetupBuf, KernelPages);
+    }
     CHECK(KernelBuf != NULL);
-    CopyMem(KernelBuf, KernelImage + SetupSize, KernelSize);
-
-    // we can free the kernel image now
-    FreePages(KernelImage, EFI_SIZE_TO_PAGES(KernelSize));
-    KernelImage = NULL;
+    Print(L"Kernel Buf: 0x%p (aligned to 0x%lx)\n", KernelBuf, GetPlacementAlignment((UINTN)KernelBuf));
+    CHECK_AND_RETHROW(KernelImageRead(Image, KernelBuf, KernelSize, SetupSize));
+    TimelineEnd(Phase);
 
     // load the command line arguments, if any
     CHAR8* CommandLineBuf = NULL;
@@ -70,37 +105,81 @@ EFI_STATUS LoadLinuxKernel(BOOT_ENTRY* Entry) {
     EFI_CHECK(LoadLinuxSetCommandLine(SetupBuf, CommandLineBuf));
 
     // TODO: don't assume the first module is the initrd
-    // load the initrd, if any
+    // load the initrd, if any, straight into the pages the kernel wants it in
     UINTN InitrdSize = 0;
     UINT8* InitrdBuf = NULL;
     if(!IsListEmpty(&Entry->BootModules)) {
+        Phase = TimelineBegin("initrd load");
         BOOT_MODULE* InitrdModule = BASE_CR(Entry->BootModules.ForwardLink, BOOT_MODULE, Link);
 
-        UINT8* InitrdBase;
-        LoadBootModule(InitrdModule, (UINTN*)&InitrdBase, &InitrdSize);
-        Print(L"Initrd size: 0x%x\n", InitrdSize);
-
-        InitrdBuf = LoadLinuxAllocateInitrdPages(SetupBuf, EFI_SIZE_TO_PAGES(InitrdSize));
-        CHECK(InitrdBuf != NULL);
-        Print(L"Initrd Buf: 0x%p\n", InitrdBuf);
-        CopyMem(InitrdBuf, InitrdBase, InitrdSize);
-
-        // can free the initrd now
-        FreePages(InitrdBase, EFI_SIZE_TO_PAGES(InitrdSize));
-        InitrdBase = NULL;
+        // the prefetched copy might not be where the kernel can reach
+        // it, so it is copied into place instead of read again
+        if (TakePrefetchedFile(InitrdModule->Fs, InitrdModule->Path, &PrefetchBase, &PrefetchSize)) {
+            InitrdSize = PrefetchSize;
+        } else {
+            CHECK_AND_RETHROW(OpenBootModule(InitrdModule, &InitrdFile, &InitrdSize));
+        }
+        Print(L"Initrd size: 0x%lx\n", InitrdSize);
+
+        // only go above 4GB if the kernel can take the initrd there,
+        // older kernels only have the low 32bits of its address
+        BOOLEAN InitrdHigh = GetModuleRegion(Entry, InitrdModule) == PLACEMENT_HIGH &&
+                             Bp->hdr.version >= 0x020c &&
+                             (Bp->hdr.xloadflags & XLF_CAN_BE_LOADED_ABOVE_4G) != 0;
+        PLACEMENT_REQUEST Request = {
+            .Type = EfiLoaderData,
+            .Pages = EFI_SIZE_TO_PAGES(InitrdSize),
+            .MinAddress = 0,
+            .MaxAddress = InitrdHigh ? MAX_UINT64 : Bp->hdr.ramdisk_max,
+            .Alignment = Entry->Placement.Alignment,
+            .PreferHigh = InitrdHigh,
+            .PreferDomain = GetPlacementDomain(Entry) != NUMA_NO_DOMAIN,
+            .Domain = GetPlacementDomain(Entry),
+        };
+        EFI_PHYSICAL_ADDRESS InitrdBase = 0;
+        CHECK_AND_RETHROW(AllocatePlacedPages(&Request, &InitrdBase));
+        InitrdBuf = (UINT8*)InitrdBase;
+        Print(L"Initrd Buf: 0x%p (aligned to 0x%lx)\n", InitrdBuf, GetPlacementAlignment(InitrdBase));
+        if (PrefetchBase != 0) {
+            ParallelCopyMem(InitrdBuf, (void*)PrefetchBase, InitrdSize);
+            gBS->FreePages(PrefetchBase, EFI_SIZE_TO_PAGES(PrefetchSize));
+            PrefetchBase = 0;
+        } else {
+            CHECK_AND_RETHROW(FileRead(InitrdFile, InitrdBuf, InitrdSize, 0));
+        }
+        TimelineEnd(Phase);
     }
 
     Print(L"Loading Initrd...");
     EFI_CHECK(LoadLinuxSetInitrd(SetupBuf, InitrdBuf, InitrdSize));
     Print(L" Dones\n");
 
+    // we are done with the files
+    CloseKernelImage();
+    if (InitrdFile != NULL) {
+        FileHandleClose(InitrdFile);
+        InitrdFile = NULL;
+    }
+
+    // the APs have to go back to the firmware before linux exits boot services
+    StopTaskRuntime();
+
+    // linux exits the boot services by itself and has no way to
+    // get the timeline, so just report what we have so far
+    DumpTimeline();
+
     // call the kernel
     Print(L"Calling linux");
     EFI_CHECK(LoadLinux(KernelBuf, SetupBuf));
 
 cleanup:
-    if (KernelImage != NULL) {
-        FreePages(KernelImage, KernelSize);
+    if (PrefetchBase != 0) {
+        gBS->FreePages(PrefetchBase, EFI_SIZE_TO_PAGES(PrefetchSize));
     }
+
+    if (InitrdFile != NULL) {
+        FileHandleClose(InitrdFile);
+    }
+
     return Status;
 }
@@ -11,9 +11,14 @@
 
 #include <config/BootEntries.h>
 #include <util/FileUtils.h>
+#include <util/TaskRuntime.h>
+#include <util/Timeline.h>
+#include <uefi/AcpiTimerLib.h>
 #include <util/Except.h>
 #include <config/BootConfig.h>
 #include <loaders/Loaders.h>
+#include <loaders/KernelImage.h>
+#include <loaders/MemoryMap.h>
 #include <Guid/Acpi.h>
 #include <loaders/elf/ElfLoader.h>
 #include <Library/UefiRuntimeLib.h>
@@ -21,44 +26,49 @@
 #include <util/DrawUtils.h>
 #include <util/GfxUtils.h>
 
-static UINT8* mBootParamsBuffer = NULL;
-static UINTN mBootParamsSize = 0;
-
 /**
  * Will jump to the mb2 kernel
  */
 extern void JumpToMB2Kernel(void* KernelStart, void* KernelParams);
 
-// TODO: need to make this force allocations below 4GB
-static void* PushBootParams(void* data, UINTN size) {
-    // align to 8 bytes
-    UINTN AllocationSize = ALIGN_VALUE(size, MULTIBOOT_TAG_ALIGN);
+/**
+ * The boot information is built in two passes, first everything is measured
+ * and a single arena is allocated, then the tags are emitted in place
+ */
+typedef struct _MB2_INFO {
+    UINT8* Base;
+    UINTN Size;
+    UINTN Offset;
+} MB2_INFO;
 
-    // allocate the buffer
-    if (mBootParamsBuffer == NULL) {
-        mBootParamsBuffer = AllocatePool(AllocationSize);
-    } else {
-        UINT8* old = mBootParamsBuffer;
-        mBootParamsBuffer = AllocateCopyPool(mBootParamsSize + AllocationSize, mBootParamsBuffer);
-        FreePool(old);
-    }
+#define MB2_TAG_SIZE(size) ALIGN_VALUE(size, MULTIBOOT_TAG_ALIGN)
 
-    // copy to the buffer
-    if (data != NULL) {
-        CopyMem(mBootParamsBuffer + mBootParamsSize, data, size);
-    }
+static void* EmitTag(MB2_INFO* Info, multiboot_uint32_t Type, UINTN Size) {
+    ASSERT(Info->Offset + MB2_TAG_SIZE(Size) <= Info->Size);
+
+    struct multiboot_tag* Tag = (struct multiboot_tag*)(Info->Base + Info->Offset);
+    Tag->type = Type;
+    Tag->size = Size;
+    Info->Offset += MB2_TAG_SIZE(Size);
 
-    // save the base we allocated from
-    UINT8* base = mBootParamsBuffer + mBootParamsSize;
+    return Tag;
+}
+
+static UINTN GetStringTagSize(UINTN Length) {
+    return OFFSET_OF(struct multiboot_tag_string, string) + Length + 1;
+}
 
-    // add to the size
-    mBootParamsSize += AllocationSize;
+static UINTN GetModuleTagSize(BOOT_MODULE* Module) {
+    return OFFSET_OF(struct multiboot_tag_module, cmdline) + StrLen(Module->Tag) + 1;
+}
 
-    // return the base of the new tag
-    return base;
+static UINTN GetTimelineTagSize() {
+    return OFFSET_OF(struct multiboot_tag_timeline, entries) + sizeof(struct multiboot_timeline_entry) * TIMELINE_MAX_ENTRIES;
 }
 
-static multiboot_uint32_t EfiTypeToMB2Type[] = {
+#define BOOTLOADER_NAME "TomatBoot-UEFI"
+
+static CONST UINT32 EfiTypeToMB2Type[] = {
     [EfiReservedMemoryType] = MULTIBOOT_MEMORY_RESERVED,
     [EfiRuntimeServicesCode] = MULTIBOOT_MEMORY_RESERVED,
     [EfiRuntimeServicesData] = MULTIBOOT_MEMORY_RESERVED,
@@ -75,44 +85,52 @@ static multiboot_uint32_t EfiTypeToMB2Type[] = {
     [EfiACPIMemoryNVS] = MULTIBOOT_MEMORY_NVS
 };
 
+/**
+ * mb2 has no type for the kernel and modules or for the boot information, like
+ * everyone else we report them as available and let the kernel keep track of
+ * them, they still have their own types in the efi memory map tag
+ */
+static CONST MEMORY_MAP_TYPES mMB2MemoryTypes = {
+    .Table = EfiTypeToMB2Type,
+    .TableSize = ARRAY_SIZE(EfiTypeToMB2Type),
+    .KernelAndModules = MULTIBOOT_MEMORY_AVAILABLE,
+    .BootInfo = MULTIBOOT_MEMORY_AVAILABLE,
+    .Reserved = MULTIBOOT_MEMORY_RESERVED,
+};
+
 static struct multiboot_header* LoadMB2Header(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* fs, CHAR16* file, UINTN* headerOff) {
     EFI_STATUS Status = EFI_SUCCESS;
-    EFI_FILE_PROTOCOL* root = NULL;
-    EFI_FILE_PROTOCOL* mb2image = NULL;
+    KERNEL_IMAGE* image = NULL;
     struct multiboot_header* ptr = NULL;
 
     // open the executable file
-    Print(L"Loading image `%s`\n", file);
-    EFI_CHECK(fs->OpenVolume(fs, &root));
-    EFI_CHECK(root->Open(root, &mb2image, file, EFI_FILE_MODE_READ, 0));
+    CHECK_AND_RETHROW(OpenKernelImage(fs, file, &image));
 
+    // the whole search area is in the head of the image
     Print(L"Searching for mb2 header\n");
-    struct multiboot_header header;
-    for (int i = 0; i < MULTIBOOT_SEARCH; i += MULTIBOOT_HEADER_ALIGN) {
-        CHECK_AND_RETHROW(FileRead(mb2image, &header, sizeof(header), i));
+    UINTN SearchSize = MIN(image->HeadSize, MULTIBOOT_SEARCH);
+    for (int i = 0; i + sizeof(struct multiboot_header) <= SearchSize; i += MULTIBOOT_HEADER_ALIGN) {
+        struct multiboot_header* header = (struct multiboot_header*)(image->Head + i);
 
         // check if this is a valid header
-        if (header.magic == MULTIBOOT2_HEADER_MAGIC &&
-            header.architecture == MULTIBOOT_ARCHITECTURE_I386 &&
-            (header.checksum + header.magic + header.architecture + header.header_length) == 0) {
+        if (header->magic == MULTIBOOT2_HEADER_MAGIC &&
+            header->architecture == MULTIBOOT_ARCHITECTURE_I386 &&
+            (header->checksum + header->magic + header->architecture + header->header_length) == 0) {
 
             // set the offset
             *headerOff = i;
 
             // found it, allocate something big enough for the whole header and return it
-            ptr = AllocatePool(header.header_length);
-            CHECK_AND_RETHROW(FileRead(mb2image, ptr, header.header_length, i));
+            ptr = AllocatePool(header->header_length);
+            CHECK_AND_RETHROW(KernelImageRead(image, ptr, header->header_length, i));
             goto cleanup;
         }
     }
 
 cleanup:
-    if (root != NULL) {
-        FileHandleClose(root);
-    }
-
-    if (mb2image != NULL) {
-        FileHandleClose(mb2image);
+    if (EFI_ERROR(Status) && ptr != NULL) {
+        FreePool(ptr);
+        ptr = NULL;
     }
 
     return ptr;
@@ -121,6 +139,7 @@ cleanup:
 EFI_STATUS LoadMB2Kernel(BOOT_ENTRY* Entry) {
     EFI_STATUS Status = EFI_SUCCESS;
     UINTN HeaderOffset = 0;
+    LOADED_MODULE* LoadedModules = NULL;
 
     gST->ConOut->ClearScreen(gST->ConOut);
     gST->ConOut->SetCursorPosition(gST->ConOut, 0, 0);
@@ -132,8 +151,10 @@ EFI_STATUS LoadMB2Kernel(BOOT_ENTRY* Entry) {
     // set the gfx mode right away, optionally we will get an override
     // later on
     EFI_GRAPHICS_OUTPUT_PROTOCOL* gop = NULL;
+    UINTN Phase = TimelineBegin("gop set");
     ASSERT_EFI_ERROR(gBS->LocateProtocol(&gEfiGraphicsOutputProtocolGuid, NULL, (VOID**)&gop));
     ASSERT_EFI_ERROR(gop->SetMode(gop, (UINT32) config.GfxMode));
+    TimelineEnd(Phase);
 
     // get the header
     struct multiboot_header* header = LoadMB2Header(Entry->Fs, Entry->Path, &HeaderOffset);
@@ -146,10 +167,6 @@ EFI_STATUS LoadMB2Kernel(BOOT_ENTRY* Entry) {
     BOOLEAN MustHaveNewAcpi = FALSE;
     BOOLEAN NotElf = FALSE;
 
-    // push the size and something else
-    mBootParamsSize = 8;
-    mBootParamsBuffer = AllocatePool(8);
-
     // iterate the entries
     for (struct multiboot_header_tag* tag = (struct multiboot_header_tag*)(header + 1);
          tag < (struct multiboot_header_tag*)((UINTN)header + header->header_length) && tag->type != MULTIBOOT_HEADER_TAG_END;
@@ -212,7 +229,9 @@ EFI_STATUS LoadMB2Kernel(BOOT_ENTRY* Entry) {
                 }
 
                 // set graphics mode
+                Phase = TimelineBegin("gop set");
                 ASSERT_EFI_ERROR(gop->SetMode(gop, (UINT32) GfxMode));
+                TimelineEnd(Phase);
             } break;
 
             case MULTIBOOT_HEADER_TAG_MODULE_ALIGN: {
@@ -251,38 +270,135 @@ EFI_STATUS LoadMB2Kernel(BOOT_ENTRY* Entry) {
         }
     }
 
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Load everything that the boot information references
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    // load the elf
+    ELF_INFO elf_info = { 0 };
+    if (NotElf) {
+        // TODO: Load raw image
+        CHECK_FAIL_TRACE("Raw image is not supported yet");
+    } else {
+        // try with 32bit elf
+        TRACE("Trying to load ELF32");
+        if (EFI_ERROR(LoadElf32(Entry->Fs, Entry->Path, &elf_info))) {
+            // try with elf64
+            TRACE("Not ELF32, trying ELF64");
+            CHECK_AND_RETHROW(LoadElf64(Entry->Fs, Entry->Path, &elf_info));
+        }
+
+        if (EntryAddressOverride == 0) {
+            EntryAddressOverride = elf_info.Entry;
+        }
+    }
+
+    // we are done with the kernel file
+    CloseKernelImage();
+
+    // load the modules
+    TRACE("Loading modules");
+    UINTN ModuleCount = 0;
+    for (LIST_ENTRY* Link = Entry->BootModules.ForwardLink; Link != &Entry->BootModules; Link = Link->ForwardLink) {
+        ModuleCount++;
+    }
+
+    LoadedModules = AllocateZeroPool(sizeof(LOADED_MODULE) * (ModuleCount + 1));
+    CHECK_ERROR(LoadedModules != NULL, EFI_OUT_OF_RESOURCES);
+    CHECK_AND_RETHROW(LoadBootModules(Entry, &Entry->Placement, LoadedModules, ModuleCount));
+
+    // get the acpi tables
+    void* acpi10table = NULL;
+    if (EFI_ERROR(EfiGetSystemConfigurationTable(&gEfiAcpi10TableGuid, &acpi10table))) {
+        CHECK_TRACE(!MustHaveOldAcpi, "Old ACPI Table is not present");
+        acpi10table = NULL;
+    }
+
+    void* acpi20table = NULL;
+    if (EFI_ERROR(EfiGetSystemConfigurationTable(&gEfiAcpi20TableGuid, &acpi20table))) {
+        CHECK_TRACE(!MustHaveNewAcpi, "New ACPI Table is not present");
+        acpi20table = NULL;
+    }
+
+    // allocate the needed space for gdt
+    TRACE("Allocating area for GDT");
+    InitLinuxDescriptorTables();
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Measure the boot information
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    // total_size and reserved
+    MB2_INFO Info = { .Size = 8 };
+
+    Info.Size += MB2_TAG_SIZE(GetStringTagSize(StrLen(Entry->Cmdline)));
+    Info.Size += MB2_TAG_SIZE(GetStringTagSize(sizeof(BOOTLOADER_NAME) - 1));
+    for (LIST_ENTRY* Link = Entry->BootModules.ForwardLink; Link != &Entry->BootModules; Link = Link->ForwardLink) {
+        Info.Size += MB2_TAG_SIZE(GetModuleTagSize(BASE_CR(Link, BOOT_MODULE, Link)));
+    }
+    Info.Size += MB2_TAG_SIZE(sizeof(struct multiboot_tag_framebuffer));
+
+    // RSDP is 20 bytes long, XSDP is 36 bytes long
+    if (acpi10table != NULL) {
+        Info.Size += MB2_TAG_SIZE(OFFSET_OF(struct multiboot_tag_old_acpi, rsdp) + 20);
+    }
+    if (acpi20table != NULL) {
+        Info.Size += MB2_TAG_SIZE(OFFSET_OF(struct multiboot_tag_new_acpi, rsdp) + 36);
+    }
+
+    if (!NotElf) {
+        Info.Size += MB2_TAG_SIZE(OFFSET_OF(struct multiboot_tag_elf_sections, sections) + elf_info.SectionHeadersSize);
+    }
+
+    Info.Size += MB2_TAG_SIZE(GetTimelineTagSize());
+    Info.Size += MB2_TAG_SIZE(sizeof(struct multiboot_tag_timer_frequency));
+
+    // the memory maps are measured for the worst case, take into
+    // account that allocating the arena will change the map
+    UINTN MaxMemoryMapSize = 0;
+    UINTN MaxEntries = 0;
+    CHECK_AND_RETHROW(MeasureMemoryMap(&MaxMemoryMapSize, &MaxEntries));
+    Info.Size += MB2_TAG_SIZE(OFFSET_OF(struct multiboot_tag_efi_mmap, efi_mmap) + MaxMemoryMapSize);
+    Info.Size += MB2_TAG_SIZE(OFFSET_OF(struct multiboot_tag_mmap, entries) + MaxEntries * sizeof(struct multiboot_mmap_entry));
+    Info.Size += sizeof(struct multiboot_tag);
+
+    // allocate it all at once, below 4GB so the kernel can access it
+    PLACEMENT_REQUEST InfoRequest = { 0 };
+    EFI_PHYSICAL_ADDRESS InfoBase = 0;
+    GetBootInfoPlacement(Entry, Info.Size, &InfoRequest);
+    CHECK_AND_RETHROW(AllocatePlacedPages(&InfoRequest, &InfoBase));
+    Info.Base = (UINT8*)InfoBase;
+    Info.Offset = 8;
+    ZeroMem(Info.Base, Info.Size);
+    TRACE("Boot information at %p (%d bytes)", Info.Base, Info.Size);
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Emit the boot information
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
     // push the command line
     {
         TRACE("Pushing cmdline");
-        UINTN size = StrLen(Entry->Cmdline) + 1 + OFFSET_OF(struct multiboot_tag_string, string);
-        struct multiboot_tag_string* string = PushBootParams(NULL, size);
-        string->type = MULTIBOOT_TAG_TYPE_CMDLINE;
-        string->size = size;
+        struct multiboot_tag_string* string = EmitTag(&Info, MULTIBOOT_TAG_TYPE_CMDLINE, GetStringTagSize(StrLen(Entry->Cmdline)));
         UnicodeStrToAsciiStr(Entry->Cmdline, string->string);
     }
 
     // push the bootloader name
     {
         TRACE("Pushing bootloader name");
-        UINTN size = sizeof("TomatBoot v2 UEFI") + OFFSET_OF(struct multiboot_tag_string, string);
-        struct multiboot_tag_string* string = PushBootParams(NULL, size);
-        string->type = MULTIBOOT_TAG_TYPE_BOOT_LOADER_NAME;
-        string->size = size;
-        AsciiStrCpy(string->string, "TomatBoot-UEFI");
+        struct multiboot_tag_string* string = EmitTag(&Info, MULTIBOOT_TAG_TYPE_BOOT_LOADER_NAME, GetStringTagSize(sizeof(BOOTLOADER_NAME) - 1));
+        AsciiStrCpy(string->string, BOOTLOADER_NAME);
     }
 
     // push the modules
     TRACE("Pushing modules");
-    for (LIST_ENTRY* Link = Entry->BootModules.ForwardLink; Link != &Entry->BootModules; Link = Link->ForwardLink) {
+    UINTN Index = 0;
+    for (LIST_ENTRY* Link = Entry->BootModules.ForwardLink; Link != &Entry->BootModules; Link = Link->ForwardLink, Index++) {
         BOOT_MODULE* Module = BASE_CR(Link, BOOT_MODULE, Link);
-        UINTN Start = 0;
-        UINTN Size = 0;
-        CHECK_AND_RETHROW(LoadBootModule(Module, &Start, &Size));
-
-        UINTN TotalTagSize = OFFSET_OF(struct multiboot_tag_module, cmdline) + StrLen(Module->Tag) + 1;
-        struct multiboot_tag_module* mod = PushBootParams(NULL, TotalTagSize);
-        mod->size = TotalTagSize;
-        mod->type = MULTIBOOT_TAG_TYPE_MODULE;
+        UINTN Start = LoadedModules[Index].Base;
+        UINTN Size = LoadedModules[Index].Size;
+
+        struct multiboot_tag_module* mod = EmitTag(&Info, MULTIBOOT_TAG_TYPE_MODULE, GetModuleTagSize(Module));
         mod->mod_start = Start;
         mod->mod_end = Start + Size;
         UnicodeStrToAsciiStr(Module->Tag, mod->cmdline);
@@ -292,141 +408,113 @@ EFI_STATUS LoadMB2Kernel(BOOT_ENTRY* Entry) {
 
     // push framebuffer info
     TRACE("Pushing framebuffer info");
-    struct multiboot_tag_framebuffer framebuffer = {
-        .common = {
-            .type = MULTIBOOT_TAG_TYPE_FRAMEBUFFER,
-            .size = sizeof(struct multiboot_tag_framebuffer),
-            .framebuffer_addr = gop->Mode->FrameBufferBase,
-            .framebuffer_pitch = gop->Mode->Info->PixelsPerScanLine * 4,
-            .framebuffer_width = gop->Mode->Info->HorizontalResolution,
-            .framebuffer_height = gop->Mode->Info->VerticalResolution,
-            .framebuffer_bpp = 32,
-            .framebuffer_type = MULTIBOOT_FRAMEBUFFER_TYPE_RGB
-        },
-        .framebuffer_red_field_position = 16,
-        .framebuffer_red_mask_size = 8,
-        .framebuffer_green_field_position = 8,
-        .framebuffer_green_mask_size = 8,
-        .framebuffer_blue_field_position = 0,
-        .framebuffer_blue_mask_size = 8
-    };
-    PushBootParams(&framebuffer, sizeof(framebuffer));
+    struct multiboot_tag_framebuffer* framebuffer = EmitTag(&Info, MULTIBOOT_TAG_TYPE_FRAMEBUFFER, sizeof(struct multiboot_tag_framebuffer));
+    framebuffer->common.framebuffer_addr = gop->Mode->FrameBufferBase;
+    framebuffer->common.framebuffer_pitch = gop->Mode->Info->PixelsPerScanLine * 4;
+    framebuffer->common.framebuffer_width = gop->Mode->Info->HorizontalResolution;
+    framebuffer->common.framebuffer_height = gop->Mode->Info->VerticalResolution;
+    framebuffer->common.framebuffer_bpp = 32;
+    framebuffer->common.framebuffer_type = MULTIBOOT_FRAMEBUFFER_TYPE_RGB;
+    framebuffer->common.reserved = 0;
+    framebuffer->framebuffer_red_field_position = 16;
+    framebuffer->framebuffer_red_mask_size = 8;
+    framebuffer->framebuffer_green_field_position = 8;
+    framebuffer->framebuffer_green_mask_size = 8;
+    framebuffer->framebuffer_blue_field_position = 0;
+    framebuffer->framebuffer_blue_mask_size = 8;
 
     // push the old acpi table if has it
-    void* acpi10table;
-    if (!EFI_ERROR(EfiGetSystemConfigurationTable(&gEfiAcpi10TableGuid, &acpi10table))) {
-        // RSDP is 20 bytes long
+    if (acpi10table != NULL) {
         TRACE("Pushing old ACPI info");
-        struct multiboot_tag_old_acpi* old_acpi = PushBootParams(NULL, 20 + OFFSET_OF(struct multiboot_tag_old_acpi, rsdp));
-        old_acpi->size = 20 + OFFSET_OF(struct multiboot_tag_old_acpi, rsdp);
-        old_acpi->type = MULTIBOOT_TAG_TYPE_ACPI_OLD;
+        struct multiboot_tag_old_acpi* old_acpi = EmitTag(&Info, MULTIBOOT_TAG_TYPE_ACPI_OLD, OFFSET_OF(struct multiboot_tag_old_acpi, rsdp) + 20);
         CopyMem(old_acpi->rsdp, acpi10table, 20);
-    } else if (MustHaveOldAcpi) {
-        CHECK_FAIL_TRACE("Old ACPI Table is not present");
     }
 
     // push the new acpi table if has it
-    void* acpi20table;
-    if (!EFI_ERROR(EfiGetSystemConfigurationTable(&gEfiAcpi20TableGuid, &acpi20table))) {
-        // XSDP is 36 bytes long
+    if (acpi20table != NULL) {
         TRACE("Pushing new ACPI info");
-        struct multiboot_tag_new_acpi* new_acpi = PushBootParams(NULL, 36 + OFFSET_OF(struct multiboot_tag_new_acpi, rsdp));
-        new_acpi->size = 36 + OFFSET_OF(struct multiboot_tag_new_acpi, rsdp);
-        new_acpi->type = MULTIBOOT_TAG_TYPE_ACPI_NEW;
+        struct multiboot_tag_new_acpi* new_acpi = EmitTag(&Info, MULTIBOOT_TAG_TYPE_ACPI_NEW, OFFSET_OF(struct multiboot_tag_new_acpi, rsdp) + 36);
         CopyMem(new_acpi->rsdp, acpi20table, 36);
-    } else if (MustHaveNewAcpi) {
-        CHECK_FAIL_TRACE("New ACPI Table is not present");
     }
 
-    // load the elf
-    if (NotElf) {
-        // TODO: Load raw image
-        CHECK_FAIL_TRACE("Raw image is not supported yet");
-    } else {
-        ELF_INFO elf_info;
-
-        // try with 32bit elf
-        TRACE("Trying to load ELF32");
-        if (EFI_ERROR(LoadElf32(Entry->Fs, Entry->Path, &elf_info))) {
-            // try with elf64
-            TRACE("Not ELF32, trying ELF64");
-            CHECK_AND_RETHROW(LoadElf64(Entry->Fs, Entry->Path, &elf_info));
-        }
-
-        // push elf info
+    // push elf info
+    if (!NotElf) {
         TRACE("Pushing ELF info");
-        UINTN Size = OFFSET_OF(struct multiboot_tag_elf_sections, sections) + elf_info.SectionHeadersSize;
-        struct multiboot_tag_elf_sections* sections = PushBootParams(NULL, Size);
-        sections->size = Size;
-        sections->type = MULTIBOOT_TAG_TYPE_ELF_SECTIONS;
+        struct multiboot_tag_elf_sections* sections = EmitTag(&Info, MULTIBOOT_TAG_TYPE_ELF_SECTIONS, OFFSET_OF(struct multiboot_tag_elf_sections, sections) + elf_info.SectionHeadersSize);
         sections->entsize = elf_info.SectionEntrySize;
         sections->num = elf_info.SectionHeadersSize / elf_info.SectionEntrySize;
         sections->shndx = elf_info.StringSectionIndex;
         CopyMem(sections->sections, elf_info.SectionHeaders, elf_info.SectionHeadersSize);
-
-        if (EntryAddressOverride == 0) {
-            EntryAddressOverride = elf_info.Entry;
-        }
     }
 
-    // allocate the needed space for gdt
-    TRACE("Allocating area for GDT");
-    InitLinuxDescriptorTables();
+    // push the timeline, it is only filled right before the
+    // jump so the exit from the boot services is included
+    TRACE("Pushing timeline");
+    STATIC_ASSERT(sizeof(struct multiboot_timeline_entry) == sizeof(TIMELINE_ENTRY), "Timeline entry layout mismatch");
+    struct multiboot_tag_timeline* timeline = EmitTag(&Info, MULTIBOOT_TAG_TYPE_TOMATBOOT_TIMELINE, GetTimelineTagSize());
+
+    // the timer frequencies, the lapic timer is measured while we
+    // finish up after exiting the boot services
+    TRACE("Pushing timer frequencies");
+    struct multiboot_tag_timer_frequency* timer_frequency = EmitTag(&Info, MULTIBOOT_TAG_TYPE_TOMATBOOT_TIMER_FREQUENCY, sizeof(struct multiboot_tag_timer_frequency));
+    timer_frequency->tsc_frequency = GetTimerTscFrequency();
+    timer_frequency->tsc_error = GetTimerTscError();
+
+    // the APs have to go back to the firmware before we exit boot services
+    StopTaskRuntime();
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // No prints from here
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    // setup the mmap information
-    UINT8 TmpMemoryMap[1];
-    UINTN MemoryMapSize = sizeof(TmpMemoryMap);
-    UINTN MapKey;
-    UINTN DescriptorSize;
-    UINT32 DescriptorVersion;
-    CHECK(gBS->GetMemoryMap(&MemoryMapSize, (EFI_MEMORY_DESCRIPTOR *) TmpMemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion) == EFI_BUFFER_TOO_SMALL);
-
-    // allocate space for the efi mmap and take into
-    // account that there will be changes
-    MemoryMapSize += EFI_PAGE_SIZE;
-    EFI_MEMORY_DESCRIPTOR* MemoryMap = AllocatePool(MemoryMapSize);
-
-    // allocate all the space we will need (hopefully)
-    UINT8* start_from = PushBootParams(NULL, OFFSET_OF(struct multiboot_tag_efi_mmap, efi_mmap) + MemoryMapSize + OFFSET_OF(struct multiboot_tag_mmap, entries) + MemoryMapSize);
-
-    // call it
-    EFI_CHECK(gBS->GetMemoryMap(&MemoryMapSize, MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion));
-    UINTN EntryCount = (MemoryMapSize / DescriptorSize);
+    // the efi memory map is read right into its tag, it goes first since its final
+    // size is only known once we have it, the normal memory map will follow it
+    struct multiboot_tag_efi_mmap* efi_mmap = (struct multiboot_tag_efi_mmap*)(Info.Base + Info.Offset);
+    MEMORY_MAP MemoryMap = { .Buffer = efi_mmap->efi_mmap, .BufferSize = MaxMemoryMapSize };
+    Phase = TimelineBegin("memory map");
+    CHECK_AND_RETHROW(SnapshotMemoryMap(&MemoryMap));
+    TimelineEnd(Phase);
 
     // Exit the memory services
-    EFI_CHECK(gBS->ExitBootServices(gImageHandle, MapKey));
-
-    // setup the normal memory map
-    struct multiboot_tag_mmap* mmap = (void*)start_from;
-    mmap->type = MULTIBOOT_TAG_TYPE_MMAP;
+    Phase = TimelineBegin("exit boot services");
+    EFI_CHECK(gBS->ExitBootServices(gImageHandle, MemoryMap.MapKey));
+    TimelineEnd(Phase);
+
+    // the timer is ours now
+    StartLapicTimerMeasurement();
+
+    // the conversion sorts the efi memory map in place, so
+    // both of the maps come out sorted
+    Phase = TimelineBegin("memory map convert");
+    EmitTag(&Info, MULTIBOOT_TAG_TYPE_EFI_MMAP, OFFSET_OF(struct multiboot_tag_efi_mmap, efi_mmap) + MemoryMap.MapSize);
+    efi_mmap->descr_size = MemoryMap.DescriptorSize;
+    efi_mmap->descr_vers = MemoryMap.DescriptorVersion;
+
+    // setup the normal memory map, converted right into place and then
+    // emitted with the exact size
+    STATIC_ASSERT(sizeof(struct multiboot_mmap_entry) == sizeof(MEMORY_MAP_ENTRY), "Memory map entry layout mismatch");
+    struct multiboot_tag_mmap* mmap = (struct multiboot_tag_mmap*)(Info.Base + Info.Offset);
+    UINTN EntryCount = ConvertMemoryMap(&MemoryMap, &mMB2MemoryTypes, (MEMORY_MAP_ENTRY*)mmap->entries);
+    EmitTag(&Info, MULTIBOOT_TAG_TYPE_MMAP, OFFSET_OF(struct multiboot_tag_mmap, entries) + EntryCount * sizeof(struct multiboot_mmap_entry));
     mmap->entry_size = sizeof(struct multiboot_mmap_entry);
     mmap->entry_version = 0;
-    mmap->size = OFFSET_OF(struct multiboot_tag_mmap, entries) + EntryCount * sizeof(struct multiboot_mmap_entry);
-    for (int i = 0; i < EntryCount; i++) {
-        struct multiboot_mmap_entry* entry = &mmap->entries[i];
-        EFI_MEMORY_DESCRIPTOR* desc = (EFI_MEMORY_DESCRIPTOR*)((UINTN)MemoryMap + DescriptorSize * i);
-        entry->type = EfiTypeToMB2Type[desc->Type];
-        entry->addr = desc->PhysicalStart;
-        entry->len = EFI_PAGES_TO_SIZE(desc->NumberOfPages);
-        entry->zero = 0;
-    }
-
-    // setup the efi memory type
-    struct multiboot_tag_efi_mmap* efi_mmap = (struct multiboot_tag_efi_mmap*)ALIGN_VALUE((UINTN)mmap + mmap->size, MULTIBOOT_TAG_ALIGN);
-    efi_mmap->size = MemoryMapSize + OFFSET_OF(struct multiboot_tag_efi_mmap, efi_mmap);
-    efi_mmap->type = MULTIBOOT_TAG_TYPE_EFI_MMAP;
-    efi_mmap->descr_size = DescriptorSize;
-    efi_mmap->descr_vers = DescriptorVersion;
-    CopyMem(efi_mmap->efi_mmap, MemoryMap, MemoryMapSize);
+    TimelineEnd(Phase);
 
     // append the end tag now
-    struct multiboot_tag* end_tag = (struct multiboot_tag*)ALIGN_VALUE((UINTN)efi_mmap + efi_mmap->size, MULTIBOOT_TAG_ALIGN);
-    end_tag->type = MULTIBOOT_TAG_TYPE_END;
-    end_tag->size = sizeof(struct multiboot_tag);
+    EmitTag(&Info, MULTIBOOT_TAG_TYPE_END, sizeof(struct multiboot_tag));
+
+    // and finally the fixed part
+    ((multiboot_uint32_t*)Info.Base)[0] = Info.Offset;
+    ((multiboot_uint32_t*)Info.Base)[1] = 0;
+
+    FinishLapicTimerMeasurement(&timer_frequency->lapic_timer_frequency, &timer_frequency->lapic_timer_error);
+
+    // fill the timeline and report it
+    TIMELINE_ENTRY* timeline_entries = NULL;
+    timeline->tsc_frequency = GetTscFrequency();
+    timeline->entry_count = GetTimelineEntries(&timeline_entries);
+    CopyMem(timeline->entries, timeline_entries, sizeof(TIMELINE_ENTRY) * timeline->entry_count);
+    DumpTimeline();
 
     // no interrupts
     DisableInterrupts();
@@ -435,12 +523,16 @@ EFI_STATUS LoadMB2Kernel(BOOT_ENTRY* Entry) {
     SetLinuxDescriptorTables();
 
     // jump to the kernel
-    JumpToMB2Kernel((void*)EntryAddressOverride, mBootParamsBuffer);
+    JumpToMB2Kernel((void*)EntryAddressOverride, Info.Base);
 
     // if we ever return sleep
     while(1) CpuSleep();
 
 cleanup:
+    if (LoadedModules != NULL) {
+        FreePool(LoadedModules);
+    }
+
     if (header != NULL) {
         FreePool(header);
     }
@@ -64,6 +64,10 @@
 #define MULTIBOOT_TAG_TYPE_EFI64_IH          20
 #define MULTIBOOT_TAG_TYPE_LOAD_BASE_ADDR    21
 
+/*  TomatBoot specific tags.  */
+#define MULTIBOOT_TAG_TYPE_TOMATBOOT_TIMELINE  0x544d4201
+#define MULTIBOOT_TAG_TYPE_TOMATBOOT_TIMER_FREQUENCY  0x544d4202
+
 #define MULTIBOOT_HEADER_TAG_END  0
 #define MULTIBOOT_HEADER_TAG_INFORMATION_REQUEST  1
 #define MULTIBOOT_HEADER_TAG_ADDRESS  2
@@ -412,6 +416,34 @@ struct multiboot_tag_load_base_addr
     multiboot_uint32_t load_base_addr;
 };
 
+/*  How long each phase of the boot took, the times are raw TSC values.  */
+struct multiboot_timeline_entry
+{
+    char name[24];
+    multiboot_uint64_t start;
+    multiboot_uint64_t end;
+};
+
+struct multiboot_tag_timeline
+{
+    multiboot_uint32_t type;
+    multiboot_uint32_t size;
+    multiboot_uint64_t tsc_frequency;
+    multiboot_uint32_t entry_count;
+    multiboot_uint32_t reserved;
+    struct multiboot_timeline_entry entries[0];
+};
+
+struct multiboot_tag_timer_frequency
+{
+    multiboot_uint32_t type;
+    multiboot_uint32_t size;
+    multiboot_uint64_t tsc_frequency;
+    multiboot_uint64_t tsc_error;
+    multiboot_uint64_t lapic_timer_frequency;
+    multiboot_uint64_t lapic_timer_error;
+};
+
 #endif /*  ! ASM_FILE */
 
 #endif /*  ! MULTIBOOT_HEADER */
\ No newline at end of file
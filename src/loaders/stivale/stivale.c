@@ -10,7 +10,12 @@
 #include <loaders/elf/elf64.h>
 #include <loaders/elf/ElfLoader.h>
 #include <util/FileUtils.h>
+#include <util/TaskRuntime.h>
+#include <util/Timeline.h>
 #include <loaders/Loaders.h>
+#include <loaders/KernelImage.h>
+#include <loaders/MemoryMap.h>
+#include <loaders/PageTables.h>
 #include <Library/BaseMemoryLib.h>
 #include <Library/FileHandleLib.h>
 #include <Library/UefiRuntimeServicesTableLib.h>
@@ -21,7 +26,7 @@
 
 #include "stivale.h"
 
-static UINT32 EfiTypeToStivaleType[] = {
+static CONST UINT32 EfiTypeToStivaleType[] = {
     [EfiReservedMemoryType] = STIVALE_RESERVED,
     [EfiRuntimeServicesCode] = STIVALE_RESERVED,
     [EfiRuntimeServicesData] = STIVALE_RESERVED,
@@ -38,25 +43,31 @@ static UINT32 EfiTypeToStivaleType[] = {
     [EfiACPIMemoryNVS] = STIVALE_ACPI_NVS
 };
 
-void NORETURN JumpToStivaleKernel(STIVALE_STRUCT* strct, UINT64 Stack, void* KernelEntry, BOOLEAN level5);
+static CONST MEMORY_MAP_TYPES mStivaleMemoryTypes = {
+    .Table = EfiTypeToStivaleType,
+    .TableSize = ARRAY_SIZE(EfiTypeToStivaleType),
+    .KernelAndModules = STIVALE_KERNEL_MODULES,
+    .BootInfo = STIVALE_BOOTLOADER_RECLAIM,
+    .Reserved = STIVALE_RESERVED,
+};
+
+void NORETURN JumpToStivaleKernel(STIVALE_STRUCT* strct, UINT64 Stack, void* KernelEntry, UINT64 Pml5);
 
 
 
 static EFI_STATUS LoadStivaleHeader(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FS, CHAR16* file, STIVALE_HEADER* header, BOOLEAN* HigherHalf) {
     EFI_STATUS Status = EFI_SUCCESS;
-    EFI_FILE_PROTOCOL* root = NULL;
-    EFI_FILE_PROTOCOL* image = NULL;
+    KERNEL_IMAGE* image = NULL;
     CHAR8* names = NULL;
     CHECK(HigherHalf != NULL);
     *HigherHalf = FALSE;
 
     // open the executable file
-    Print(L"Loading image `%s`\n", file);
-    EFI_CHECK(FS->OpenVolume(FS, &root));
-    EFI_CHECK(root->Open(root, &image, file, EFI_FILE_MODE_READ, 0));
+    CHECK_AND_RETHROW(OpenKernelImage(FS, file, &image));
 
+    CHECK(image->HeadSize >= sizeof(Elf64_Ehdr));
     Elf64_Ehdr ehdr = {0};
-    CHECK_AND_RETHROW(FileRead(image, &ehdr, sizeof(ehdr), 0));
+    CopyMem(&ehdr, image->Head, sizeof(ehdr));
 
     // verify is an elf
     CHECK(IS_ELF(ehdr));
@@ -71,18 +82,25 @@ static EFI_STATUS LoadStivaleHeader(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FS, CHAR16*
         *HigherHalf = TRUE;
     }
 
+    // get all the section headers at once
+    UINT8* shdrs = NULL;
+    CHECK(ehdr.e_shentsize >= sizeof(Elf64_Shdr));
+    CHECK(ehdr.e_shstrndx < ehdr.e_shnum);
+    CHECK_AND_RETHROW(GetKernelImageSectionHeaders(image, ehdr.e_shoff, ehdr.e_shnum * ehdr.e_shentsize, (void**)&shdrs));
+
     // read the string table
     Elf64_Shdr shstr;
-    CHECK_AND_RETHROW(FileRead(image, &shstr, sizeof(Elf64_Shdr), ehdr.e_shoff + ehdr.e_shentsize * ehdr.e_shstrndx));
-    names = AllocatePool(shstr.sh_size);
-    CHECK_AND_RETHROW(FileRead(image, names, shstr.sh_size, shstr.sh_offset));
+    CopyMem(&shstr, shdrs + ehdr.e_shentsize * ehdr.e_shstrndx, sizeof(Elf64_Shdr));
+    names = AllocateZeroPool(shstr.sh_size + 1);
+    CHECK_ERROR(names != NULL, EFI_OUT_OF_RESOURCES);
+    CHECK_AND_RETHROW(KernelImageRead(image, names, shstr.sh_size, shstr.sh_offset));
 
     // search for the stivale section
     Elf64_Shdr shdr;
     BOOLEAN found = FALSE;
     for (int i = 0; i < ehdr.e_shnum; i++) {
-        CHECK_AND_RETHROW(FileRead(image, &shdr, sizeof(Elf64_Shdr), ehdr.e_shoff + ehdr.e_shentsize * i));
-        if (AsciiStrCmp(&names[shdr.sh_name], ".stivalehdr") == 0) {
+        CopyMem(&shdr, shdrs + ehdr.e_shentsize * i, sizeof(Elf64_Shdr));
+        if (shdr.sh_name < shstr.sh_size && AsciiStrCmp(&names[shdr.sh_name], ".stivalehdr") == 0) {
             found = TRUE;
             break;
         }
@@ -91,7 +109,7 @@ static EFI_STATUS LoadStivaleHeader(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FS, CHAR16*
 
     // zero and read it
     CHECK(sizeof(*header) == shdr.sh_size);
-    CHECK_AND_RETHROW(FileRead(image, header, sizeof(*header), shdr.sh_offset));
+    CHECK_AND_RETHROW(KernelImageRead(image, header, sizeof(*header), shdr.sh_offset));
 
     // change the higher half spec if we have a
     // different entry point
@@ -104,14 +122,6 @@ cleanup:
         FreePool(names);
     }
 
-    if (root != NULL) {
-        FileHandleClose(root);
-    }
-
-    if (image != NULL) {
-        FileHandleClose(image);
-    }
-
     return Status;
 }
 
@@ -119,7 +129,7 @@ EFI_STATUS LoadStivaleKernel(BOOT_ENTRY* Entry) {
     EFI_STATUS Status = EFI_SUCCESS;
     STIVALE_HEADER Header = {0};
     ELF_INFO Elf = {0};
-    BOOLEAN level5Supported = FALSE;
+    LOADED_MODULE* LoadedModules = NULL;
 
     // load config
     BOOT_CONFIG config;
@@ -142,14 +152,10 @@ EFI_STATUS LoadStivaleKernel(BOOT_ENTRY* Entry) {
     }
 
     EFI_GRAPHICS_OUTPUT_PROTOCOL* gop = NULL;
+    UINTN Phase = TimelineBegin("gop set");
     ASSERT_EFI_ERROR(gBS->LocateProtocol(&gEfiGraphicsOutputProtocolGuid, NULL, (VOID**)&gop));
     ASSERT_EFI_ERROR(gop->SetMode(gop, (UINT32) GfxMode));
-
-    UINT32 eax, ebx, ecx, edx;
-    AsmCpuidEx(0x00000007, 0, &eax, &ebx, &ecx, &edx);
-    if (ecx & BIT16) {
-        level5Supported = TRUE;
-    }
+    TimelineEnd(Phase);
 
     WARN_ON(!Header.EnableKASLR, "KASLR Is not supported yet! ignoring.");
 
@@ -160,12 +166,15 @@ EFI_STATUS LoadStivaleKernel(BOOT_ENTRY* Entry) {
     }
 
     // setup the struct
-    STIVALE_STRUCT* Struct = AllocateReservedPool(sizeof(STIVALE_STRUCT));
-    SetMem(Struct, sizeof(STIVALE_STRUCT), 0);
+    // everything handed to the kernel is in the boot information memory
+    // type, so it is reported as bootloader reclaimable
+    STIVALE_STRUCT* Struct = AllocateBootInfoPool(sizeof(STIVALE_STRUCT));
+    CHECK_ERROR(Struct != NULL, EFI_OUT_OF_RESOURCES);
 
     // cmdline
     TRACE("Setting cmdline");
-    Struct->Cmdline = (UINT64)AllocateReservedPool(StrLen(Entry->Cmdline) + 1);
+    Struct->Cmdline = (UINT64)AllocateBootInfoPool(StrLen(Entry->Cmdline) + 1);
+    CHECK_ERROR(Struct->Cmdline != 0, EFI_OUT_OF_RESOURCES);
     UnicodeStrToAsciiStr(Entry->Cmdline, (CHAR8*)Struct->Cmdline);
 
     // graphics info
@@ -186,13 +195,19 @@ EFI_STATUS LoadStivaleKernel(BOOT_ENTRY* Entry) {
 
     // set the acpi table
     void* acpi_table = NULL;
+    UINTN rsdp_size = 0;
     if (!EFI_ERROR(EfiGetSystemConfigurationTable(&gEfiAcpi20TableGuid, &acpi_table))) {
-        Struct->Rsdp = (UINT64)AllocateReservedCopyPool(36, acpi_table);
+        rsdp_size = 36;
     } else if (!EFI_ERROR(EfiGetSystemConfigurationTable(&gEfiAcpi10TableGuid, &acpi_table))) {
-        Struct->Rsdp = (UINT64)AllocateReservedCopyPool(20, acpi_table);
+        rsdp_size = 20;
     } else {
         WARN("No ACPI table found, RSDP set to NULL");
     }
+    if (rsdp_size != 0) {
+        Struct->Rsdp = (UINT64)AllocateBootInfoPool(rsdp_size);
+        CHECK_ERROR(Struct->Rsdp != 0, EFI_OUT_OF_RESOURCES);
+        CopyMem((void*)Struct->Rsdp, acpi_table, rsdp_size);
+    }
 
     TRACE("Setting epoch");
     EFI_TIME Time = { 0 };
@@ -201,14 +216,24 @@ EFI_STATUS LoadStivaleKernel(BOOT_ENTRY* Entry) {
 
     // push the modules
     TRACE("Loading modules");
-    STIVALE_MODULE* LastModule = NULL;
+    UINTN ModuleCount = 0;
     for (LIST_ENTRY* Link = Entry->BootModules.ForwardLink; Link != &Entry->BootModules; Link = Link->ForwardLink) {
+        ModuleCount++;
+    }
+
+    LoadedModules = AllocateZeroPool(sizeof(LOADED_MODULE) * (ModuleCount + 1));
+    CHECK_ERROR(LoadedModules != NULL, EFI_OUT_OF_RESOURCES);
+    CHECK_AND_RETHROW(LoadBootModules(Entry, &Entry->Placement, LoadedModules, ModuleCount));
+
+    STIVALE_MODULE* LastModule = NULL;
+    UINTN Index = 0;
+    for (LIST_ENTRY* Link = Entry->BootModules.ForwardLink; Link != &Entry->BootModules; Link = Link->ForwardLink, Index++) {
         BOOT_MODULE* Module = BASE_CR(Link, BOOT_MODULE, Link);
-        UINTN Start = 0;
-        UINTN Size = 0;
-        CHECK_AND_RETHROW(LoadBootModule(Module, &Start, &Size));
+        UINTN Start = LoadedModules[Index].Base;
+        UINTN Size = LoadedModules[Index].Size;
 
-        STIVALE_MODULE* NewModule = AllocateReservedZeroPool(sizeof(STIVALE_MODULE));
+        STIVALE_MODULE* NewModule = AllocateBootInfoPool(sizeof(STIVALE_MODULE));
+        CHECK_ERROR(NewModule != NULL, EFI_OUT_OF_RESOURCES);
         NewModule->Begin = Start;
         NewModule->End = Start + Size;
         UnicodeStrToAsciiStrS(Module->Tag, NewModule->String, sizeof(NewModule->String));
@@ -225,95 +250,66 @@ EFI_STATUS LoadStivaleKernel(BOOT_ENTRY* Entry) {
         TRACE("    Added %s (%s) -> %p - %p", Module->Tag, Module->Path, Start, Start + Size);
     }
 
-    // setup the page table correctly
-    // first disable write protection so we can modify the table
-    TRACE("Preparing higher half");
-    IA32_CR0 Cr0 = { .UintN = AsmReadCr0() };
-    Cr0.Bits.WP = 0;
-    AsmWriteCr0(Cr0.UintN);
+    // we are done with the kernel file
+    CloseKernelImage();
 
-    // get the memory map
-    UINT64* Pml4 = (UINT64*)AsmReadCr3();
-
-    // take the first pml4 and copy it to 0xffff800000000000
-    Pml4[256] = Pml4[0];
-
-    // allocate pml3 for 0xffffffff80000000
-    UINT64* Pml3High = AllocateReservedPages(1);
-    SetMem(Pml3High, EFI_PAGE_SIZE, 0);
-    TRACE("Allocated page %p", Pml3High);
-    Pml4[511] = ((UINT64)Pml3High) | 0x3u;
-
-    // map first 2 pages to 0xffffffff80000000
-    UINT64* Pml3Low = (UINT64*)(Pml4[0] & 0x7ffffffffffff000u);
-    Pml3High[510] = Pml3Low[0];
-    Pml3High[511] = Pml3Low[1];
+    // build our own tables, the firmware ones are left alone
+    TRACE("Preparing higher half");
+    Phase = TimelineBegin("page tables");
+    PAGE_TABLES PageTables = { 0 };
+    CHECK_AND_RETHROW(InitPageTables(&PageTables, Header.Pml5Enable));
+    CHECK_AND_RETHROW(MapPhysicalMemory(&PageTables));
+    CHECK_AND_RETHROW(MapPhysicalRange(&PageTables, gop->Mode->FrameBufferBase, gop->Mode->FrameBufferSize));
+    CHECK_AND_RETHROW(MapKernelSegments(&PageTables, &Elf));
+    TimelineEnd(Phase);
 
     TRACE("Getting memory map");
+    // the APs have to go back to the firmware before we exit boot services
+    StopTaskRuntime();
+
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // No prints from here
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    // setup the mmap information
-    UINT8 TmpMemoryMap[1];
-    UINTN MemoryMapSize = sizeof(TmpMemoryMap);
-    UINTN MapKey = 0;
-    UINTN DescriptorSize = 0;
-    UINT32 DescriptorVersion = 0;
-    CHECK(gBS->GetMemoryMap(&MemoryMapSize, (EFI_MEMORY_DESCRIPTOR *) TmpMemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion) == EFI_BUFFER_TOO_SMALL);
-
-    // allocate space for the efi mmap and take into
-    // account that there will be changes
-    MemoryMapSize += EFI_PAGE_SIZE;
-    EFI_MEMORY_DESCRIPTOR* MemoryMap = AllocatePool(MemoryMapSize);
-
-    // allocate all the space we will need (hopefully)
-    STIVALE_MMAP_ENTRY* StartFrom = AllocateReservedPool((MemoryMapSize / DescriptorSize) * sizeof(STIVALE_MMAP_ENTRY));
-
-    // call it
-    EFI_CHECK(gBS->GetMemoryMap(&MemoryMapSize, MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion));
-    UINTN EntryCount = (MemoryMapSize / DescriptorSize);
+    // take the memory map right into its buffer, the entries
+    // are converted in place once we are out of boot services
+    Phase = TimelineBegin("memory map");
+    UINTN MemoryMapSize = 0;
+    UINTN MaxEntries = 0;
+    CHECK_AND_RETHROW(MeasureMemoryMap(&MemoryMapSize, &MaxEntries));
+    MEMORY_MAP MemoryMap = { .Buffer = AllocatePool(MemoryMapSize), .BufferSize = MemoryMapSize };
+    CHECK_ERROR(MemoryMap.Buffer != NULL, EFI_OUT_OF_RESOURCES);
+    STIVALE_MMAP_ENTRY* Entries = AllocateBootInfoPool(MaxEntries * sizeof(STIVALE_MMAP_ENTRY));
+    CHECK_ERROR(Entries != NULL, EFI_OUT_OF_RESOURCES);
+    CHECK_AND_RETHROW(SnapshotMemoryMap(&MemoryMap));
+    TimelineEnd(Phase);
 
     // Exit the memory services
-    EFI_CHECK(gBS->ExitBootServices(gImageHandle, MapKey));
+    Phase = TimelineBegin("exit boot services");
+    EFI_CHECK(gBS->ExitBootServices(gImageHandle, MemoryMap.MapKey));
+    TimelineEnd(Phase);
 
     // setup the normal memory map
-    Struct->MemoryMapAddr = (UINT64)StartFrom;
-    Struct->MemoryMapEntries = 0;
-    int LastType = -1;
-    UINTN LastEnd = 0xFFFFFFFFFFFF;
-    for (int i = 0; i < EntryCount; i++) {
-        EFI_MEMORY_DESCRIPTOR* Desc = (EFI_MEMORY_DESCRIPTOR*)((UINTN)MemoryMap + DescriptorSize * i);
-        EFI_PHYSICAL_ADDRESS PhysicalBase = Desc->PhysicalStart;
-        UINTN Length = EFI_PAGES_TO_SIZE(Desc->NumberOfPages);
-        EFI_PHYSICAL_ADDRESS PhysicalEnd = Desc->PhysicalStart + Length;
-
-        int Type = STIVALE_RESERVED;
-        if (Desc->Type == gKernelAndModulesMemoryType) {
-            Type = STIVALE_KERNEL_MODULES;
-        } else if (Desc->Type < EfiMaxMemoryType) {
-            Type = EfiTypeToStivaleType[Desc->Type];
-        }
+    Phase = TimelineBegin("memory map convert");
+    STATIC_ASSERT(sizeof(STIVALE_MMAP_ENTRY) == sizeof(MEMORY_MAP_ENTRY), "Memory map entry layout mismatch");
+    Struct->MemoryMapAddr = (UINT64)Entries;
+    Struct->MemoryMapEntries = ConvertMemoryMap(&MemoryMap, &mStivaleMemoryTypes, (MEMORY_MAP_ENTRY*)Entries);
+    TimelineEnd(Phase);
 
-        if (LastType == Type && LastEnd == Desc->PhysicalStart) {
-            StartFrom[-1].Length += Length;
-        } else {
-            StartFrom->Type = Type;
-            StartFrom->Length = Length;
-            StartFrom->Base = PhysicalBase;
-            StartFrom->Unused = 0;
-            LastType = Type;
-            StartFrom++;
-            Struct->MemoryMapEntries++;
-        }
-        LastEnd = PhysicalEnd;
-    }
+    // stivale has no way to pass it, so just report it
+    DumpTimeline();
 
     // no interrupts
     DisableInterrupts();
 
-    JumpToStivaleKernel(Struct, Header.Stack, (void*)Elf.Entry, Header.Pml5Enable && level5Supported);
+    ActivatePageTables(&PageTables);
+
+    JumpToStivaleKernel(Struct, Header.Stack, (void*)Elf.Entry, PageTables.Levels == 5 ? (UINT64)PageTables.Root : 0);
 
 cleanup:
+    if (LoadedModules != NULL) {
+        FreePool(LoadedModules);
+    }
+
     return Status;
 }
@@ -19,7 +19,13 @@
 #include <loaders/elf/elf64.h>
 #include <loaders/mb2/gdt.h>
 #include <loaders/Loaders.h>
+#include <loaders/KernelImage.h>
+#include <loaders/MemoryMap.h>
+#include <loaders/PageTables.h>
 #include <util/FileUtils.h>
+#include <util/TaskRuntime.h>
+#include <util/Timeline.h>
+#include <uefi/AcpiTimerLib.h>
 #include <util/TimeUtils.h>
 #include <util/GfxUtils.h>
 #include <util/Except.h>
@@ -29,7 +35,7 @@
 
 #include "stivale2.h"
 
-static UINT32 EfiTypeToStivaleType[] = {
+static CONST UINT32 EfiTypeToStivaleType[] = {
     [EfiReservedMemoryType] = STIVALE2_RESERVED,
     [EfiLoaderCode] = STIVALE2_BOOTLOADER_RECLAIMABLE,
     [EfiLoaderData] = STIVALE2_BOOTLOADER_RECLAIMABLE,
@@ -47,23 +53,61 @@ static UINT32 EfiTypeToStivaleType[] = {
     [EfiPersistentMemory] = STIVALE2_RESERVED,
 };
 
-void NORETURN JumpToStivale2Kernel(STIVALE2_STRUCT* strct, UINT64 Stack, void* KernelEntry, BOOLEAN level5);
+static CONST MEMORY_MAP_TYPES mStivale2MemoryTypes = {
+    .Table = EfiTypeToStivaleType,
+    .TableSize = ARRAY_SIZE(EfiTypeToStivaleType),
+    .KernelAndModules = STIVALE2_KERNEL_AND_MODULES,
+    .BootInfo = STIVALE2_BOOTLOADER_RECLAIMABLE,
+    .Reserved = STIVALE2_RESERVED,
+};
+
+/**
+ * The boot information is built in two passes, first everything is measured
+ * and a single arena is allocated, then the struct and the tags are emitted
+ * in place, each tag is linked to the previous one as it is emitted
+ */
+typedef struct _STIVALE2_INFO {
+    UINT8* Base;
+    UINTN Size;
+    UINTN Offset;
+    void** Next;
+} STIVALE2_INFO;
+
+#define STIVALE2_ITEM_SIZE(size) ALIGN_VALUE(size, 8)
+
+static void* EmitItem(STIVALE2_INFO* Info, UINTN Size) {
+    ASSERT(Info->Offset + STIVALE2_ITEM_SIZE(Size) <= Info->Size);
+
+    void* Item = Info->Base + Info->Offset;
+    Info->Offset += STIVALE2_ITEM_SIZE(Size);
+
+    return Item;
+}
+
+static void* EmitTag(STIVALE2_INFO* Info, UINT64 Identifier, UINTN Size) {
+    STIVALE2_HDR_TAG* Tag = EmitItem(Info, Size);
+    Tag->Identifier = Identifier;
+    *Info->Next = Tag;
+    Info->Next = &Tag->Next;
+
+    return Tag;
+}
+
+void NORETURN JumpToStivale2Kernel(STIVALE2_STRUCT* strct, UINT64 Stack, void* KernelEntry, UINT64 Pml5);
 
 static EFI_STATUS LoadStivaleHeader(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FS, CHAR16* file, STIVALE2_HEADER* header, BOOLEAN* HigherHalf) {
     EFI_STATUS Status = EFI_SUCCESS;
-    EFI_FILE_PROTOCOL* root = NULL;
-    EFI_FILE_PROTOCOL* image = NULL;
+    KERNEL_IMAGE* image = NULL;
     CHAR8* names = NULL;
     CHECK(HigherHalf != NULL);
     *HigherHalf = FALSE;
 
     // open the executable file
-    Print(L"Loading image `%s`\n", file);
-    EFI_CHECK(FS->OpenVolume(FS, &root));
-    EFI_CHECK(root->Open(root, &image, file, EFI_FILE_MODE_READ, 0));
+    CHECK_AND_RETHROW(OpenKernelImage(FS, file, &image));
 
+    CHECK(image->HeadSize >= sizeof(Elf64_Ehdr));
     Elf64_Ehdr ehdr = {0};
-    CHECK_AND_RETHROW(FileRead(image, &ehdr, sizeof(ehdr), 0));
+    CopyMem(&ehdr, image->Head, sizeof(ehdr));
 
     // verify is an elf
     CHECK(IS_ELF(ehdr));
@@ -78,18 +122,25 @@ static EFI_STATUS LoadStivaleHeader(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FS, CHAR16*
         *HigherHalf = TRUE;
     }
 
+    // get all the section headers at once
+    UINT8* shdrs = NULL;
+    CHECK(ehdr.e_shentsize >= sizeof(Elf64_Shdr));
+    CHECK(ehdr.e_shstrndx < ehdr.e_shnum);
+    CHECK_AND_RETHROW(GetKernelImageSectionHeaders(image, ehdr.e_shoff, ehdr.e_shnum * ehdr.e_shentsize, (void**)&shdrs));
+
     // read the string table
     Elf64_Shdr shstr;
-    CHECK_AND_RETHROW(FileRead(image, &shstr, sizeof(Elf64_Shdr), ehdr.e_shoff + ehdr.e_shentsize * ehdr.e_shstrndx));
-    names = AllocatePool(shstr.sh_size);
-    CHECK_AND_RETHROW(FileRead(image, names, shstr.sh_size, shstr.sh_offset));
+    CopyMem(&shstr, shdrs + ehdr.e_shentsize * ehdr.e_shstrndx, sizeof(Elf64_Shdr));
+    names = AllocateZeroPool(shstr.sh_size + 1);
+    CHECK_ERROR(names != NULL, EFI_OUT_OF_RESOURCES);
+    CHECK_AND_RETHROW(KernelImageRead(image, names, shstr.sh_size, shstr.sh_offset));
 
     // search for the stivale section
     Elf64_Shdr shdr;
     BOOLEAN found = FALSE;
     for (int i = 0; i < ehdr.e_shnum; i++) {
-        CHECK_AND_RETHROW(FileRead(image, &shdr, sizeof(Elf64_Shdr), ehdr.e_shoff + ehdr.e_shentsize * i));
-        if (AsciiStrCmp(&names[shdr.sh_name], ".stivale2hdr") == 0) {
+        CopyMem(&shdr, shdrs + ehdr.e_shentsize * i, sizeof(Elf64_Shdr));
+        if (shdr.sh_name < shstr.sh_size && AsciiStrCmp(&names[shdr.sh_name], ".stivale2hdr") == 0) {
             found = TRUE;
             break;
         }
@@ -98,7 +149,7 @@ static EFI_STATUS LoadStivaleHeader(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* FS, CHAR16*
 
     // zero and read it
     CHECK(sizeof(*header) == shdr.sh_size);
-    CHECK_AND_RETHROW(FileRead(image, header, sizeof(*header), shdr.sh_offset));
+    CHECK_AND_RETHROW(KernelImageRead(image, header, sizeof(*header), shdr.sh_offset));
 
     // change the higher half spec if we have a
     // different entry point
@@ -111,14 +162,6 @@ cleanup:
         FreePool(names);
     }
 
-    if (root != NULL) {
-        FileHandleClose(root);
-    }
-
-    if (image != NULL) {
-        FileHandleClose(image);
-    }
-
     return Status;
 }
 
@@ -129,10 +172,39 @@ extern UINT8 gSmpTrampoline[];
 extern IA32_DESCRIPTOR gSmpTplGdt;
 extern UINT32 gSmpTplTargetMode;
 extern UINT32 gSmpTplPagemap;
-extern UINT32 gSmpTplBootedFlag;
-extern UINT64 gSmpTplInfoStruct;
+extern UINT64 gSmpTplCpus;
+extern UINT32 gSmpTplCpuCount;
+extern UINT32 gSmpTplMwait;
 extern UINT8 gSmpTrampolineEnd[];
 
+/**
+ * The slot of an ap in the trampoline, the aps find their slot by their apic id
+ * so they can all be started at once, the layout is used by the trampoline
+ */
+typedef struct _SMP_TPL_CPU {
+    UINT32 ApicId;
+    UINT32 Booted;
+    UINT64 Info;
+    UINT64 Stack;
+    UINT64 Wake;
+} SMP_TPL_CPU;
+STATIC_ASSERT(sizeof(SMP_TPL_CPU) == 32, "Smp trampoline slot layout mismatch");
+
+/**
+ * Nothing is pushed while the aps are parked and there is no idt, the
+ * stack is only there so they have a valid rsp of their own until the
+ * kernel gives them one
+ */
+#define SMP_TPL_STACK_SIZE 256
+
+/**
+ * Delays of the startup sequence, and how long we wait for the aps
+ * to come up before leaving them out of the smp tag (in microseconds)
+ */
+#define SMP_INIT_DELAY 10000
+#define SMP_SIPI_DELAY 200
+#define SMP_BOOT_TIMEOUT 100000
+
 /**
  * The gdt that will be used when booting
  * into the kernel
@@ -145,6 +217,7 @@ EFI_STATUS LoadStivale2Kernel(BOOT_ENTRY* Entry) {
     EFI_STATUS Status = EFI_SUCCESS;
     STIVALE2_HEADER Header = {0};
     ELF_INFO Elf = {0};
+    LOADED_MODULE* LoadedModules = NULL;
 
     // load config
     BOOT_CONFIG config;
@@ -171,10 +244,12 @@ EFI_STATUS LoadStivale2Kernel(BOOT_ENTRY* Entry) {
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
     // flags
+    PLACEMENT_POLICY ModulePlacement = Entry->Placement;
     BOOLEAN RequestedPml5 = FALSE;
     STIVALE2_HEADER_TAG_FRAMEBUFFER* FramebufferReq = NULL;
     BOOLEAN RequestedSmp = FALSE;
     BOOLEAN Requestedx2Apic = FALSE;
+    BOOLEAN RequestedPageBitmap = FALSE;
 
     // iterate the tags
     STIVALE2_HDR_TAG* Tag = Header.Tags > (void*)0xffffffff80000000 ? Header.Tags - 0xffffffff80000000 : Header.Tags;
@@ -188,28 +263,30 @@ EFI_STATUS LoadStivale2Kernel(BOOT_ENTRY* Entry) {
                 FramebufferReq = (STIVALE2_HEADER_TAG_FRAMEBUFFER*) Tag;
             } break;
 
+            case STIVALE2_HEADER_TAG_PLACEMENT_IDENT: {
+                // the config of the entry wins over the kernel, same rules as PLACEMENT_ALIGN
+                UINT64 Alignment = ((STIVALE2_HEADER_TAG_PLACEMENT*)Tag)->Alignment;
+                if (Alignment < EFI_PAGE_SIZE || Alignment > SIZE_1GB || (Alignment & (Alignment - 1)) != 0) {
+                    WARN("Invalid placement alignment %lx, must be a power of two between 4K and 1G", Alignment);
+                } else if (ModulePlacement.Alignment == 0) {
+                    ModulePlacement.Alignment = (UINTN)Alignment;
+                }
+            } break;
+
+            case STIVALE2_HEADER_TAG_PAGE_BITMAP_IDENT: {
+                RequestedPageBitmap = TRUE;
+            } break;
+
             case STIVALE2_HEADER_TAG_SMP_IDENT: {
-//                STIVALE2_HEADER_TAG_SMP* Smp = (STIVALE2_HEADER_TAG_SMP*)Tag;
-//                RequestedSmp = TRUE;
-//                Requestedx2Apic = Smp->Flags & STIVALE2_HEADER_TAG_SMP_FLAG_X2APIC;
+                STIVALE2_HEADER_TAG_SMP* Smp = (STIVALE2_HEADER_TAG_SMP*)Tag;
+                RequestedSmp = TRUE;
+                Requestedx2Apic = Smp->Flags & STIVALE2_HEADER_TAG_SMP_FLAG_X2APIC;
             } break;
         }
 
         Tag = Tag->Next > (void*)0xffffffff80000000 ? Tag->Next - 0xffffffff80000000 : Tag->Next;
     }
 
-    // check if pml5 is supported, if not turn of pml5
-    UINT32 eax = 0, ebx = 0, ecx = 0, edx = 0;
-    AsmCpuidEx(0x00000007, 0, &eax, &ebx, &ecx, &edx);
-    if (!(ecx & BIT16)) {
-        // at this point I have no idea tbh, this is just fucking weird
-        // that I even have to place this here, why in the name of heck
-        // does a code that has no threads needs memoryfence for things
-        // to not get fucked up, what in the name of hell really
-        MemoryFence();
-        RequestedPml5 = FALSE;
-    }
-
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Choose the graphics mode
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -225,17 +302,191 @@ EFI_STATUS LoadStivale2Kernel(BOOT_ENTRY* Entry) {
 
     // set graphics mode
     EFI_GRAPHICS_OUTPUT_PROTOCOL* gop = NULL;
+    UINTN Phase = TimelineBegin("gop set");
     ASSERT_EFI_ERROR(gBS->LocateProtocol(&gEfiGraphicsOutputProtocolGuid, NULL, (VOID**)&gop));
     ASSERT_EFI_ERROR(gop->SetMode(gop, (UINT32) GfxMode));
+    TimelineEnd(Phase);
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Load everything that the boot information references
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    // load the modules
+    UINTN ModuleCount = 0;
+    for (LIST_ENTRY* Link = Entry->BootModules.ForwardLink; Link != &Entry->BootModules; Link = Link->ForwardLink) {
+        ModuleCount++;
+    }
+
+    if (ModuleCount != 0) {
+        TRACE("Loading modules");
+        LoadedModules = AllocateZeroPool(sizeof(LOADED_MODULE) * ModuleCount);
+        CHECK_ERROR(LoadedModules != NULL, EFI_OUT_OF_RESOURCES);
+        CHECK_AND_RETHROW(LoadBootModules(Entry, &ModulePlacement, LoadedModules, ModuleCount));
+    }
+
+    // find the rsdp, the kernel gets a copy of it
+    void* AcpiTable = NULL;
+    UINTN RsdpSize = 0;
+    if (!EFI_ERROR(EfiGetSystemConfigurationTable(&gEfiAcpi20TableGuid, &AcpiTable))) {
+        RsdpSize = ((EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER*)AcpiTable)->Length;
+    } else if (!EFI_ERROR(EfiGetSystemConfigurationTable(&gEfiAcpi10TableGuid, &AcpiTable))) {
+        RsdpSize = sizeof(EFI_ACPI_1_0_ROOT_SYSTEM_DESCRIPTION_POINTER);
+    } else {
+        WARN("No ACPI table found");
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Prepare SMP
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    EFI_PHYSICAL_ADDRESS SmpTplBase = 0x100000;
+    EFI_ACPI_1_0_MULTIPLE_APIC_DESCRIPTION_TABLE_HEADER* Madt = NULL;
+    UINT8* MadtEntries = NULL;
+    UINTN CpuCount = 0;
+    SMP_TPL_CPU* SmpTplCpus = NULL;
+    UINT8* SmpTplStacks = NULL;
+    if (RequestedSmp) {
+        // allocate the smp trampoline address
+        EFI_CHECK_LABEL(gBS->AllocatePages(AllocateMaxAddress, EfiBootServicesCode, EFI_SIZE_TO_PAGES(gSmpTrampolineEnd - gSmpTrampoline), &SmpTplBase), invalid_cpu_info);
+        TRACE("Smp Trampoline at %p", SmpTplBase);
+
+        // move the idt to an address that can be accessed in pmode
+        EFI_PHYSICAL_ADDRESS NewGdt = BASE_4GB;
+        EFI_CHECK_LABEL(gBS->AllocatePages(AllocateMaxAddress, EfiBootServicesData, gGdtPtr.Limit + 1, &NewGdt), invalid_cpu_info);
+        CopyMem((void*)NewGdt, (void*)gGdtPtr.Base, gGdtPtr.Limit + 1);
+        gGdtPtr.Base = NewGdt;
+
+        // x2apic is only used if the kernel asked for it and the cpu has it
+        UINT32 VersionEcx = 0;
+        AsmCpuid(1, NULL, NULL, &VersionEcx, NULL);
+        WARN_ON(Requestedx2Apic && !(VersionEcx & BIT21), "x2APIC is not supported, using xAPIC");
+        Requestedx2Apic = Requestedx2Apic && (VersionEcx & BIT21) != 0;
+
+        // get the madt
+        Madt = GetAcpiTable(EFI_ACPI_1_0_APIC_SIGNATURE);
+        CHECK_ERROR_LABEL(Madt != NULL, EFI_NOT_FOUND, invalid_cpu_info);
+        MadtEntries = (UINT8*)(Madt + 1);
+
+        // the cpus with an apic id below 255 are in local apic entries even
+        // with x2apic, the x2apic entries only have the ones above that
+        for (
+            UINT8* MadtEntry = MadtEntries;
+            MadtEntry < MadtEntries + (Madt->Header.Length - sizeof(EFI_ACPI_1_0_MULTIPLE_APIC_DESCRIPTION_TABLE_HEADER));
+            MadtEntry = MadtEntry + MadtEntry[1]
+        ) {
+            switch (MadtEntry[0]) {
+                case EFI_ACPI_1_0_PROCESSOR_LOCAL_APIC: {
+                    CpuCount++;
+                } break;
+
+                case EFI_ACPI_4_0_PROCESSOR_LOCAL_X2APIC: {
+                    if (Requestedx2Apic) {
+                        CpuCount++;
+                    }
+                } break;
+            }
+        }
+
+        // the slots and the stacks of the aps, the trampoline
+        // reads them before the kernel tables are in use
+        PLACEMENT_REQUEST SmpRequest = { 0 };
+        EFI_PHYSICAL_ADDRESS SmpBase = 0;
+        GetBootInfoPlacement(Entry, (sizeof(SMP_TPL_CPU) + SMP_TPL_STACK_SIZE) * CpuCount, &SmpRequest);
+        CHECK_AND_RETHROW_LABEL(AllocatePlacedPages(&SmpRequest, &SmpBase), invalid_cpu_info);
+        SmpTplStacks = (UINT8*)SmpBase;
+        SmpTplCpus = (SMP_TPL_CPU*)(SmpTplStacks + SMP_TPL_STACK_SIZE * CpuCount);
+
+        // we got it, skip the failure
+        goto got_cpu_info;
+
+    invalid_cpu_info:
+        RequestedSmp = FALSE;
+
+    got_cpu_info:
+        (void)0;
+    }
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Build the page tables
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    // the tables are built before the boot information is measured, so the
+    // memory they take is already in the memory map we measure
+    Phase = TimelineBegin("page tables");
+    PAGE_TABLES PageTables = { 0 };
+    CHECK_AND_RETHROW(InitPageTables(&PageTables, RequestedPml5));
+    CHECK_AND_RETHROW(MapPhysicalMemory(&PageTables));
+    CHECK_AND_RETHROW(MapPhysicalRange(&PageTables, gop->Mode->FrameBufferBase, gop->Mode->FrameBufferSize));
+    CHECK_AND_RETHROW(MapKernelSegments(&PageTables, &Elf));
+    TimelineEnd(Phase);
+
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    // Measure the boot information
+    ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+    STIVALE2_INFO Info = { 0 };
+    Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT));
+    Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT_TAG_CMDLINE)) + STIVALE2_ITEM_SIZE(StrLen(Entry->Cmdline) + 1);
+    Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT_TAG_FRAMEBUFFER));
+    if (RsdpSize != 0) {
+        Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT_TAG_RSDP)) + STIVALE2_ITEM_SIZE(RsdpSize);
+    }
+    Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT_TAG_FIRMWARE));
+    Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT_TAG_EPOCH));
+    if (ModuleCount != 0) {
+        Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT_TAG_MODULES) + sizeof(STIVALE2_MODULE) * ModuleCount);
+    }
+    Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT_TAG_PLACEMENT) + sizeof(STIVALE2_PLACEMENT_ENTRY) * ModuleCount);
+    if (RequestedSmp) {
+        Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT_TAG_SMP) + sizeof(STIVALE2_SMP_INFO) * CpuCount);
+        Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT_TAG_SMP_PARK) + sizeof(STIVALE2_SMP_PARK_ENTRY) * CpuCount);
+    }
+    Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT_TAG_TIMELINE) + sizeof(STIVALE2_TIMELINE_ENTRY) * TIMELINE_MAX_ENTRIES);
+    Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT_TAG_TIMER_FREQUENCY));
+
+    // the page bitmap is too big for the boot information so it gets its own
+    // pages, it covers the memory that is free now and anything that becomes
+    // free above it later is only in the memory map
+    UINT64* PageBitmap = NULL;
+    UINT64 PageBitmapPages = 0;
+    if (RequestedPageBitmap) {
+        Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT_TAG_PAGE_BITMAP));
+
+        PLACEMENT_REQUEST BitmapRequest = { 0 };
+        EFI_PHYSICAL_ADDRESS BitmapBase = 0;
+        CHECK_AND_RETHROW(MeasurePageBitmap(&mStivale2MemoryTypes, STIVALE2_USEABLE, &PageBitmapPages));
+        GetBootInfoPlacement(Entry, ALIGN_VALUE(PageBitmapPages, 64) / 8, &BitmapRequest);
+        CHECK_AND_RETHROW(AllocatePlacedPages(&BitmapRequest, &BitmapBase));
+        PageBitmap = (UINT64*)BitmapBase;
+    }
+
+    // the memory map goes last and is measured for the worst case, the snapshot
+    // buffer is allocated right away so it is taken into account as well
+    UINTN MemoryMapSize = 0;
+    UINTN MaxEntries = 0;
+    CHECK_AND_RETHROW(MeasureMemoryMap(&MemoryMapSize, &MaxEntries));
+    MEMORY_MAP MemoryMap = { .Buffer = AllocatePool(MemoryMapSize), .BufferSize = MemoryMapSize };
+    CHECK_ERROR(MemoryMap.Buffer != NULL, EFI_OUT_OF_RESOURCES);
+    Info.Size += STIVALE2_ITEM_SIZE(sizeof(STIVALE2_STRUCT_TAG_MEMMAP) + sizeof(STIVALE2_MMAP_ENTRY) * MaxEntries);
+
+    // allocate it all at once, the kernel can reclaim it in one go
+    PLACEMENT_REQUEST InfoRequest = { 0 };
+    EFI_PHYSICAL_ADDRESS InfoBase = 0;
+    GetBootInfoPlacement(Entry, Info.Size, &InfoRequest);
+    CHECK_AND_RETHROW(AllocatePlacedPages(&InfoRequest, &InfoBase));
+    Info.Base = (UINT8*)InfoBase;
+    ZeroMem(Info.Base, Info.Size);
+    TRACE("Boot information at %p (%d bytes)", Info.Base, Info.Size);
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Setup the base struct
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
     // setup the struct
-    STIVALE2_STRUCT* Struct = AllocateZeroPool(sizeof(STIVALE2_STRUCT));
+    STIVALE2_STRUCT* Struct = EmitItem(&Info, sizeof(STIVALE2_STRUCT));
     AsciiStrnCpy(Struct->BootloaderBrand, "TomatBoot-UEFI", sizeof(Struct->BootloaderBrand));
     AsciiStrnCpy(Struct->BootloaderVersion, __GIT_REVISION__, sizeof(Struct->BootloaderVersion));
+    Info.Next = &Struct->Tags;
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Set the Command Line
@@ -243,11 +494,9 @@ EFI_STATUS LoadStivale2Kernel(BOOT_ENTRY* Entry) {
 
     // cmdline
     TRACE("Setting cmdline");
-    STIVALE2_STRUCT_TAG_CMDLINE* Cmdline = AllocateZeroPool(sizeof(STIVALE2_STRUCT_TAG_CMDLINE));
-    Cmdline->Identifier = STIVALE2_STRUCT_TAG_CMDLINE_IDENT;
-    Cmdline->Cmdline = AllocateReservedPool(StrLen(Entry->Cmdline) + 1);
+    STIVALE2_STRUCT_TAG_CMDLINE* Cmdline = EmitTag(&Info, STIVALE2_STRUCT_TAG_CMDLINE_IDENT, sizeof(STIVALE2_STRUCT_TAG_CMDLINE));
+    Cmdline->Cmdline = EmitItem(&Info, StrLen(Entry->Cmdline) + 1);
     UnicodeStrToAsciiStr(Entry->Cmdline, (CHAR8*)Cmdline->Cmdline);
-    Struct->Tags = Cmdline;
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Set the Framebuffer info
@@ -255,8 +504,7 @@ EFI_STATUS LoadStivale2Kernel(BOOT_ENTRY* Entry) {
 
     // graphics info
     TRACE("Setting framebuffer info");
-    STIVALE2_STRUCT_TAG_FRAMEBUFFER* Framebuffer = AllocateZeroPool(sizeof(STIVALE2_STRUCT_TAG_FRAMEBUFFER));
-    Framebuffer->Identifier = STIVALE2_STRUCT_TAG_FRAMEBUFFER_IDENT;
+    STIVALE2_STRUCT_TAG_FRAMEBUFFER* Framebuffer = EmitTag(&Info, STIVALE2_STRUCT_TAG_FRAMEBUFFER_IDENT, sizeof(STIVALE2_STRUCT_TAG_FRAMEBUFFER));
     Framebuffer->FramebufferAddr = gop->Mode->FrameBufferBase;
     Framebuffer->FramebufferWidth = gop->Mode->Info->HorizontalResolution;
     Framebuffer->FramebufferHeight = gop->Mode->Info->VerticalResolution;
@@ -269,30 +517,15 @@ EFI_STATUS LoadStivale2Kernel(BOOT_ENTRY* Entry) {
     Framebuffer->GreenMaskShift = 8;
     Framebuffer->BlueMaskSize = 8;
     Framebuffer->BlueMaskShift = 16;
-    Cmdline->Next = Framebuffer;
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Set the RSDP if found
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    // set the acpi table
-    void** Next = &Framebuffer->Next;
-    void* AcpiTable = NULL;
-    if (!EFI_ERROR(EfiGetSystemConfigurationTable(&gEfiAcpi20TableGuid, &AcpiTable))) {
-        STIVALE2_STRUCT_TAG_RSDP* Rsdp = AllocateZeroPool(sizeof(STIVALE2_STRUCT_TAG_RSDP));
-        EFI_ACPI_2_0_ROOT_SYSTEM_DESCRIPTION_POINTER* ActualRsdp = AcpiTable;
-        Rsdp->Identifier = STIVALE2_STRUCT_TAG_RSDP_IDENT;
-        Rsdp->Rsdp = AllocateReservedCopyPool(ActualRsdp->Length, ActualRsdp);
-        *Next = Rsdp;
-        Next = &Rsdp->Next;
-    } else if (!EFI_ERROR(EfiGetSystemConfigurationTable(&gEfiAcpi10TableGuid, &AcpiTable))) {
-        STIVALE2_STRUCT_TAG_RSDP* Rsdp = AllocateZeroPool(sizeof(STIVALE2_STRUCT_TAG_RSDP));
-        Rsdp->Identifier = STIVALE2_STRUCT_TAG_RSDP_IDENT;
-        Rsdp->Rsdp = AllocateReservedCopyPool(sizeof(EFI_ACPI_1_0_ROOT_SYSTEM_DESCRIPTION_POINTER), AcpiTable);
-        *Next = Rsdp;
-        Next = &Rsdp->Next;
-    } else {
-        WARN("No ACPI table found");
+    if (RsdpSize != 0) {
+        STIVALE2_STRUCT_TAG_RSDP* Rsdp = EmitTag(&Info, STIVALE2_STRUCT_TAG_RSDP_IDENT, sizeof(STIVALE2_STRUCT_TAG_RSDP));
+        Rsdp->Rsdp = EmitItem(&Info, RsdpSize);
+        CopyMem((void*)Rsdp->Rsdp, AcpiTable, RsdpSize);
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -300,115 +533,60 @@ EFI_STATUS LoadStivale2Kernel(BOOT_ENTRY* Entry) {
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
     TRACE("Setting firmware");
-    STIVALE2_STRUCT_TAG_FIRMWARE* Firmware = AllocateZeroPool(sizeof(STIVALE2_STRUCT_TAG_FIRMWARE));
-    Firmware->Identifier = STIVALE2_STRUCT_TAG_FIRMWARE_IDENT;
+    STIVALE2_STRUCT_TAG_FIRMWARE* Firmware = EmitTag(&Info, STIVALE2_STRUCT_TAG_FIRMWARE_IDENT, sizeof(STIVALE2_STRUCT_TAG_FIRMWARE));
     Firmware->Flags = 0;
-    *Next = Firmware;
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Process EPOCH timestamp
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
     TRACE("Setting epoch");
-    STIVALE2_STRUCT_TAG_EPOCH* Epoch = AllocateZeroPool(sizeof(STIVALE2_STRUCT_TAG_EPOCH));
-    Epoch->Identifier = STIVALE2_STRUCT_TAG_EPOCH_IDENT;
+    STIVALE2_STRUCT_TAG_EPOCH* Epoch = EmitTag(&Info, STIVALE2_STRUCT_TAG_EPOCH_IDENT, sizeof(STIVALE2_STRUCT_TAG_EPOCH));
     EFI_TIME Time = { 0 };
     EFI_CHECK(gRT->GetTime(&Time, NULL));
     Epoch->Epoch = GetUnixEpoch(Time.Second, Time.Minute, Time.Hour, Time.Day, Time.Month, Time.Year);
-    Firmware->Next = Epoch;
-    Next = &Epoch->Next;
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Process Modules
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    STIVALE2_STRUCT_TAG_MODULES* Modules = NULL;
-    if (!IsListEmpty(&Entry->BootModules)) {
-        TRACE("Loading modules");
-        UINTN ModulesCount = 0;
-        for (LIST_ENTRY* Link = GetFirstNode(&Entry->BootModules); Link != &Entry->BootModules; Link = Link->ForwardLink) {
-            ModulesCount++;
-        }
-
-        Modules = AllocateZeroPool(sizeof(STIVALE2_STRUCT_TAG_MODULES) + sizeof(STIVALE2_MODULE) * ModulesCount);
-        Modules->Identifier = STIVALE2_STRUCT_TAG_MODULES_IDENT;
-        Modules->ModuleCount = ModulesCount;
-        Epoch->Next = Modules;
-        Next = &Modules->Next;
+    if (ModuleCount != 0) {
+        TRACE("Pushing modules");
+        STIVALE2_STRUCT_TAG_MODULES* Modules = EmitTag(&Info, STIVALE2_STRUCT_TAG_MODULES_IDENT, sizeof(STIVALE2_STRUCT_TAG_MODULES) + sizeof(STIVALE2_MODULE) * ModuleCount);
+        Modules->ModuleCount = ModuleCount;
 
         UINTN Index = 0;
         for (LIST_ENTRY* Link = Entry->BootModules.ForwardLink; Link != &Entry->BootModules; Link = Link->ForwardLink, Index++) {
             BOOT_MODULE* Module = BASE_CR(Link, BOOT_MODULE, Link);
-            UINTN Start = 0;
-            UINTN Size = 0;
-            CHECK_AND_RETHROW(LoadBootModule(Module, &Start, &Size));
-
             STIVALE2_MODULE* NewModule = &Modules->Modules[Index];
-            NewModule->Begin = Start;
-            NewModule->End = Start + Size;
+            NewModule->Begin = LoadedModules[Index].Base;
+            NewModule->End = LoadedModules[Index].Base + LoadedModules[Index].Size;
             UnicodeStrToAsciiStrS(Module->Tag, NewModule->String, sizeof(NewModule->String));
-            TRACE("    Added %s (%s) -> %p - %p", Module->Tag, Module->Path, Start, Start + Size);
+            TRACE("    Added %s (%s) -> %p - %p", Module->Tag, Module->Path, NewModule->Begin, NewModule->End);
         }
     }
 
+    // tell the kernel how well everything is aligned, so it
+    // knows which ones it can map with large pages
+    STIVALE2_STRUCT_TAG_PLACEMENT* Placement = EmitTag(&Info, STIVALE2_STRUCT_TAG_PLACEMENT_IDENT, sizeof(STIVALE2_STRUCT_TAG_PLACEMENT) + sizeof(STIVALE2_PLACEMENT_ENTRY) * ModuleCount);
+    Placement->KernelAlignment = GetPlacementAlignment(Elf.PhysicalBase);
+    Placement->ModuleCount = ModuleCount;
+    for (UINTN Index = 0; Index < ModuleCount; Index++) {
+        Placement->Modules[Index].Alignment = LoadedModules[Index].Alignment;
+        Placement->Modules[Index].Domain = LoadedModules[Index].Domain == NUMA_NO_DOMAIN ? STIVALE2_PLACEMENT_NO_DOMAIN : LoadedModules[Index].Domain;
+    }
+
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Process SMP info
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    // push smp info
     STIVALE2_STRUCT_TAG_SMP* Smp = NULL;
-    EFI_PHYSICAL_ADDRESS SmpTplBase = 0x100000;
-    UINT8* MadtEntries = NULL;
+    STIVALE2_STRUCT_TAG_SMP_PARK* SmpPark = NULL;
     if (RequestedSmp) {
-        // allocate the smp trampoline address
-        EFI_CHECK_LABEL(gBS->AllocatePages(AllocateMaxAddress, EfiBootServicesCode, EFI_SIZE_TO_PAGES(gSmpTrampolineEnd - gSmpTrampoline), &SmpTplBase), invalid_cpu_info);
-        TRACE("Smp Trampoline at %p", SmpTplBase);
-
-        // move the idt to an address that can be accessed in pmode
-        EFI_PHYSICAL_ADDRESS NewGdt = BASE_4GB;
-        EFI_CHECK_LABEL(gBS->AllocatePages(AllocateMaxAddress, EfiBootServicesData, gGdtPtr.Limit + 1, &NewGdt), invalid_cpu_info);
-        CopyMem((void*)NewGdt, (void*)gGdtPtr.Base, gGdtPtr.Limit + 1);
-        gGdtPtr.Base = NewGdt;
-
-        // TODO: check if x2apic is supported and adjust Requestedx2Apic accordingly
-        Requestedx2Apic = FALSE;
-
-        // get the madt
-        EFI_ACPI_1_0_MULTIPLE_APIC_DESCRIPTION_TABLE_HEADER* Madt = GetAcpiTable(EFI_ACPI_1_0_APIC_SIGNATURE);
-        CHECK_ERROR_LABEL(Madt != NULL, EFI_NOT_FOUND, invalid_cpu_info);
-        MadtEntries = (UINT8*)(Madt + 1);
-
-        if (Requestedx2Apic && Madt->Header.Revision < EFI_ACPI_4_0_MULTIPLE_APIC_DESCRIPTION_TABLE_REVISION) {
-            WARN("MADT table does not support x2apic!");
-            Requestedx2Apic = FALSE;
-        }
-
-        UINTN CpuCount = 0;
-        for (
-            UINT8* MadtEntry = MadtEntries;
-            MadtEntry < MadtEntries + (Madt->Header.Length - sizeof(EFI_ACPI_1_0_MULTIPLE_APIC_DESCRIPTION_TABLE_HEADER));
-            MadtEntry = MadtEntry + MadtEntry[1]
-        ) {
-            switch (MadtEntry[0]) {
-                case EFI_ACPI_1_0_PROCESSOR_LOCAL_APIC: {
-                    if (!Requestedx2Apic) {
-                        CpuCount++;
-                    }
-                } break;
-
-                case EFI_ACPI_4_0_PROCESSOR_LOCAL_X2APIC: {
-                    if (Requestedx2Apic) {
-                        CpuCount++;
-                    }
-                } break;
-            }
-        }
-
-        // allocate the smp info tag
-        Smp = AllocateZeroPool(sizeof(STIVALE2_STRUCT_TAG_SMP) + sizeof(STIVALE2_SMP_INFO) * CpuCount);
-        Smp->Identifier = STIVALE2_STRUCT_TAG_SMP_IDENT;
+        Smp = EmitTag(&Info, STIVALE2_STRUCT_TAG_SMP_IDENT, sizeof(STIVALE2_STRUCT_TAG_SMP) + sizeof(STIVALE2_SMP_INFO) * CpuCount);
         Smp->CpuCount = 0;
-        Smp->Flags = GetApicMode() == Requestedx2Apic ? STIVALE2_HEADER_TAG_SMP_FLAG_X2APIC : 0;
+        Smp->Flags = Requestedx2Apic ? STIVALE2_HEADER_TAG_SMP_FLAG_X2APIC : 0;
+        UINTN SkippedCpus = 0;
 
         for (
                 UINT8* MadtEntry = MadtEntries;
@@ -417,111 +595,89 @@ EFI_STATUS LoadStivale2Kernel(BOOT_ENTRY* Entry) {
         ) {
             switch (MadtEntry[0]) {
                 case EFI_ACPI_1_0_PROCESSOR_LOCAL_APIC: {
-                    if (!Requestedx2Apic) {
-                        EFI_ACPI_1_0_PROCESSOR_LOCAL_APIC_STRUCTURE* Lapic = (void*)MadtEntry;
-
-                        // check if the cpu is enabled and if it can be enabled
-                        if (!(Lapic->Flags & EFI_ACPI_1_0_LOCAL_APIC_ENABLED)) {
-                            if (
-                                (Madt->Header.Revision < EFI_ACPI_6_3_MULTIPLE_APIC_DESCRIPTION_TABLE_REVISION) ||
-                                !(Lapic->Flags & EFI_ACPI_6_3_LOCAL_APIC_ONLINE_CAPABLE)
-                            ) {
-                                continue;
-                            }
-                        }
-                        Smp->SmpInfo[Smp->CpuCount].LapicId = Lapic->ApicId;
-                        Smp->SmpInfo[Smp->CpuCount].AcpiProcessorUid = Lapic->AcpiProcessorId;
-                        Smp->CpuCount++;
-                        TRACE("Cpu #%d", Lapic->ApicId);
+                    EFI_ACPI_1_0_PROCESSOR_LOCAL_APIC_STRUCTURE* Lapic = (void*)MadtEntry;
+
+                    // only the enabled cpus are started, the online capable
+                    // ones are left for the kernel to bring up
+                    if (!(Lapic->Flags & EFI_ACPI_1_0_LOCAL_APIC_ENABLED) || Lapic->ApicId == 0xFF) {
+                        continue;
                     }
+                    Smp->SmpInfo[Smp->CpuCount].LapicId = Lapic->ApicId;
+                    Smp->SmpInfo[Smp->CpuCount].AcpiProcessorUid = Lapic->AcpiProcessorId;
+                    Smp->CpuCount++;
+                    TRACE("Cpu #%d", Lapic->ApicId);
                 } break;
 
                 case EFI_ACPI_4_0_PROCESSOR_LOCAL_X2APIC: {
-                    if (Requestedx2Apic) {
-                        EFI_ACPI_4_0_PROCESSOR_LOCAL_X2APIC_STRUCTURE* Lapic = (void*)MadtEntry;
-                        Smp->SmpInfo[Smp->CpuCount].LapicId = Lapic->X2ApicId;
-                        Smp->SmpInfo[Smp->CpuCount].AcpiProcessorUid = Lapic->AcpiProcessorUid;
-                        Smp->CpuCount++;
-                        TRACE("Cpu #%d", Lapic->X2ApicId);
+                    EFI_ACPI_4_0_PROCESSOR_LOCAL_X2APIC_STRUCTURE* Lapic = (void*)MadtEntry;
+                    if (!(Lapic->Flags & EFI_ACPI_4_0_LOCAL_APIC_ENABLED)) {
+                        continue;
                     }
+
+                    // xapic can't send ipis to these
+                    if (!Requestedx2Apic) {
+                        SkippedCpus++;
+                        continue;
+                    }
+                    Smp->SmpInfo[Smp->CpuCount].LapicId = Lapic->X2ApicId;
+                    Smp->SmpInfo[Smp->CpuCount].AcpiProcessorUid = Lapic->AcpiProcessorUid;
+                    Smp->CpuCount++;
+                    TRACE("Cpu #%d", Lapic->X2ApicId);
                 } break;
             }
         }
-
-        // link it
-        *Next = Smp;
-        Next = &Smp->Next;
-
-        // we got it, skip the failure
-        goto got_cpu_info;
-
-    invalid_cpu_info:
-        if (Smp != NULL) {
-            FreePool(Smp);
-            Smp = NULL;
-        }
-
-    got_cpu_info:
-        (void)0;
+        WARN_ON(SkippedCpus != 0, "%d cpus can only be started with x2APIC", SkippedCpus);
+
+        // the aps sleep with monitor/mwait if the cpu has it, so
+        // they don't take from the bsp while the kernel starts
+        UINT32 VersionEcx = 0;
+        AsmCpuid(1, NULL, NULL, &VersionEcx, NULL);
+        SmpPark = EmitTag(&Info, STIVALE2_STRUCT_TAG_SMP_PARK_IDENT, sizeof(STIVALE2_STRUCT_TAG_SMP_PARK) + sizeof(STIVALE2_SMP_PARK_ENTRY) * CpuCount);
+        SmpPark->Flags = (VersionEcx & BIT3) ? STIVALE2_SMP_PARK_FLAG_MWAIT : 0;
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-    // Pre-process the page tables to get a nice higher half, for pml5 the rest of the
-    // pre-processing is done inside of the jump stub
+    // Push the boot timeline
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    // setup the page table correctly
-    // first disable write protection so we can modify the table
-    TRACE("Preparing higher half");
-    IA32_CR0 Cr0 = { .UintN = AsmReadCr0() };
-    Cr0.Bits.WP = 0;
-    AsmWriteCr0(Cr0.UintN);
-
-    // get the memory map
-    UINT64* Pml4 = (UINT64*)AsmReadCr3();
+    // the entries are only filled right before the jump so
+    // the exit from the boot services is included as well
+    STATIC_ASSERT(sizeof(STIVALE2_TIMELINE_ENTRY) == sizeof(TIMELINE_ENTRY), "Timeline entry layout mismatch");
+    STIVALE2_STRUCT_TAG_TIMELINE* Timeline = EmitTag(&Info, STIVALE2_STRUCT_TAG_TIMELINE_IDENT, sizeof(STIVALE2_STRUCT_TAG_TIMELINE) + sizeof(STIVALE2_TIMELINE_ENTRY) * TIMELINE_MAX_ENTRIES);
 
-    // take the first pml4 and copy it to 0xffff800000000000
-    Pml4[256] = Pml4[0];
+    // the timer frequencies, the lapic timer is measured while
+    // we finish up after exiting the boot services
+    STIVALE2_STRUCT_TAG_TIMER_FREQUENCY* TimerFrequency = EmitTag(&Info, STIVALE2_STRUCT_TAG_TIMER_FREQUENCY_IDENT, sizeof(STIVALE2_STRUCT_TAG_TIMER_FREQUENCY));
+    TimerFrequency->TscFrequency = GetTimerTscFrequency();
+    TimerFrequency->TscError = GetTimerTscError();
 
-    // allocate pml3 for 0xffffffff80000000
-    UINT64* Pml3High = AllocatePages(1);
-    SetMem(Pml3High, EFI_PAGE_SIZE, 0);
-    TRACE("Allocated page %p", Pml3High);
-    Pml4[511] = ((UINT64)Pml3High) | 0x3u;
+    // the page bitmap is only filled from the final memory map
+    STIVALE2_STRUCT_TAG_PAGE_BITMAP* PageBitmapTag = NULL;
+    if (RequestedPageBitmap) {
+        PageBitmapTag = EmitTag(&Info, STIVALE2_STRUCT_TAG_PAGE_BITMAP_IDENT, sizeof(STIVALE2_STRUCT_TAG_PAGE_BITMAP));
+        PageBitmapTag->Bitmap = (UINT64)PageBitmap;
+        PageBitmapTag->PageCount = PageBitmapPages;
+    }
 
-    // map first 2 pages to 0xffffffff80000000
-    UINT64* Pml3Low = (UINT64*)(Pml4[0] & 0x7ffffffffffff000u);
-    Pml3High[510] = Pml3Low[0];
-    Pml3High[511] = Pml3Low[1];
+    // we are done with the kernel file
+    CloseKernelImage();
 
     TRACE("Getting memory map");
 
+    // the APs have to go back to the firmware before we exit boot services
+    StopTaskRuntime();
+
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Get the memory map
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-    // setup the mmap information
-    UINT8 TmpMemoryMap[1];
-    UINTN MemoryMapSize = sizeof(TmpMemoryMap);
-    UINTN MapKey = 0;
-    UINTN DescriptorSize = 0;
-    UINT32 DescriptorVersion = 0;
-    CHECK(gBS->GetMemoryMap(&MemoryMapSize, (EFI_MEMORY_DESCRIPTOR *) TmpMemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion) == EFI_BUFFER_TOO_SMALL);
-
-    // allocate space for the efi mmap and take into
-    // account that there will be changes
-    MemoryMapSize += EFI_PAGE_SIZE;
-    EFI_MEMORY_DESCRIPTOR* MemoryMap = AllocatePool(MemoryMapSize);
-
-    // allocate all the space we will need (hopefully)
-    STIVALE2_STRUCT_TAG_MEMMAP* Memmap = AllocateZeroPool(sizeof(STIVALE2_STRUCT_TAG_MEMMAP) + (MemoryMapSize / DescriptorSize) * sizeof(STIVALE2_MMAP_ENTRY));
-    Memmap->Identifier = STIVALE2_STRUCT_TAG_MEMMAP_IDENT;
-    STIVALE2_MMAP_ENTRY* StartFrom = Memmap->Memmap;
-    *Next = Memmap;
+    Phase = TimelineBegin("memory map");
 
-    // call it
-    EFI_CHECK(gBS->GetMemoryMap(&MemoryMapSize, MemoryMap, &MapKey, &DescriptorSize, &DescriptorVersion));
-    UINTN EntryCount = (MemoryMapSize / DescriptorSize);
+    // the memory map tag was measured for the worst case, the entries
+    // are converted right into it once we are out of boot services
+    STIVALE2_STRUCT_TAG_MEMMAP* Memmap = EmitTag(&Info, STIVALE2_STRUCT_TAG_MEMMAP_IDENT, sizeof(STIVALE2_STRUCT_TAG_MEMMAP) + sizeof(STIVALE2_MMAP_ENTRY) * MaxEntries);
+    CHECK_AND_RETHROW(SnapshotMemoryMap(&MemoryMap));
+    TimelineEnd(Phase);
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Exit from boot services
@@ -529,19 +685,26 @@ EFI_STATUS LoadStivale2Kernel(BOOT_ENTRY* Entry) {
 
     // Exit the memory services, we put fences in here to make sure the compiler
     // won't try to mix boot services code and non-bootservices code
+    Phase = TimelineBegin("exit boot services");
     MemoryFence();
-    EFI_CHECK(gBS->ExitBootServices(gImageHandle, MapKey));
+    EFI_CHECK(gBS->ExitBootServices(gImageHandle, MemoryMap.MapKey));
     MemoryFence();
+    TimelineEnd(Phase);
 
     // no interrupts
     DisableInterrupts();
 
+    // switch to our own tables (5 level tables are switched to by the
+    // jump stub), the aps are started with them as well
+    ActivatePageTables(&PageTables);
+
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Do SMP startup if enabled
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
     // setup the local apic
     if (RequestedSmp) {
+        Phase = TimelineBegin("smp startup");
         InitializeLocalApicSoftwareEnable(TRUE);
         ProgramVirtualWireMode();
         if (Requestedx2Apic) {
@@ -553,12 +716,18 @@ EFI_STATUS LoadStivale2Kernel(BOOT_ENTRY* Entry) {
         // set the id of the bsp, we do this after setting to x2apic mode if enabled
         Smp->BspLapicId = GetApicId();
 
+        // the lapic timer is measured while the aps start, the mode is set by now
+        StartLapicTimerMeasurement();
+
         // set the global info
-        gSmpTplPagemap = AsmReadCr3();
+        gSmpTplPagemap = (UINT32)(UINTN)PageTables.Root;
         gSmpTplTargetMode = 0;
-        if (RequestedPml5) {
+        if (PageTables.Levels == 5) {
             gSmpTplTargetMode |= (1 << 1);
         }
+        if (PageTables.NoExecute) {
+            gSmpTplTargetMode |= (1 << 3);
+        }
         if (Requestedx2Apic) {
             gSmpTplTargetMode |= (1 << 2);
         }
@@ -569,34 +738,100 @@ EFI_STATUS LoadStivale2Kernel(BOOT_ENTRY* Entry) {
         MemoryFence();
 
         // calculate the physical addresses
-        _Atomic(UINT32)* SmpTplBootedFlag = (_Atomic(UINT32)*)((UINT8*)SmpTplBase + ((UINTN)&gSmpTplBootedFlag - (UINTN)gSmpTrampoline));
-        UINT64* SmpTplInfoStruct = (UINT64*)((UINT8*)SmpTplBase + ((UINTN)&gSmpTplInfoStruct - (UINTN)gSmpTrampoline));
+        UINT64* SmpTplCpusPtr = (UINT64*)((UINT8*)SmpTplBase + ((UINTN)&gSmpTplCpus - (UINTN)gSmpTrampoline));
+        UINT32* SmpTplCpuCount = (UINT32*)((UINT8*)SmpTplBase + ((UINTN)&gSmpTplCpuCount - (UINTN)gSmpTrampoline));
+        UINT32* SmpTplMwait = (UINT32*)((UINT8*)SmpTplBase + ((UINTN)&gSmpTplMwait - (UINTN)gSmpTrampoline));
         IA32_DESCRIPTOR* SmpTplGdt = (IA32_DESCRIPTOR*)((UINT8*)SmpTplBase + ((UINTN)&gSmpTplGdt - (UINTN)gSmpTrampoline));
 
         // set the descriptor
         *SmpTplGdt = gGdtPtr;
 
-        // now start all aps
-        for (int i = 0; i < Smp->CpuCount; i++) {
-            // don't send to bsp lol
+        // a slot for every ap, the info struct is only given
+        // once we know which of them made it
+        UINTN ApCount = 0;
+        for (UINTN i = 0; i < Smp->CpuCount; i++) {
             if (Smp->BspLapicId == Smp->SmpInfo[i].LapicId) {
                 continue;
             }
 
-            // set the params
-            *SmpTplBootedFlag = 0;
-            *SmpTplInfoStruct = (UINT64)&Smp->SmpInfo[i];
+            SMP_TPL_CPU* Cpu = &SmpTplCpus[ApCount++];
+            Cpu->ApicId = Smp->SmpInfo[i].LapicId;
+            Cpu->Booted = 0;
+            Cpu->Info = 0;
+            Cpu->Wake = 0;
+            Cpu->Stack = (UINT64)(SmpTplStacks + SMP_TPL_STACK_SIZE * ApCount);
+        }
+        *SmpTplCpusPtr = (UINT64)SmpTplCpus;
+        *SmpTplCpuCount = ApCount;
+        *SmpTplMwait = (SmpPark->Flags & STIVALE2_SMP_PARK_FLAG_MWAIT) ? 1 : 0;
+
+        // don't run this until the slots are set
+        MemoryFence();
+
+        // start all of them together, every ap gets its INIT and they all share a
+        // single delay, the second SIPI only goes to the ones the first one missed
+        volatile SMP_TPL_CPU* Cpus = SmpTplCpus;
+        for (UINTN i = 0; i < ApCount; i++) {
+            SendInitIpi(Cpus[i].ApicId);
+        }
+        MicroSecondDelay(SMP_INIT_DELAY);
+        for (UINTN i = 0; i < ApCount; i++) {
+            SendStartupIpi(Cpus[i].ApicId, SmpTplBase);
+        }
+        MicroSecondDelay(SMP_SIPI_DELAY);
+        for (UINTN i = 0; i < ApCount; i++) {
+            if (!Cpus[i].Booted) {
+                SendStartupIpi(Cpus[i].ApicId, SmpTplBase);
+            }
+        }
+
+        // wait for all of them to come up
+        for (UINTN Waited = 0; Waited < SMP_BOOT_TIMEOUT; Waited += SMP_SIPI_DELAY) {
+            UINTN Booted = 0;
+            for (UINTN i = 0; i < ApCount; i++) {
+                Booted += Cpus[i].Booted ? 1 : 0;
+            }
+            if (Booted == ApCount) {
+                break;
+            }
+            MicroSecondDelay(SMP_SIPI_DELAY);
+        }
+
+        // the aps that did not make it go back to waiting for a SIPI, otherwise
+        // they would keep running the trampoline on memory the kernel reuses,
+        // one that came up just now is sent back as well and left out
+        for (UINTN i = 0; i < ApCount; i++) {
+            if (!Cpus[i].Booted) {
+                SendInitIpi(Cpus[i].ApicId);
+                Cpus[i].Booted = 0;
+            }
+        }
 
-            // don't run this until the flags are set
-            MemoryFence();
-            SendInitSipiSipi(Smp->SmpInfo[i].LapicId, SmpTplBase);
+        // the aps that did not make it are left out of the tag, the rest get their info struct and park
+        UINTN Count = 0;
+        UINTN Slot = 0;
+        for (UINTN i = 0; i < Smp->CpuCount; i++) {
+            BOOLEAN IsBsp = Smp->BspLapicId == Smp->SmpInfo[i].LapicId;
+            volatile SMP_TPL_CPU* Cpu = IsBsp ? NULL : &Cpus[Slot++];
+            if (Cpu != NULL && !Cpu->Booted) {
+                continue;
+            }
 
-            // wait until it is done and we can get to
-            // the next one
-            while (*SmpTplBootedFlag == 0) {
-                CpuPause();
+            Smp->SmpInfo[Count] = Smp->SmpInfo[i];
+            SmpPark->Cpus[Count].LapicId = Smp->SmpInfo[Count].LapicId;
+            SmpPark->Cpus[Count].WakeTsc = 0;
+            if (Cpu != NULL) {
+                Cpu->Wake = (UINT64)&SmpPark->Cpus[Count].WakeTsc;
+                MemoryFence();
+                Cpu->Info = (UINT64)&Smp->SmpInfo[Count];
             }
+            Count++;
         }
+        Smp->CpuCount = Count;
+        SmpPark->CpuCount = Count;
+        TimelineEnd(Phase);
+    } else {
+        StartLapicTimerMeasurement();
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -604,50 +839,44 @@ EFI_STATUS LoadStivale2Kernel(BOOT_ENTRY* Entry) {
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
     // setup the normal memory map
-    Memmap->Entries = 0;
-    int LastType = -1;
-    UINTN LastEnd = 0xFFFFFFFFFFFF;
-    for (int i = 0; i < EntryCount; i++) {
-        EFI_MEMORY_DESCRIPTOR* Desc = (EFI_MEMORY_DESCRIPTOR*)((UINTN)MemoryMap + DescriptorSize * i);
-        EFI_PHYSICAL_ADDRESS PhysicalBase = Desc->PhysicalStart;
-        UINTN Length = EFI_PAGES_TO_SIZE(Desc->NumberOfPages);
-        EFI_PHYSICAL_ADDRESS PhysicalEnd = Desc->PhysicalStart + Length;
-
-        int Type = STIVALE2_RESERVED;
-        if (Desc->Type == gKernelAndModulesMemoryType) {
-            Type = STIVALE2_KERNEL_AND_MODULES;
-        } else if (Desc->Type < EfiMaxMemoryType) {
-            Type = EfiTypeToStivaleType[Desc->Type];
-        }
-
-        // check if we can merge
-        if (LastType == Type && LastEnd == Desc->PhysicalStart) {
-            StartFrom[-1].Length += Length;
-        } else {
-            StartFrom->Type = Type;
-            StartFrom->Length = Length;
-            StartFrom->Base = PhysicalBase;
-            StartFrom->Unused = 0;
-            LastType = Type;
-            StartFrom++;
-            Memmap->Entries++;
-        }
-        LastEnd = PhysicalEnd;
+    Phase = TimelineBegin("memory map convert");
+    STATIC_ASSERT(sizeof(STIVALE2_MMAP_ENTRY) == sizeof(MEMORY_MAP_ENTRY), "Memory map entry layout mismatch");
+    Memmap->Entries = ConvertMemoryMap(&MemoryMap, &mStivale2MemoryTypes, (MEMORY_MAP_ENTRY*)Memmap->Memmap);
+    TimelineEnd(Phase);
+
+    // and the free pages of it, if the kernel wants them
+    if (PageBitmapTag != NULL) {
+        Phase = TimelineBegin("page bitmap");
+        PageBitmapTag->FreePages = BuildPageBitmap((MEMORY_MAP_ENTRY*)Memmap->Memmap, Memmap->Entries, STIVALE2_USEABLE, PageBitmap, PageBitmapPages);
+        TimelineEnd(Phase);
     }
 
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     // Jump to kernel
     ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+    FinishLapicTimerMeasurement(&TimerFrequency->LapicTimerFrequency, &TimerFrequency->LapicTimerError);
+
+    // fill the timeline and report it
+    TIMELINE_ENTRY* TimelineEntries = NULL;
+    Timeline->TscFrequency = GetTscFrequency();
+    Timeline->EntryCount = GetTimelineEntries(&TimelineEntries);
+    CopyMem(Timeline->Entries, TimelineEntries, sizeof(TIMELINE_ENTRY) * Timeline->EntryCount);
+    DumpTimeline();
+
     // clear the screen before booting just to indicate we got to here
     SetMem32((void*)Framebuffer->FramebufferAddr,
              Framebuffer->FramebufferPitch * Framebuffer->FramebufferHeight,
              0x404000);
 
     // makes sure everything is done before here
-    JumpToStivale2Kernel(Struct, Header.Stack, (void*)Elf.Entry, RequestedPml5);
+    JumpToStivale2Kernel(Struct, Header.Stack, (void*)Elf.Entry, PageTables.Levels == 5 ? (UINT64)PageTables.Root : 0);
     UNREACHABLE();
 
 cleanup:
+    if (LoadedModules != NULL) {
+        FreePool(LoadedModules);
+    }
+
     return Status;
 }
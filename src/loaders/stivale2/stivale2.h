@@ -145,6 +145,115 @@ typedef struct _STIVALE2_STRUCT_TAG_SMP {
     STIVALE2_SMP_INFO SmpInfo[];
 } STIVALE2_STRUCT_TAG_SMP;
 
+/**
+ * TomatBoot specific, how long each phase of the boot took, the
+ * times are raw TSC values
+ */
+typedef struct _STIVALE2_TIMELINE_ENTRY {
+    CHAR8 Name[24];
+    UINT64 Start;
+    UINT64 End;
+} STIVALE2_TIMELINE_ENTRY;
+
+#define STIVALE2_STRUCT_TAG_TIMELINE_IDENT 0x8d3b5e1f2c7a9046
+typedef struct _STIVALE2_STRUCT_TAG_TIMELINE {
+    UINT64 Identifier;
+    void* Next;
+    UINT64 TscFrequency;
+    UINT64 EntryCount;
+    STIVALE2_TIMELINE_ENTRY Entries[];
+} STIVALE2_STRUCT_TAG_TIMELINE;
+
+/**
+ * TomatBoot specific, asks for the modules to be placed with the given
+ * alignment (a power of two up to 1GB) so they can be mapped with large pages
+ */
+#define STIVALE2_HEADER_TAG_PLACEMENT_IDENT 0x6a2f5c8e41d7b390
+typedef struct _STIVALE2_HEADER_TAG_PLACEMENT {
+    UINT64 Identifier;
+    void* Next;
+    UINT64 Alignment;
+} STIVALE2_HEADER_TAG_PLACEMENT;
+
+/**
+ * TomatBoot specific, the alignment the kernel and the modules actually
+ * got and the NUMA proximity domain of every module (all ones if it is
+ * not known), the modules are in the same order as in the modules tag
+ */
+#define STIVALE2_PLACEMENT_NO_DOMAIN 0xffffffffffffffff
+typedef struct _STIVALE2_PLACEMENT_ENTRY {
+    UINT64 Alignment;
+    UINT64 Domain;
+} STIVALE2_PLACEMENT_ENTRY;
+
+#define STIVALE2_STRUCT_TAG_PLACEMENT_IDENT 0x6a2f5c8e41d7b391
+typedef struct _STIVALE2_STRUCT_TAG_PLACEMENT {
+    UINT64 Identifier;
+    void* Next;
+    UINT64 KernelAlignment;
+    UINT64 ModuleCount;
+    STIVALE2_PLACEMENT_ENTRY Modules[];
+} STIVALE2_STRUCT_TAG_PLACEMENT;
+
+/**
+ * TomatBoot specific, asks for a bitmap of the free pages so the
+ * kernel has a page allocator right away
+ */
+#define STIVALE2_HEADER_TAG_PAGE_BITMAP_IDENT 0x4c1e7a93d05b2f68
+typedef struct _STIVALE2_HEADER_TAG_PAGE_BITMAP {
+    UINT64 Identifier;
+    void* Next;
+} STIVALE2_HEADER_TAG_PAGE_BITMAP;
+
+/**
+ * TomatBoot specific, a bit for every page from address zero that is set if the
+ * page is usable memory, built from the final memory map. The bitmap itself is
+ * bootloader reclaimable memory
+ */
+#define STIVALE2_STRUCT_TAG_PAGE_BITMAP_IDENT 0x4c1e7a93d05b2f69
+typedef struct _STIVALE2_STRUCT_TAG_PAGE_BITMAP {
+    UINT64 Identifier;
+    void* Next;
+    UINT64 Bitmap;
+    UINT64 PageCount;
+    UINT64 FreePages;
+} STIVALE2_STRUCT_TAG_PAGE_BITMAP;
+
+/**
+ * TomatBoot specific, how the aps wait for their goto address and the tsc value at
+ * which each of them saw it was set (zero until then), in the same order as the smp
+ * tag. The kernel gets the wake up latency by comparing it with when it wrote it
+ */
+#define STIVALE2_SMP_PARK_FLAG_MWAIT BIT0
+typedef struct _STIVALE2_SMP_PARK_ENTRY {
+    UINT64 LapicId;
+    UINT64 WakeTsc;
+} STIVALE2_SMP_PARK_ENTRY;
+
+#define STIVALE2_STRUCT_TAG_SMP_PARK_IDENT 0x3e8f1a6c7d20b594
+typedef struct _STIVALE2_STRUCT_TAG_SMP_PARK {
+    UINT64 Identifier;
+    void* Next;
+    UINT64 Flags;
+    UINT64 CpuCount;
+    STIVALE2_SMP_PARK_ENTRY Cpus[];
+} STIVALE2_STRUCT_TAG_SMP_PARK;
+
+/**
+ * TomatBoot specific, the frequencies of the TSC and of the lapic timer with a
+ * divider of 1, and how far off each of them can be, all in Hz. A frequency of
+ * zero was not measured
+ */
+#define STIVALE2_STRUCT_TAG_TIMER_FREQUENCY_IDENT 0x1c7e5a3b9d2f4086
+typedef struct _STIVALE2_STRUCT_TAG_TIMER_FREQUENCY {
+    UINT64 Identifier;
+    void* Next;
+    UINT64 TscFrequency;
+    UINT64 TscError;
+    UINT64 LapicTimerFrequency;
+    UINT64 LapicTimerError;
+} STIVALE2_STRUCT_TAG_TIMER_FREQUENCY;
+
 #pragma pack()
 
 #endif //__LOADERS_STIVALE_STIVALE_H__
@@ -11,7 +11,9 @@
 #include <menus/Menus.h>
 #include <uefi/AcpiTimerLib.h>
 #include <loaders/elf/ElfLoader.h>
+#include <loaders/Loaders.h>
 #include <Library/TimerLib.h>
+#include <util/Timeline.h>
 
 // define all constructors
 extern EFI_STATUS EFIAPI UefiBootServicesTableLibConstructor(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE* SystemTable);
@@ -24,6 +26,9 @@ extern EFI_STATUS EFIAPI UefiRuntimeServicesTableLibConstructor (IN EFI_HANDLE I
 EFI_STATUS EFIAPI EfiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *SystemTable) {
     EFI_STATUS Status = EFI_SUCCESS;
 
+    // everything on the timeline is relative to this
+    StartTimeline();
+
     // Call constructors
     EFI_CHECK(DxeDebugLibConstructor(ImageHandle, SystemTable));
     EFI_CHECK(UefiBootServicesTableLibConstructor(ImageHandle, SystemTable));
@@ -36,6 +41,7 @@ EFI_STATUS EFIAPI EfiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *System
 
     // run our own constructors
     CHECK_AND_RETHROW(AcpiTimerLibConstructor());
+    CalibrateTimeline();
 
     // disable the watchdog timer
     EFI_CHECK(gST->BootServices->SetWatchdogTimer(0, 0, 0, NULL));
@@ -54,6 +60,7 @@ EFI_STATUS EFIAPI EfiMain(IN EFI_HANDLE ImageHandle, IN EFI_SYSTEM_TABLE *System
     ) {
         TRACE("Need workaround for memory type :(");
         gKernelAndModulesMemoryType = EfiMemoryMappedIOPortSpace;
+        gBootInfoMemoryType = EfiLoaderData;
     }
 
     // Load the boot configs and set the default one
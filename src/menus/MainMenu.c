@@ -15,6 +15,7 @@
 #include <Library/DevicePathLib.h>
 #include <Library/MemoryAllocationLib.h>
 #include <loaders/Loaders.h>
+#include <loaders/Prefetch.h>
 
 // 14x13 (28x13)
 #define G EFI_GREEN
@@ -127,12 +128,32 @@ MENU EnterMainMenu(BOOLEAN first) {
     EFI_EVENT events[2] = { gST->ConIn->WaitForKey };
     ASSERT_EFI_ERROR(gBS->CreateEvent(EVT_TIMER, TPL_CALLBACK, NULL, NULL, &events[1]));
 
+    BOOT_ENTRY* default_entry = gBootConfigOverride.DefaultOS > 0 ? GetBootEntryAt(gBootConfigOverride.DefaultOS) : gDefaultEntry;
+    BOOLEAN prefetching = FALSE;
     if(first && !IsListEmpty(&gBootEntries)) {
         ASSERT_EFI_ERROR(gBS->SetTimer(events[1], TimerRelative, TIMER_INTERVAL));
+
+        // start reading the entry we are going to boot while counting down
+        StartPrefetch(default_entry);
+        prefetching = TRUE;
     }
 
     UINTN count = 2;
     do {
+        // use the time until the next tick or key press to read the default
+        // entry, if the timer fired while reading signal it again so the wait
+        // below sees it
+        while(prefetching && count == 2) {
+            if(gBS->CheckEvent(events[0]) == EFI_SUCCESS) {
+                break;
+            }
+            if(gBS->CheckEvent(events[1]) == EFI_SUCCESS) {
+                ASSERT_EFI_ERROR(gBS->SignalEvent(events[1]));
+                break;
+            }
+            prefetching = PrefetchStep();
+        }
+
         // get key press
         UINTN which = 0;
         EFI_INPUT_KEY key = {};
@@ -180,7 +201,7 @@ MENU EnterMainMenu(BOOLEAN first) {
                 ASSERT_EFI_ERROR(gBS->CloseEvent(events[1]));
 
                 // call the loader
-                LoadKernel(gBootConfigOverride.DefaultOS > 0 ? GetBootEntryAt(gBootConfigOverride.DefaultOS) : gDefaultEntry);
+                LoadKernel(default_entry);
             } else {
                 // set bar color
                 ASSERT_EFI_ERROR(gST->ConOut->SetAttribute(gST->ConOut, EFI_TEXT_ATTR(EFI_BLACK, EFI_LIGHTGRAY)));
@@ -1,26 +1,228 @@
 
 #include <ProcessorBind.h>
 #include <Uefi.h>
+#include <IndustryStandard/Acpi.h>
 #include <util/AcpiUtils.h>
 #include <util/Except.h>
 #include <Library/IoLib.h>
+#include <Library/BaseLib.h>
+#include <Library/LocalApicLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+/**
+ * How long the TSC is calibrated for, about 10ms
+ */
+#define CALIBRATION_MICROSECONDS 10000
+#define CALIBRATION_TICKS (ACPI_TIMER_FREQUENCY / 100)
+
+/**
+ * The lapic timer is measured for at least this long (in microseconds), it is
+ * masked so the vector is never used but it still has to be a valid one
+ */
+#define LAPIC_MEASURE_MICROSECONDS 1000
+#define LAPIC_MEASURE_VECTOR 0x20
 
 static UINT32 mAcpiTimerIoAddr = 0;
 
+/**
+ * The delays and the performance counter use the TSC if it is invariant (or if there is
+ * no PM timer to use instead), the frequency is measured once in the constructor
+ */
+static BOOLEAN mUseTsc = FALSE;
+static UINT64 mTscFrequency = 0;
+static UINT64 mTscError = 0;
+
+/**
+ * The lapic timer runs from the crystal clock if cpuid enumerates it,
+ * otherwise it is measured against the TSC after exiting boot services
+ */
+static UINT64 mCrystalFrequency = 0;
+static UINT64 mLapicStartTsc = 0;
+
+/**
+ * Get the port of the PM timer, prefers the extended block of newer FADTs and
+ * returns 0 if there is no PM timer (no FADT or a HW-reduced ACPI platform)
+ */
+static UINT32 GetPmTimerPort() {
+    EFI_ACPI_5_0_FIXED_ACPI_DESCRIPTION_TABLE* Facp = GetAcpiTable(EFI_ACPI_1_0_FIXED_ACPI_DESCRIPTION_TABLE_SIGNATURE);
+    if (Facp == NULL) {
+        return 0;
+    }
+
+    // the flags are there since the first revision, the hw-reduced one only since acpi 5
+    if (Facp->Header.Length >= OFFSET_OF(EFI_ACPI_5_0_FIXED_ACPI_DESCRIPTION_TABLE, ResetReg) &&
+        (Facp->Flags & EFI_ACPI_5_0_HW_REDUCED_ACPI)) {
+        return 0;
+    }
+
+    if (Facp->Header.Length >= OFFSET_OF(EFI_ACPI_5_0_FIXED_ACPI_DESCRIPTION_TABLE, XGpe0Blk) &&
+        Facp->XPmTmrBlk.AddressSpaceId == EFI_ACPI_5_0_SYSTEM_IO &&
+        Facp->XPmTmrBlk.Address != 0 && Facp->XPmTmrBlk.Address <= MAX_UINT16) {
+        return (UINT32)Facp->XPmTmrBlk.Address;
+    }
+
+    return Facp->PmTmrBlk;
+}
+
+/**
+ * The TSC frequency from the cpuid leaves, 0 if the cpu does not report it
+ */
+static UINT64 GetCpuidTscFrequency(UINT64* Error) {
+    UINT32 MaxBasic = 0;
+    AsmCpuid(0, &MaxBasic, NULL, NULL, NULL);
+    if (MaxBasic < 0x15) {
+        return 0;
+    }
+
+    // the ratio of the TSC to the crystal clock
+    UINT32 Denominator = 0;
+    UINT32 Numerator = 0;
+    UINT32 CrystalHz = 0;
+    AsmCpuid(0x15, &Denominator, &Numerator, &CrystalHz, NULL);
+    if (Denominator == 0 || Numerator == 0) {
+        return 0;
+    }
+
+    if (CrystalHz != 0) {
+        mCrystalFrequency = CrystalHz;
+        *Error = 0;
+        return DivU64x32(MultU64x32(CrystalHz, Numerator), Denominator);
+    }
+
+    // the crystal is not enumerated, but then the TSC runs at the base
+    // frequency, which is only given in MHz
+    if (MaxBasic >= 0x16) {
+        UINT32 BaseMhz = 0;
+        AsmCpuid(0x16, &BaseMhz, NULL, NULL, NULL);
+        *Error = 1000000;
+        return MultU64x32(BaseMhz & 0xFFFF, 1000000);
+    }
+
+    return 0;
+}
+
+/**
+ * Measure the TSC against the PM timer, the pm timer is only 24bit
+ * so everything is masked to handle the wrap around
+ */
+static UINT64 CalibrateTscWithPmTimer(UINT64* Error) {
+    UINT32 PmStart = IoRead32(mAcpiTimerIoAddr);
+    UINT64 TscStart = AsmReadTsc();
+    UINT32 PmTicks = 0;
+    do {
+        CpuPause();
+        PmTicks = (IoRead32(mAcpiTimerIoAddr) - PmStart) & (BIT24 - 1);
+    } while (PmTicks < CALIBRATION_TICKS);
+    UINT64 TscTicks = AsmReadTsc() - TscStart;
+
+    // off by up to a pm timer tick at each end
+    UINT64 Frequency = DivU64x32(MultU64x32(TscTicks, ACPI_TIMER_FREQUENCY), PmTicks);
+    *Error = DivU64x32(Frequency, PmTicks) * 2 + 1;
+    return Frequency;
+}
+
+/**
+ * Measure the TSC against the stall of the firmware, for when there is no PM timer
+ */
+static UINT64 CalibrateTscWithStall(UINT64* Error) {
+    UINT64 TscStart = AsmReadTsc();
+    gBS->Stall(CALIBRATION_MICROSECONDS);
+    UINT64 TscTicks = AsmReadTsc() - TscStart;
+
+    // the stall is only promised to be at least as long as asked for, so
+    // there is no real bound, give a generous one
+    UINT64 Frequency = DivU64x32(MultU64x32(TscTicks, 1000000), CALIBRATION_MICROSECONDS);
+    *Error = DivU64x32(Frequency, 100);
+    return Frequency;
+}
+
 EFI_STATUS AcpiTimerLibConstructor() {
     EFI_STATUS Status = EFI_SUCCESS;
 
-    EFI_ACPI_1_0_FIXED_ACPI_DESCRIPTION_TABLE* Facp = GetAcpiTable(EFI_ACPI_1_0_FIXED_ACPI_DESCRIPTION_TABLE_SIGNATURE);
-    // TODO: support newer revision
-    // TODO: support booting without this maybe?
-    CHECK(Facp != NULL);
+    mAcpiTimerIoAddr = GetPmTimerPort();
 
-    mAcpiTimerIoAddr = Facp->PmTmrBlk;
+    // the cpu knows best, then the pm timer and the firmware as a last resort
+    mTscFrequency = GetCpuidTscFrequency(&mTscError);
+    if (mTscFrequency == 0 && mAcpiTimerIoAddr != 0) {
+        mTscFrequency = CalibrateTscWithPmTimer(&mTscError);
+    }
+    if (mTscFrequency == 0) {
+        mTscFrequency = CalibrateTscWithStall(&mTscError);
+    }
+    CHECK(mTscFrequency != 0);
+
+    // the TSC only keeps its frequency across power states if it is invariant
+    UINT32 MaxExtended = 0;
+    UINT32 Edx = 0;
+    AsmCpuid(0x80000000, &MaxExtended, NULL, NULL, NULL);
+    if (MaxExtended >= 0x80000007) {
+        AsmCpuid(0x80000007, NULL, NULL, NULL, &Edx);
+    }
+    mUseTsc = (Edx & BIT8) != 0 || mAcpiTimerIoAddr == 0;
+    WARN_ON(!(Edx & BIT8) && mAcpiTimerIoAddr == 0, "No invariant TSC and no PM timer, delays may be inaccurate");
 
 cleanup:
     return Status;
 }
 
+UINT64 GetTimerTscFrequency() {
+    return mTscFrequency;
+}
+
+UINT64 GetTimerTscError() {
+    return mTscError;
+}
+
+void StartLapicTimerMeasurement() {
+    if (mCrystalFrequency != 0) {
+        return;
+    }
+
+    // count down from the top with no divider, the interrupt is masked
+    // right away and it would take seconds to fire anyways
+    InitializeApicTimer(1, MAX_UINT32, FALSE, LAPIC_MEASURE_VECTOR);
+    DisableApicTimerInterrupt();
+    mLapicStartTsc = AsmReadTsc();
+}
+
+void FinishLapicTimerMeasurement(UINT64* Frequency, UINT64* Error) {
+    *Frequency = 0;
+    *Error = 0;
+
+    if (mCrystalFrequency != 0) {
+        *Frequency = mCrystalFrequency;
+        return;
+    }
+
+    // never started, or the timer was reset since then
+    if (mLapicStartTsc == 0 || GetApicTimerInitCount() != MAX_UINT32) {
+        return;
+    }
+
+    // most of the time the boot work in between took longer than this already
+    UINT64 MinTicks = DivU64x32(MultU64x32(mTscFrequency, LAPIC_MEASURE_MICROSECONDS), 1000000);
+    while (AsmReadTsc() - mLapicStartTsc < MinTicks) {
+        CpuPause();
+    }
+    UINT32 Current = GetApicTimerCurrentCount();
+    UINT64 TscTicks = AsmReadTsc() - mLapicStartTsc;
+    if (Current == 0) {
+        return;
+    }
+
+    // the measurement is milliseconds long, so the lapic ticks
+    // times the TSC frequency can't overflow
+    UINT64 LapicTicks = MAX_UINT32 - Current;
+    if (LapicTicks == 0) {
+        return;
+    }
+    *Frequency = DivU64x64Remainder(MultU64x64(LapicTicks, mTscFrequency), TscTicks, NULL);
+
+    // off by a tick at each end, and by as much as the TSC it is measured against
+    *Error = DivU64x64Remainder(*Frequency, LapicTicks, NULL) * 2 + 1;
+    *Error += DivU64x64Remainder(MultU64x64(*Frequency, mTscError), mTscFrequency, NULL);
+}
+
 /**
   Internal function to read the current tick counter of ACPI.
   Read the current ACPI tick counter using the counter address cached
@@ -72,6 +274,17 @@ InternalAcpiDelay (
     } while (Times-- > 0);
 }
 
+/**
+  Stalls the CPU for at least the given number of TSC ticks.
+  @param  Delay     A period of time to delay in ticks.
+**/
+static VOID InternalTscDelay(UINT64 Delay) {
+    UINT64 Start = AsmReadTsc();
+    while (AsmReadTsc() - Start < Delay) {
+        CpuPause();
+    }
+}
+
 /**
   Stalls the CPU for at least the given number of microseconds.
   Stalls the CPU for the number of microseconds specified by MicroSeconds.
@@ -84,6 +297,11 @@ MicroSecondDelay (
         IN      UINTN                     MicroSeconds
 )
 {
+    if (mUseTsc) {
+        InternalTscDelay(DivU64x32(MultU64x64(MicroSeconds, mTscFrequency), 1000000u));
+        return MicroSeconds;
+    }
+
     InternalAcpiDelay (
             (UINT32)DivU64x32 (
                     MultU64x32 (
@@ -108,6 +326,11 @@ NanoSecondDelay (
         IN      UINTN                     NanoSeconds
 )
 {
+    if (mUseTsc) {
+        InternalTscDelay(DivU64x32(MultU64x64(NanoSeconds, mTscFrequency), 1000000000u));
+        return NanoSeconds;
+    }
+
     InternalAcpiDelay (
             (UINT32)DivU64x32 (
                     MultU64x32 (
@@ -135,6 +358,10 @@ GetPerformanceCounter (
         VOID
 )
 {
+    if (mUseTsc) {
+        return AsmReadTsc();
+    }
+
     return (UINT64)InternalAcpiGetTimerTick ();
 }
 
@@ -169,10 +396,10 @@ GetPerformanceCounterProperties (
     }
 
     if (EndValue != NULL) {
-        *EndValue = ACPI_TIMER_COUNT_SIZE - 1;
+        *EndValue = mUseTsc ? MAX_UINT64 : ACPI_TIMER_COUNT_SIZE - 1;
     }
 
-    return ACPI_TIMER_FREQUENCY;
+    return mUseTsc ? mTscFrequency : ACPI_TIMER_FREQUENCY;
 }
 
 /**
@@ -188,21 +415,24 @@ GetTimeInNanoSecond (
         IN      UINT64                     Ticks
 )
 {
+    UINT64  Frequency;
     UINT64  NanoSeconds;
-    UINT32  Remainder;
+    UINT64  Remainder;
+
+    Frequency = GetPerformanceCounterProperties (NULL, NULL);
 
     //
     //          Ticks
     // Time = --------- x 1,000,000,000
     //        Frequency
     //
-    NanoSeconds = MultU64x32 (DivU64x32Remainder (Ticks, ACPI_TIMER_FREQUENCY, &Remainder), 1000000000u);
+    NanoSeconds = MultU64x32 (DivU64x64Remainder (Ticks, Frequency, &Remainder), 1000000000u);
 
     //
-    // Frequency < 0x100000000, so Remainder < 0x100000000, then (Remainder * 1,000,000,000)
+    // The TSC frequency is well below 2^34, so Remainder * 1,000,000,000
     // will not overflow 64-bit.
     //
-    NanoSeconds += DivU64x32 (MultU64x32 ((UINT64) Remainder, 1000000000u), ACPI_TIMER_FREQUENCY);
+    NanoSeconds += DivU64x64Remainder (MultU64x32 (Remainder, 1000000000u), Frequency, NULL);
 
     return NanoSeconds;
 }
@@ -1,6 +1,36 @@
 #ifndef TOMATOS_ACPITIMERLIB_H
 #define TOMATOS_ACPITIMERLIB_H
 
+#include <Uefi.h>
+
+/**
+ * Find the PM timer (if the platform has one) and get the TSC frequency, from
+ * cpuid or calibrated once. The delays use the TSC when it is invariant
+ */
 EFI_STATUS AcpiTimerLibConstructor();
 
+/**
+ * The TSC frequency in Hz found by the constructor
+ */
+UINT64 GetTimerTscFrequency();
+
+/**
+ * How far off the TSC frequency can be in Hz, 0 if it came straight from cpuid
+ */
+UINT64 GetTimerTscError();
+
+/**
+ * Start counting down the lapic timer so its frequency is measured while the rest
+ * of the boot goes on. Only call after ExitBootServices, the firmware may be using
+ * the timer, and after the apic mode is set since going back to xapic resets it
+ */
+void StartLapicTimerMeasurement();
+
+/**
+ * The frequency of the lapic timer with a divider of 1 and how far off it can be,
+ * both in Hz, the frequency is 0 if it could not be measured. Waits if the timer
+ * did not run long enough for a good measurement yet
+ */
+void FinishLapicTimerMeasurement(UINT64* Frequency, UINT64* Error);
+
 #endif //TOMATOS_ACPITIMERLIB_H
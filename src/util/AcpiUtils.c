@@ -1,5 +1,7 @@
 #include <Uefi.h>
 #include <Guid/Acpi.h>
+#include <IndustryStandard/Acpi.h>
+#include <Library/MemoryAllocationLib.h>
 #include "AcpiUtils.h"
 #include "Except.h"
 
@@ -24,7 +26,7 @@ void* GetAcpiTable(UINT32 Signature) {
             Count = (Xsdt->Length - sizeof(EFI_ACPI_DESCRIPTION_HEADER)) / sizeof(UINT64);
         } else if (Rsdp->RsdtAddress != 0) {
             EFI_ACPI_DESCRIPTION_HEADER* Rsdt = (EFI_ACPI_DESCRIPTION_HEADER*)(UINTN)Rsdp->RsdtAddress;
-            Entries64 = (UINT64*)(Rsdt + 1);
+            Entries32 = (UINT32*)(Rsdt + 1);
             Count = (Rsdt->Length - sizeof(EFI_ACPI_DESCRIPTION_HEADER)) / sizeof(UINT32);
         } else {
             return NULL;
@@ -33,7 +35,7 @@ void* GetAcpiTable(UINT32 Signature) {
         EFI_ACPI_1_0_ROOT_SYSTEM_DESCRIPTION_POINTER* Rsdp = AcpiTable;
         if (Rsdp->RsdtAddress != 0) {
             EFI_ACPI_DESCRIPTION_HEADER* Rsdt = (EFI_ACPI_DESCRIPTION_HEADER*)(UINTN)Rsdp->RsdtAddress;
-            Entries64 = (UINT64*)(Rsdt + 1);
+            Entries32 = (UINT32*)(Rsdt + 1);
             Count = (Rsdt->Length - sizeof(EFI_ACPI_DESCRIPTION_HEADER)) / sizeof(UINT32);
         } else {
             return NULL;
@@ -56,6 +58,7 @@ void* GetAcpiTable(UINT32 Signature) {
         if (Table->Signature == Signature) {
             break;
         }
+        Table = NULL;
     }
 
     if (Table == NULL) {
@@ -85,3 +88,111 @@ void* GetAcpiTable(UINT32 Signature) {
         return Table;
     }
 }
+
+//----------------------------------------------------------------------------------------------------------------------
+// NUMA
+//----------------------------------------------------------------------------------------------------------------------
+
+static BOOLEAN mSratParsed = FALSE;
+static NUMA_MEMORY_RANGE* mNumaRanges = NULL;
+static UINTN mNumaRangeCount = 0;
+
+static EFI_ACPI_6_0_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER* GetSrat() {
+    return GetAcpiTable(EFI_ACPI_6_0_SYSTEM_RESOURCE_AFFINITY_TABLE_SIGNATURE);
+}
+
+/**
+ * Walk the entries of the SRAT, returns NULL once there are no more
+ */
+static UINT8* NextSratEntry(EFI_ACPI_6_0_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER* Srat, UINT8* Entry) {
+    UINT8* End = (UINT8*)Srat + Srat->Header.Length;
+    Entry = Entry == NULL ? (UINT8*)(Srat + 1) : Entry + Entry[1];
+
+    // a broken length would make us loop forever or run off the table
+    if (Entry + 2 > End || Entry[1] < 2 || Entry + Entry[1] > End) {
+        return NULL;
+    }
+    return Entry;
+}
+
+static void ParseSrat() {
+    mSratParsed = TRUE;
+
+    EFI_ACPI_6_0_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER* Srat = GetSrat();
+    if (Srat == NULL) {
+        return;
+    }
+
+    UINTN Count = 0;
+    for (UINT8* Entry = NextSratEntry(Srat, NULL); Entry != NULL; Entry = NextSratEntry(Srat, Entry)) {
+        if (Entry[0] == EFI_ACPI_6_0_MEMORY_AFFINITY) {
+            Count++;
+        }
+    }
+
+    mNumaRanges = AllocatePool(sizeof(NUMA_MEMORY_RANGE) * MAX(Count, 1));
+    if (mNumaRanges == NULL) {
+        return;
+    }
+
+    for (UINT8* Entry = NextSratEntry(Srat, NULL); Entry != NULL; Entry = NextSratEntry(Srat, Entry)) {
+        EFI_ACPI_6_0_MEMORY_AFFINITY_STRUCTURE* Memory = (EFI_ACPI_6_0_MEMORY_AFFINITY_STRUCTURE*)Entry;
+        if (Entry[0] != EFI_ACPI_6_0_MEMORY_AFFINITY || Entry[1] < sizeof(*Memory) || !(Memory->Flags & EFI_ACPI_6_0_MEMORY_ENABLED)) {
+            continue;
+        }
+
+        NUMA_MEMORY_RANGE* Range = &mNumaRanges[mNumaRangeCount++];
+        Range->Base = Memory->AddressBaseLow | LShiftU64(Memory->AddressBaseHigh, 32);
+        Range->Length = Memory->LengthLow | LShiftU64(Memory->LengthHigh, 32);
+        Range->Domain = Memory->ProximityDomain;
+    }
+}
+
+NUMA_MEMORY_RANGE* GetNumaMemoryRanges(UINTN* Count) {
+    if (!mSratParsed) {
+        ParseSrat();
+    }
+
+    *Count = mNumaRangeCount;
+    return mNumaRanges;
+}
+
+UINT32 GetProcessorDomain(UINT32 ApicId) {
+    EFI_ACPI_6_0_SYSTEM_RESOURCE_AFFINITY_TABLE_HEADER* Srat = GetSrat();
+    if (Srat == NULL) {
+        return NUMA_NO_DOMAIN;
+    }
+
+    for (UINT8* Entry = NextSratEntry(Srat, NULL); Entry != NULL; Entry = NextSratEntry(Srat, Entry)) {
+        if (Entry[0] == EFI_ACPI_6_0_PROCESSOR_LOCAL_APIC_SAPIC_AFFINITY && Entry[1] >= sizeof(EFI_ACPI_6_0_PROCESSOR_LOCAL_APIC_SAPIC_AFFINITY_STRUCTURE)) {
+            EFI_ACPI_6_0_PROCESSOR_LOCAL_APIC_SAPIC_AFFINITY_STRUCTURE* Apic = (EFI_ACPI_6_0_PROCESSOR_LOCAL_APIC_SAPIC_AFFINITY_STRUCTURE*)Entry;
+            if ((Apic->Flags & EFI_ACPI_6_0_PROCESSOR_LOCAL_APIC_SAPIC_ENABLED) && Apic->ApicId == ApicId) {
+                // the high bits of the domain were only added in acpi 3.0
+                UINT32 Domain = Apic->ProximityDomain7To0;
+                if (Srat->Header.Revision >= 2) {
+                    Domain |= Apic->ProximityDomain31To8[0] << 8 | Apic->ProximityDomain31To8[1] << 16 | (UINT32)Apic->ProximityDomain31To8[2] << 24;
+                }
+                return Domain;
+            }
+
+        } else if (Entry[0] == EFI_ACPI_6_0_PROCESSOR_LOCAL_X2APIC_AFFINITY && Entry[1] >= sizeof(EFI_ACPI_6_0_PROCESSOR_LOCAL_X2APIC_AFFINITY_STRUCTURE)) {
+            EFI_ACPI_6_0_PROCESSOR_LOCAL_X2APIC_AFFINITY_STRUCTURE* X2Apic = (EFI_ACPI_6_0_PROCESSOR_LOCAL_X2APIC_AFFINITY_STRUCTURE*)Entry;
+            if ((X2Apic->Flags & EFI_ACPI_6_0_PROCESSOR_LOCAL_APIC_SAPIC_ENABLED) && X2Apic->X2ApicId == ApicId) {
+                return X2Apic->ProximityDomain;
+            }
+        }
+    }
+
+    return NUMA_NO_DOMAIN;
+}
+
+UINT32 GetMemoryDomain(UINT64 Address) {
+    UINTN Count = 0;
+    NUMA_MEMORY_RANGE* Ranges = GetNumaMemoryRanges(&Count);
+    for (UINTN i = 0; i < Count; i++) {
+        if (Address >= Ranges[i].Base && Address - Ranges[i].Base < Ranges[i].Length) {
+            return Ranges[i].Domain;
+        }
+    }
+    return NUMA_NO_DOMAIN;
+}
@@ -1,8 +1,38 @@
 #ifndef TOMATOS_ACPIUTILS_H
 #define TOMATOS_ACPIUTILS_H
 
-#include <ProcessorBind.h>
+#include <Uefi.h>
 
 void* GetAcpiTable(UINT32 Signature);
 
+/**
+ * Memory and cpus the SRAT does not cover, or there is no SRAT at all
+ */
+#define NUMA_NO_DOMAIN MAX_UINT32
+
+/**
+ * A range of memory and the proximity domain it is in
+ */
+typedef struct _NUMA_MEMORY_RANGE {
+    UINT64 Base;
+    UINT64 Length;
+    UINT32 Domain;
+} NUMA_MEMORY_RANGE;
+
+/**
+ * The enabled memory affinity entries of the SRAT, the count is 0 if there
+ * is no SRAT. The SRAT is only parsed the first time
+ */
+NUMA_MEMORY_RANGE* GetNumaMemoryRanges(UINTN* Count);
+
+/**
+ * The proximity domain of a cpu from the processor affinity entries of the SRAT
+ */
+UINT32 GetProcessorDomain(UINT32 ApicId);
+
+/**
+ * The proximity domain the address is in
+ */
+UINT32 GetMemoryDomain(UINT64 Address);
+
 #endif //TOMATOS_ACPIUTILS_H
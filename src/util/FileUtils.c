@@ -10,7 +10,12 @@
 
 #include "Except.h"
 
-EFI_STATUS FileRead(EFI_FILE_HANDLE Handle, void* Buffer, UINTN Size, UINTN Offset) {
+#define FILE_READ_CHUNK_SIZE SIZE_1MB
+#define FILE_READ_MAX_QUEUE_DEPTH 32
+
+UINTN gFileReadQueueDepth = 8;
+
+static EFI_STATUS FileReadSync(EFI_FILE_HANDLE Handle, void* Buffer, UINTN Size, UINTN Offset) {
     EFI_STATUS Status = EFI_SUCCESS;
     UINTN ReadSize = Size;
 
@@ -21,3 +26,134 @@ EFI_STATUS FileRead(EFI_FILE_HANDLE Handle, void* Buffer, UINTN Size, UINTN Offs
 cleanup:
     return Status;
 }
+
+/**
+ * Split the read into chunks and keep up to gFileReadQueueDepth of them
+ * in flight using ReadEx, the filesystem driver passes them down to the
+ * DiskIo2/BlockIo2 layer so the device gets a queue instead of one read
+ * at a time.
+ *
+ * Returns EFI_UNSUPPORTED without reading anything if the driver does not
+ * support async reads, so the caller can fallback to the sync path.
+ */
+static EFI_STATUS FileReadAsync(EFI_FILE_HANDLE Handle, UINT8* Buffer, UINTN Size, UINTN Offset) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    EFI_FILE_IO_TOKEN Tokens[FILE_READ_MAX_QUEUE_DEPTH] = { 0 };
+    EFI_EVENT Events[FILE_READ_MAX_QUEUE_DEPTH] = { 0 };
+    UINTN ChunkSizes[FILE_READ_MAX_QUEUE_DEPTH] = { 0 };
+    UINTN Depth = MAX(1, MIN(gFileReadQueueDepth, FILE_READ_MAX_QUEUE_DEPTH));
+    UINTN InFlight = 0;
+    UINTN Submitted = 0;
+
+    for (int i = 0; i < Depth; i++) {
+        EFI_CHECK(gBS->CreateEvent(0, 0, NULL, NULL, &Events[i]));
+    }
+
+    while (Submitted < Size || InFlight > 0) {
+        // fill the queue
+        for (int i = 0; i < Depth && Submitted < Size; i++) {
+            if (Tokens[i].Buffer != NULL) {
+                continue;
+            }
+
+            ChunkSizes[i] = MIN(FILE_READ_CHUNK_SIZE, Size - Submitted);
+            Tokens[i].Event = Events[i];
+            Tokens[i].Status = EFI_SUCCESS;
+            Tokens[i].BufferSize = ChunkSizes[i];
+            Tokens[i].Buffer = Buffer + Submitted;
+
+            // the read starts from the current position, set it for every chunk
+            // instead of relying on the driver advancing it on submission
+            EFI_CHECK(FileHandleSetPosition(Handle, Offset + Submitted));
+            EFI_STATUS ReadStatus = Handle->ReadEx(Handle, &Tokens[i]);
+            if (EFI_ERROR(ReadStatus)) {
+                Tokens[i].Buffer = NULL;
+
+                // nothing was read yet, let the caller fallback quietly
+                if (ReadStatus == EFI_UNSUPPORTED && Submitted == 0) {
+                    Status = EFI_UNSUPPORTED;
+                    goto cleanup;
+                }
+            }
+            EFI_CHECK(ReadStatus);
+
+            Submitted += ChunkSizes[i];
+            InFlight++;
+        }
+
+        // wait for any of the reads to complete
+        UINTN Index = 0;
+        EFI_CHECK(gBS->WaitForEvent(Depth, Events, &Index));
+        CHECK(Tokens[Index].Buffer != NULL);
+
+        Tokens[Index].Buffer = NULL;
+        InFlight--;
+        EFI_CHECK(Tokens[Index].Status);
+        CHECK(Tokens[Index].BufferSize == ChunkSizes[Index]);
+    }
+
+cleanup:
+    // the tokens live on our stack, so we can not leave
+    // before all the reads we started are done
+    for (int i = 0; i < Depth; i++) {
+        if (Tokens[i].Buffer != NULL) {
+            UINTN Index = 0;
+            gBS->WaitForEvent(1, &Events[i], &Index);
+        }
+
+        if (Events[i] != NULL) {
+            gBS->CloseEvent(Events[i]);
+        }
+    }
+
+    return Status;
+}
+
+EFI_STATUS FileRead(EFI_FILE_HANDLE Handle, void* Buffer, UINTN Size, UINTN Offset) {
+    EFI_STATUS Status = EFI_SUCCESS;
+
+    CHECK(Handle != NULL);
+
+    // small reads are not worth the event setup
+    if (Handle->Revision >= EFI_FILE_PROTOCOL_REVISION2 && gFileReadQueueDepth > 1 && Size > FILE_READ_CHUNK_SIZE) {
+        Status = FileReadAsync(Handle, Buffer, Size, Offset);
+        if (Status != EFI_UNSUPPORTED) {
+            CHECK_AND_RETHROW(Status);
+            goto cleanup;
+        }
+    }
+
+    CHECK_AND_RETHROW(FileReadSync(Handle, Buffer, Size, Offset));
+
+cleanup:
+    return Status;
+}
+
+EFI_STATUS FileReadAll(EFI_FILE_HANDLE Handle, void** Buffer, UINTN* Size) {
+    EFI_STATUS Status = EFI_SUCCESS;
+    UINT8* Data = NULL;
+    UINT64 FileSize = 0;
+
+    CHECK(Buffer != NULL);
+    CHECK(Size != NULL);
+
+    // get the size and allocate room for the null terminator
+    EFI_CHECK(FileHandleGetSize(Handle, &FileSize));
+    Data = AllocatePool(FileSize + 1);
+    CHECK_ERROR(Data != NULL, EFI_OUT_OF_RESOURCES);
+
+    // read it all in one go
+    CHECK_AND_RETHROW(FileRead(Handle, Data, FileSize, 0));
+    Data[FileSize] = 0;
+
+    *Buffer = Data;
+    *Size = FileSize;
+    Data = NULL;
+
+cleanup:
+    if (Data != NULL) {
+        FreePool(Data);
+    }
+
+    return Status;
+}
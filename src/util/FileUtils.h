@@ -4,6 +4,24 @@
 #include <Uefi.h>
 #include <Protocol/SimpleFileSystem.h>
 
+/**
+ * How many chunks of a large read can be in flight at once, set from the
+ * config file, reads fallback to a single sync read if this is 1 or the
+ * filesystem does not support async io
+ */
+extern UINTN gFileReadQueueDepth;
+
+/**
+ * Read exactly Size bytes from the given offset, large reads are split and
+ * queued asynchronously when the filesystem supports it
+ */
 EFI_STATUS FileRead(EFI_FILE_HANDLE Handle, void* Buffer, UINTN Size, UINTN Offset);
 
+/**
+ * Read the whole file into a newly allocated pool buffer with a single read,
+ * the buffer is null terminated (not included in the size) so text files can
+ * be parsed in place
+ */
+EFI_STATUS FileReadAll(EFI_FILE_HANDLE Handle, void** Buffer, UINTN* Size);
+
 #endif //__UTIL_FILEUTILS_H__
@@ -0,0 +1,175 @@
+#include "PartitionIndex.h"
+#include "DPUtils.h"
+#include "Except.h"
+
+#include <Protocol/LoadedImage.h>
+#include <Library/UefiBootServicesTableLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/BaseMemoryLib.h>
+
+typedef struct _GUID_INDEX_ENTRY {
+    EFI_GUID Guid;
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Fs;
+} GUID_INDEX_ENTRY;
+
+typedef struct _NUMBER_INDEX_ENTRY {
+    UINTN PartitionNumber;
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Fs;
+} NUMBER_INDEX_ENTRY;
+
+/**
+ * Both indexes are open addressing hash tables with a power of two
+ * capacity, an entry with no Fs is empty
+ */
+static GUID_INDEX_ENTRY* mGuidIndex = NULL;
+static NUMBER_INDEX_ENTRY* mNumberIndex = NULL;
+static UINTN mIndexCapacity = 0;
+
+static UINTN HashGuid(EFI_GUID* Guid) {
+    UINT64* Parts = (UINT64*)Guid;
+    UINT64 Hash = (Parts[0] ^ (Parts[1] * 0x9E3779B97F4A7C15ull));
+    return (UINTN)(Hash ^ (Hash >> 29));
+}
+
+static UINTN HashNumber(UINTN Number) {
+    return (UINTN)(Number * 0x9E3779B97F4A7C15ull) >> 7;
+}
+
+static void InsertGuid(EFI_GUID* Guid, EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Fs) {
+    for (UINTN i = HashGuid(Guid); ; i++) {
+        GUID_INDEX_ENTRY* Entry = &mGuidIndex[i & (mIndexCapacity - 1)];
+        if (Entry->Fs == NULL) {
+            CopyGuid(&Entry->Guid, Guid);
+            Entry->Fs = Fs;
+            return;
+        } else if (CompareGuid(&Entry->Guid, Guid)) {
+            // keep the first one, that is how the linear search behaved
+            return;
+        }
+    }
+}
+
+static void InsertNumber(UINTN PartitionNumber, EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Fs) {
+    for (UINTN i = HashNumber(PartitionNumber); ; i++) {
+        NUMBER_INDEX_ENTRY* Entry = &mNumberIndex[i & (mIndexCapacity - 1)];
+        if (Entry->Fs == NULL) {
+            Entry->PartitionNumber = PartitionNumber;
+            Entry->Fs = Fs;
+            return;
+        } else if (Entry->PartitionNumber == PartitionNumber) {
+            return;
+        }
+    }
+}
+
+EFI_STATUS InitPartitionIndex() {
+    EFI_STATUS Status = EFI_SUCCESS;
+    EFI_LOADED_IMAGE_PROTOCOL* LoadedImage = NULL;
+    EFI_DEVICE_PATH* BootDevicePath = NULL;
+    EFI_DEVICE_PATH* BootDrivePath = NULL;
+    EFI_HANDLE* Handles = NULL;
+    UINTN HandleCount = 0;
+
+    // only build it once
+    if (mIndexCapacity != 0) {
+        goto cleanup;
+    }
+
+    // we need the boot drive device path so we can check which
+    // filesystems are on the boot drive, this is the path of the
+    // boot partition without the partition itself
+    EFI_CHECK(gBS->HandleProtocol(gImageHandle, &gEfiLoadedImageProtocolGuid, (void**)&LoadedImage));
+    EFI_CHECK(gBS->HandleProtocol(LoadedImage->DeviceHandle, &gEfiDevicePathProtocolGuid, (void**)&BootDevicePath));
+    BootDrivePath = RemoveLastDevicePathNode(BootDevicePath);
+    CHECK(BootDrivePath != NULL);
+
+    EFI_CHECK(gBS->LocateHandleBuffer(ByProtocol, &gEfiSimpleFileSystemProtocolGuid, NULL, &HandleCount, &Handles));
+
+    // keep the tables at most half full
+    mIndexCapacity = 16;
+    while (mIndexCapacity < HandleCount * 2) {
+        mIndexCapacity *= 2;
+    }
+    mGuidIndex = AllocateZeroPool(mIndexCapacity * sizeof(GUID_INDEX_ENTRY));
+    mNumberIndex = AllocateZeroPool(mIndexCapacity * sizeof(NUMBER_INDEX_ENTRY));
+    CHECK_ERROR(mGuidIndex != NULL && mNumberIndex != NULL, EFI_OUT_OF_RESOURCES);
+
+    for (int i = 0; i < HandleCount; i++) {
+        EFI_DEVICE_PATH* DevicePath = NULL;
+        EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* Fs = NULL;
+        if (EFI_ERROR(gBS->HandleProtocol(Handles[i], &gEfiDevicePathProtocolGuid, (void**)&DevicePath))) {
+            continue;
+        }
+        EFI_CHECK(gBS->HandleProtocol(Handles[i], &gEfiSimpleFileSystemProtocolGuid, (void**)&Fs));
+
+        // get the last one, and make sure it is of
+        // a harddrive part, since we are looking for
+        // partitions
+        EFI_DEVICE_PATH* LastNode = LastDevicePathNode(DevicePath);
+        if (LastNode == NULL || DevicePathType(LastNode) != MEDIA_DEVICE_PATH || DevicePathSubType(LastNode) != MEDIA_HARDDRIVE_DP) {
+            continue;
+        }
+        HARDDRIVE_DEVICE_PATH* Hd = (HARDDRIVE_DEVICE_PATH*)LastNode;
+
+        // index by the gpt partition guid
+        if (Hd->SignatureType == SIGNATURE_TYPE_GUID) {
+            InsertGuid((EFI_GUID*)Hd->Signature, Fs);
+        }
+
+        // index by the partition number if on the boot drive
+        if (InsideDevicePath(DevicePath, BootDrivePath)) {
+            InsertNumber(Hd->PartitionNumber, Fs);
+        }
+    }
+
+cleanup:
+    if (EFI_ERROR(Status)) {
+        if (mGuidIndex != NULL) {
+            FreePool(mGuidIndex);
+            mGuidIndex = NULL;
+        }
+
+        if (mNumberIndex != NULL) {
+            FreePool(mNumberIndex);
+            mNumberIndex = NULL;
+        }
+
+        mIndexCapacity = 0;
+    }
+
+    if (Handles != NULL) {
+        FreePool(Handles);
+    }
+
+    if (BootDrivePath != NULL) {
+        FreePool(BootDrivePath);
+    }
+
+    return Status;
+}
+
+EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* GetBootDrivePartitionFs(UINTN PartitionNumber) {
+    if (mIndexCapacity == 0) {
+        return NULL;
+    }
+
+    for (UINTN i = HashNumber(PartitionNumber); ; i++) {
+        NUMBER_INDEX_ENTRY* Entry = &mNumberIndex[i & (mIndexCapacity - 1)];
+        if (Entry->Fs == NULL || Entry->PartitionNumber == PartitionNumber) {
+            return Entry->Fs;
+        }
+    }
+}
+
+EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* GetPartitionFsByGuid(EFI_GUID* Guid) {
+    if (mIndexCapacity == 0) {
+        return NULL;
+    }
+
+    for (UINTN i = HashGuid(Guid); ; i++) {
+        GUID_INDEX_ENTRY* Entry = &mGuidIndex[i & (mIndexCapacity - 1)];
+        if (Entry->Fs == NULL || CompareGuid(&Entry->Guid, Guid)) {
+            return Entry->Fs;
+        }
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef __UTIL_PARTITIONINDEX_H__
+#define __UTIL_PARTITIONINDEX_H__
+
+#include <Uefi.h>
+#include <Protocol/SimpleFileSystem.h>
+
+/**
+ * Walk all the filesystems once and index them by their GPT partition
+ * guid and by their partition number on the boot drive, so resolving
+ * an URI does not need to go over all the handles again
+ */
+EFI_STATUS InitPartitionIndex();
+
+/**
+ * Get the filesystem of the given (1-based) partition on the boot drive,
+ * NULL if there is no such partition
+ */
+EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* GetBootDrivePartitionFs(UINTN PartitionNumber);
+
+/**
+ * Get the filesystem of the partition with the given guid,
+ * NULL if there is no such partition
+ */
+EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* GetPartitionFsByGuid(EFI_GUID* Guid);
+
+#endif //__UTIL_PARTITIONINDEX_H__
@@ -0,0 +1,313 @@
+#include "TaskRuntime.h"
+#include "Except.h"
+
+#include <Protocol/MpService.h>
+#include <Library/BaseLib.h>
+#include <Library/LocalApicLib.h>
+#include <Library/BaseMemoryLib.h>
+#include <Library/SynchronizationLib.h>
+#include <Library/MemoryAllocationLib.h>
+#include <Library/UefiBootServicesTableLib.h>
+
+/**
+ * How many tasks can wait in a single queue, must be a power of two
+ */
+#define TASK_QUEUE_SIZE 256
+
+/**
+ * Memory operations are split into chunks of this size, and
+ * anything smaller than two chunks is not worth splitting
+ */
+#define TASK_MEM_CHUNK_SIZE SIZE_1MB
+
+typedef struct _TASK {
+    TASK_FUNCTION Function;
+    void* Context;
+    UINTN Index;
+    TASK_GROUP* Group;
+} TASK;
+
+/**
+ * The owner pushes and pops at the bottom, thieves take from the top
+ */
+typedef struct _TASK_QUEUE {
+    SPIN_LOCK Lock;
+    UINT32 ApicId;
+    UINTN Top;
+    UINTN Bottom;
+    TASK Tasks[TASK_QUEUE_SIZE];
+} TASK_QUEUE;
+
+/**
+ * Queue 0 belongs to the BSP, the rest are taken by the APs as they come up
+ */
+static TASK_QUEUE* mQueues = NULL;
+static UINTN mQueueCount = 0;
+static volatile UINT32 mNextWorker = 0;
+static UINTN mNextQueue = 0;
+static volatile BOOLEAN mStopWorkers = FALSE;
+static BOOLEAN mRunning = FALSE;
+static EFI_EVENT mWorkersDone = NULL;
+
+static void LockQueue(TASK_QUEUE* Queue) {
+    while (!AcquireSpinLockOrFail(&Queue->Lock)) {
+        CpuPause();
+    }
+}
+
+static BOOLEAN PushTask(TASK_QUEUE* Queue, TASK* Task) {
+    BOOLEAN Pushed = FALSE;
+    LockQueue(Queue);
+    if (Queue->Bottom - Queue->Top < TASK_QUEUE_SIZE) {
+        TASK* Slot = &Queue->Tasks[Queue->Bottom & (TASK_QUEUE_SIZE - 1)];
+        Slot->Function = Task->Function;
+        Slot->Context = Task->Context;
+        Slot->Index = Task->Index;
+        Slot->Group = Task->Group;
+        Queue->Bottom++;
+        Pushed = TRUE;
+    }
+    ReleaseSpinLock(&Queue->Lock);
+    return Pushed;
+}
+
+static BOOLEAN TakeTask(TASK_QUEUE* Queue, TASK* Task, BOOLEAN Steal) {
+    BOOLEAN Taken = FALSE;
+    LockQueue(Queue);
+    if (Queue->Bottom != Queue->Top) {
+        TASK* Slot;
+        if (Steal) {
+            Slot = &Queue->Tasks[Queue->Top & (TASK_QUEUE_SIZE - 1)];
+            Queue->Top++;
+        } else {
+            Queue->Bottom--;
+            Slot = &Queue->Tasks[Queue->Bottom & (TASK_QUEUE_SIZE - 1)];
+        }
+        Task->Function = Slot->Function;
+        Task->Context = Slot->Context;
+        Task->Index = Slot->Index;
+        Task->Group = Slot->Group;
+        Taken = TRUE;
+    }
+    ReleaseSpinLock(&Queue->Lock);
+    return Taken;
+}
+
+/**
+ * Take from our own queue first, then go over the others
+ */
+static BOOLEAN FindTask(UINTN Self, TASK* Task) {
+    if (TakeTask(&mQueues[Self], Task, FALSE)) {
+        return TRUE;
+    }
+
+    for (UINTN i = 1; i < mQueueCount; i++) {
+        if (TakeTask(&mQueues[(Self + i) % mQueueCount], Task, TRUE)) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+static void RunTask(TASK* Task) {
+    Task->Function(Task->Context, Task->Index);
+    InterlockedDecrement(&Task->Group->Pending);
+}
+
+/**
+ * Find the queue of the cpu we are running on, the BSP is checked first
+ */
+static UINTN CurrentQueue() {
+    UINT32 ApicId = GetApicId();
+    for (UINTN i = 0; i < mQueueCount; i++) {
+        if (mQueues[i].ApicId == ApicId) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+static void EFIAPI TaskWorker(void* Argument) {
+    UINTN Self = InterlockedIncrement(&mNextWorker);
+    if (Self >= mQueueCount) {
+        return;
+    }
+    mQueues[Self].ApicId = GetApicId();
+
+    TASK Task;
+    while (!mStopWorkers) {
+        if (FindTask(Self, &Task)) {
+            RunTask(&Task);
+        } else {
+            CpuPause();
+        }
+    }
+}
+
+EFI_STATUS StartTaskRuntime() {
+    EFI_STATUS Status = EFI_SUCCESS;
+    EFI_MP_SERVICES_PROTOCOL* MpServices = NULL;
+    UINTN ProcessorCount = 0;
+    UINTN EnabledCount = 0;
+
+    if (mRunning) {
+        goto cleanup;
+    }
+
+    // no MP services or no APs is fine, we just run everything in place
+    if (EFI_ERROR(gBS->LocateProtocol(&gEfiMpServiceProtocolGuid, NULL, (void**)&MpServices))) {
+        TRACE("No MP services, tasks will run on the BSP");
+        goto cleanup;
+    }
+    EFI_CHECK(MpServices->GetNumberOfProcessors(MpServices, &ProcessorCount, &EnabledCount));
+    if (EnabledCount <= 1) {
+        goto cleanup;
+    }
+
+    mQueueCount = EnabledCount;
+    mQueues = AllocateZeroPool(sizeof(TASK_QUEUE) * mQueueCount);
+    CHECK_ERROR(mQueues != NULL, EFI_OUT_OF_RESOURCES);
+    for (UINTN i = 0; i < mQueueCount; i++) {
+        InitializeSpinLock(&mQueues[i].Lock);
+        mQueues[i].ApicId = MAX_UINT32;
+    }
+    mQueues[0].ApicId = GetApicId();
+
+    mNextWorker = 0;
+    mNextQueue = 0;
+    mStopWorkers = FALSE;
+
+    // the workers only return once we tell them to, so start
+    // them without blocking and keep the event to wait on them
+    EFI_CHECK(gBS->CreateEvent(0, 0, NULL, NULL, &mWorkersDone));
+    EFI_CHECK(MpServices->StartupAllAPs(MpServices, TaskWorker, FALSE, mWorkersDone, 0, NULL, NULL));
+
+    TRACE("Task runtime started on %d cpus", mQueueCount);
+    mRunning = TRUE;
+
+cleanup:
+    if (!mRunning) {
+        if (mWorkersDone != NULL) {
+            gBS->CloseEvent(mWorkersDone);
+            mWorkersDone = NULL;
+        }
+        if (mQueues != NULL) {
+            FreePool(mQueues);
+            mQueues = NULL;
+        }
+        mQueueCount = 0;
+    }
+    return Status;
+}
+
+void StopTaskRuntime() {
+    UINTN Index = 0;
+
+    if (!mRunning) {
+        return;
+    }
+
+    mStopWorkers = TRUE;
+    gBS->WaitForEvent(1, &mWorkersDone, &Index);
+    gBS->CloseEvent(mWorkersDone);
+    mWorkersDone = NULL;
+
+    FreePool(mQueues);
+    mQueues = NULL;
+    mQueueCount = 0;
+    mRunning = FALSE;
+}
+
+void SubmitTask(TASK_GROUP* Group, TASK_FUNCTION Function, void* Context, UINTN Index) {
+    TASK Task = {
+        .Function = Function,
+        .Context = Context,
+        .Index = Index,
+        .Group = Group
+    };
+
+    InterlockedIncrement(&Group->Pending);
+
+    if (mRunning) {
+        // the BSP spreads its tasks over all the queues, the
+        // workers keep whatever they submit to themselves
+        UINTN Self = CurrentQueue();
+        if (Self == 0) {
+            Self = mNextQueue++ % mQueueCount;
+        }
+
+        if (PushTask(&mQueues[Self], &Task)) {
+            return;
+        }
+    }
+
+    RunTask(&Task);
+}
+
+void JoinTaskGroup(TASK_GROUP* Group) {
+    TASK Task;
+
+    if (!mRunning) {
+        return;
+    }
+
+    UINTN Self = CurrentQueue();
+    while (Group->Pending != 0) {
+        if (FindTask(Self, &Task)) {
+            RunTask(&Task);
+        } else {
+            CpuPause();
+        }
+    }
+}
+
+void ParallelFor(TASK_FUNCTION Function, void* Context, UINTN Count) {
+    TASK_GROUP Group = { 0 };
+    for (UINTN i = 0; i < Count; i++) {
+        SubmitTask(&Group, Function, Context, i);
+    }
+    JoinTaskGroup(&Group);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Memory operations
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+typedef struct _MEM_TASK {
+    UINT8* Destination;
+    const UINT8* Source;
+    UINTN Size;
+} MEM_TASK;
+
+static void ZeroMemChunk(void* Context, UINTN Index) {
+    MEM_TASK* Mem = Context;
+    UINTN Offset = Index * TASK_MEM_CHUNK_SIZE;
+    ZeroMem(Mem->Destination + Offset, MIN(TASK_MEM_CHUNK_SIZE, Mem->Size - Offset));
+}
+
+static void CopyMemChunk(void* Context, UINTN Index) {
+    MEM_TASK* Mem = Context;
+    UINTN Offset = Index * TASK_MEM_CHUNK_SIZE;
+    CopyMem(Mem->Destination + Offset, Mem->Source + Offset, MIN(TASK_MEM_CHUNK_SIZE, Mem->Size - Offset));
+}
+
+void ParallelZeroMem(void* Buffer, UINTN Size) {
+    if (!mRunning || Size < TASK_MEM_CHUNK_SIZE * 2) {
+        ZeroMem(Buffer, Size);
+        return;
+    }
+
+    MEM_TASK Mem = { .Destination = Buffer, .Source = NULL, .Size = Size };
+    ParallelFor(ZeroMemChunk, &Mem, (Size + TASK_MEM_CHUNK_SIZE - 1) / TASK_MEM_CHUNK_SIZE);
+}
+
+void ParallelCopyMem(void* Destination, const void* Source, UINTN Size) {
+    if (!mRunning || Size < TASK_MEM_CHUNK_SIZE * 2) {
+        CopyMem(Destination, Source, Size);
+        return;
+    }
+
+    MEM_TASK Mem = { .Destination = Destination, .Source = Source, .Size = Size };
+    ParallelFor(CopyMemChunk, &Mem, (Size + TASK_MEM_CHUNK_SIZE - 1) / TASK_MEM_CHUNK_SIZE);
+}
@@ -0,0 +1,57 @@
+#ifndef __UTIL_TASKRUNTIME_H__
+#define __UTIL_TASKRUNTIME_H__
+
+#include <Uefi.h>
+
+/**
+ * A task, gets the context and index it was submitted with.
+ *
+ * Tasks may run on an AP, so they must not call any boot service
+ * (that includes allocating, printing and tracing)
+ */
+typedef void (*TASK_FUNCTION)(void* Context, UINTN Index);
+
+/**
+ * Counts the tasks that were submitted to it and did not finish yet
+ */
+typedef struct _TASK_GROUP {
+    volatile UINT32 Pending;
+} TASK_GROUP;
+
+/**
+ * Start a worker on every enabled AP, each one has its own task queue and
+ * steals from the others once it runs dry.
+ *
+ * If there are no MP services or no APs everything just runs on the BSP
+ */
+EFI_STATUS StartTaskRuntime();
+
+/**
+ * Stop the workers and give the APs back to the firmware, must be
+ * called before ExitBootServices
+ */
+void StopTaskRuntime();
+
+/**
+ * Queue a task in the group, runs it right away if it can not be queued
+ */
+void SubmitTask(TASK_GROUP* Group, TASK_FUNCTION Function, void* Context, UINTN Index);
+
+/**
+ * Help running tasks until all the tasks of the group are done
+ */
+void JoinTaskGroup(TASK_GROUP* Group);
+
+/**
+ * Run the function for every index in [0, Count) and wait for all of them
+ */
+void ParallelFor(TASK_FUNCTION Function, void* Context, UINTN Count);
+
+/**
+ * ZeroMem/CopyMem split into chunks which are spread over the workers,
+ * the buffers of the copy must not overlap
+ */
+void ParallelZeroMem(void* Buffer, UINTN Size);
+void ParallelCopyMem(void* Destination, const void* Source, UINTN Size);
+
+#endif //__UTIL_TASKRUNTIME_H__
@@ -0,0 +1,84 @@
+#include "Timeline.h"
+
+#include <Library/IoLib.h>
+#include <Library/BaseLib.h>
+#include <Library/PrintLib.h>
+#include <uefi/AcpiTimerLib.h>
+
+#define DEBUGCON_PORT 0xE9
+#define COM1_PORT 0x3F8
+
+static TIMELINE_ENTRY mEntries[TIMELINE_MAX_ENTRIES];
+static UINTN mEntryCount = 0;
+static UINT64 mStartTsc = 0;
+static UINT64 mTscFrequency = 0;
+
+void StartTimeline() {
+    mStartTsc = AsmReadTsc();
+}
+
+void CalibrateTimeline() {
+    mTscFrequency = GetTimerTscFrequency();
+}
+
+UINTN TimelineBegin(CONST CHAR8* Name) {
+    if (mEntryCount == TIMELINE_MAX_ENTRIES) {
+        return MAX_UINTN;
+    }
+
+    TIMELINE_ENTRY* Entry = &mEntries[mEntryCount];
+    AsciiStrnCpyS(Entry->Name, sizeof(Entry->Name), Name, sizeof(Entry->Name) - 1);
+    Entry->Start = AsmReadTsc();
+    Entry->End = 0;
+    return mEntryCount++;
+}
+
+void TimelineEnd(UINTN Phase) {
+    if (Phase < mEntryCount) {
+        mEntries[Phase].End = AsmReadTsc();
+    }
+}
+
+UINT64 GetTscFrequency() {
+    return mTscFrequency;
+}
+
+UINTN GetTimelineEntries(TIMELINE_ENTRY** Entries) {
+    *Entries = mEntries;
+    return mEntryCount;
+}
+
+static UINT64 TscToMicroSeconds(UINT64 Tsc) {
+    if (mTscFrequency == 0 || Tsc < mStartTsc) {
+        return 0;
+    }
+    return DivU64x64Remainder(MultU64x32(Tsc - mStartTsc, 1000000), mTscFrequency, NULL);
+}
+
+static void WriteString(CONST CHAR8* String) {
+    for (; *String != '\0'; String++) {
+        IoWrite8(DEBUGCON_PORT, *String);
+
+        // wait for the transmit holding register, but don't get
+        // stuck if there is nothing behind the port
+        for (UINTN Timeout = 0; Timeout < 10000 && !(IoRead8(COM1_PORT + 5) & BIT5); Timeout++) {
+            CpuPause();
+        }
+        IoWrite8(COM1_PORT, *String);
+    }
+}
+
+void DumpTimeline() {
+    CHAR8 Line[128];
+
+    AsciiSPrint(Line, sizeof(Line), "TomatBoot timeline (TSC at %ld Hz):\r\n", mTscFrequency);
+    WriteString(Line);
+
+    for (UINTN i = 0; i < mEntryCount; i++) {
+        TIMELINE_ENTRY* Entry = &mEntries[i];
+        UINT64 Start = TscToMicroSeconds(Entry->Start);
+        UINT64 End = Entry->End != 0 ? TscToMicroSeconds(Entry->End) : Start;
+        AsciiSPrint(Line, sizeof(Line), "  %-24a %10ldus +%ldus\r\n", Entry->Name, Start, End - Start);
+        WriteString(Line);
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef __UTIL_TIMELINE_H__
+#define __UTIL_TIMELINE_H__
+
+#include <Uefi.h>
+
+#define TIMELINE_MAX_ENTRIES 64
+#define TIMELINE_NAME_SIZE 24
+
+/**
+ * A single phase of the boot, the times are raw TSC values
+ */
+typedef struct _TIMELINE_ENTRY {
+    CHAR8 Name[TIMELINE_NAME_SIZE];
+    UINT64 Start;
+    UINT64 End;
+} TIMELINE_ENTRY;
+
+/**
+ * Take the TSC at the entry of the loader, should be the first thing we do
+ */
+void StartTimeline();
+
+/**
+ * Take the TSC frequency the timer lib found, needs the
+ * timer lib to be initialized
+ */
+void CalibrateTimeline();
+
+/**
+ * Start a phase with the given name (truncated to fit), returns
+ * the handle to pass to TimelineEnd.
+ *
+ * Does not use any boot service so it is fine to call after ExitBootServices
+ */
+UINTN TimelineBegin(CONST CHAR8* Name);
+
+/**
+ * End the phase returned by TimelineBegin
+ */
+void TimelineEnd(UINTN Phase);
+
+/**
+ * The calibrated TSC frequency in Hz, 0 if not calibrated
+ */
+UINT64 GetTscFrequency();
+
+/**
+ * Get the recorded entries, returns how many there are
+ */
+UINTN GetTimelineEntries(TIMELINE_ENTRY** Entries);
+
+/**
+ * Write the timeline to debugcon (port 0xE9) and COM1, does not
+ * use any boot service
+ */
+void DumpTimeline();
+
+#endif //__UTIL_TIMELINE_H__